@@ -8,7 +8,7 @@
 
 #include "FileHandlingException.h"
 
-class CleaningFailedException : FileHandlingException {
+class CleaningFailedException : public FileHandlingException {
     using FileHandlingException::FileHandlingException;
 };
 
@@ -8,7 +8,7 @@
 
 #include "FileHandlingException.h"
 
-class CopyToCacheFailedException : FileHandlingException {
+class CopyToCacheFailedException : public FileHandlingException {
     using FileHandlingException::FileHandlingException;
 };
 
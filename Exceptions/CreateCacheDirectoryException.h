@@ -8,7 +8,7 @@
 
 #include "FileHandlingException.h"
 
-class CreateCacheDirectoryException: FileHandlingException {
+class CreateCacheDirectoryException: public FileHandlingException {
     using FileHandlingException::FileHandlingException;
 };
 
@@ -0,0 +1,11 @@
+#ifndef CADIR3_DAEMONEXCEPTION_H
+#define CADIR3_DAEMONEXCEPTION_H
+
+#include "CadirException.h"
+
+class DaemonException : public CadirException {
+    using CadirException::CadirException;
+};
+
+
+#endif //CADIR3_DAEMONEXCEPTION_H
@@ -7,7 +7,7 @@
 
 #include "FileHandlingException.h"
 
-class FinalizeCommandException : FileHandlingException {
+class FinalizeCommandException : public FileHandlingException {
     using FileHandlingException::FileHandlingException;
 };
 
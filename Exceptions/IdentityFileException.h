@@ -0,0 +1,11 @@
+#ifndef CADIR3_IDENTITYFILEEXCEPTION_H
+#define CADIR3_IDENTITYFILEEXCEPTION_H
+
+#include "CadirException.h"
+
+class IdentityFileException : public CadirException {
+    using CadirException::CadirException;
+};
+
+
+#endif //CADIR3_IDENTITYFILEEXCEPTION_H
@@ -0,0 +1,11 @@
+#ifndef CADIR3_MANIFESTEXCEPTION_H
+#define CADIR3_MANIFESTEXCEPTION_H
+
+#include "CadirException.h"
+
+class ManifestException : public CadirException {
+    using CadirException::CadirException;
+};
+
+
+#endif //CADIR3_MANIFESTEXCEPTION_H
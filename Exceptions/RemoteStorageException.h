@@ -0,0 +1,11 @@
+#ifndef CADIR3_REMOTESTORAGEEXCEPTION_H
+#define CADIR3_REMOTESTORAGEEXCEPTION_H
+
+#include "CadirException.h"
+
+class RemoteStorageException : public CadirException {
+    using CadirException::CadirException;
+};
+
+
+#endif //CADIR3_REMOTESTORAGEEXCEPTION_H
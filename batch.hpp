@@ -0,0 +1,83 @@
+#pragma once //"batch.hpp"
+
+#include <fstream>
+#include <functional>
+#include <string>
+#include <vector>
+#include "Exceptions/CadirException.h"
+#include "Exceptions/ManifestException.h"
+#include "exitCodeEnum.hpp"
+#include "workerPool.hpp"
+#include "trace.hpp"
+
+/**
+ * Batch mode runs many jobs in one invocation. A manifest has the job options of one job per line, written
+ * like on the command line, e.g.
+ *
+ *   --cache-source=packages/a/vendor --identity-file=packages/a/composer.lock --setup="composer install"
+ *
+ * Empty lines and lines starting with # are skipped.
+ */
+namespace batch {
+    // setup commands usually saturate the machine on their own
+    const unsigned int defaultSetupJobs = 2;
+
+    std::vector<std::string> readManifest(const std::string &manifestFile) {
+        std::ifstream manifest(manifestFile);
+        if (!manifest.good()) {
+            throw (ManifestException("Cannot read manifest " + manifestFile, ExitCode::argumentParsingFailed));
+        }
+
+        std::vector<std::string> lines;
+        std::string line;
+        while (std::getline(manifest, line)) {
+            size_t start = line.find_first_not_of(" \t\r");
+            if (start == std::string::npos || line[start] == '#')
+                continue;
+
+            lines.push_back(line.substr(start, line.find_last_not_of(" \t\r") + 1 - start));
+        }
+
+        return lines;
+    }
+
+    /**
+     * Runs start(job) for every job on a pool of jobs threads. If the entry of the job is missing start
+     * returns the build, which runs on a pool of setupJobs threads, so restores are not held up by setups.
+     * Returns the exit code of every job.
+     */
+    std::vector<int> run(size_t jobCount, unsigned int jobs, unsigned int setupJobs,
+                         const std::function<std::function<void()>(size_t)> &start) {
+        std::vector<int> exitCodes(jobCount, ExitCode::ok);
+
+        auto runJob = [&exitCodes](size_t job, const std::function<void()> &task) {
+            try {
+                task();
+            } catch (CadirException &exception) {
+                trace(exception.what());
+                exitCodes[job] = exception.getErrorCode();
+            } catch (std::exception &exception) {
+                trace(exception.what());
+                exitCodes[job] = ExitCode::copyToCacheFailed;
+            }
+        };
+
+        {
+            WorkerPool setupPool(setupJobs);
+            WorkerPool pool(jobs);
+
+            for (size_t job = 0; job < jobCount; job++) {
+                pool.submit([&runJob, &setupPool, &start, job] {
+                    std::function<void()> build;
+                    runJob(job, [&build, &start, job] { build = start(job); });
+
+                    if (build) {
+                        setupPool.submit([&runJob, build, job] { runJob(job, build); });
+                    }
+                });
+            }
+        }
+
+        return exitCodes;
+    }
+}
@@ -0,0 +1,508 @@
+#pragma once //"cacheIndex.hpp"
+
+#include <config.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "cacheLayout.hpp"
+#include "keyLock.hpp"
+#include "workerPool.hpp"
+
+/**
+ * Index of the entries of a cache destination, so sizes and eviction do not need to walk the entries.
+ * The index file is a header followed by fixed size records, one per entry, which is memory mapped:
+ *
+ * - reading the whole index is one mapping of one file,
+ * - restores update the last access and the hit count of their record in place with atomic operations,
+ *   under the shared index lock,
+ * - stores and removals take the exclusive index lock, they fill a free record or grow the file.
+ *
+ * The first store creates the index, a file in an older format is replaced. Entries stored before, or by
+ * tools which do not know the index, are measured and added by reconcile().
+ */
+namespace cacheIndex {
+    const char magic[8] = {'C', 'A', 'D', 'I', 'R', 'I', 'X', '1'};
+    // records added at once when the index is full
+    const size_t growRecords = 64;
+
+    enum Format : uint8_t {
+        unused = 0,
+        directory = 1,
+        gzipArchive = 2,
+        chunkedArchive = 3
+    };
+
+    struct Header {
+        char magic[8];
+        uint32_t recordSize;
+        uint32_t reserved;
+    };
+
+    struct Record {
+        char key[cacheLayout::entryKeyLength];
+        uint8_t format;
+        uint8_t reserved[7];
+        uint64_t bytes;
+        uint64_t files;
+        int64_t created;
+        int64_t lastAccess;
+        uint64_t hits;
+        // duration of the setup command which built the entry, the cost of a rebuild
+        uint64_t setupMilliseconds;
+    };
+
+    static_assert(sizeof(Record) % 8 == 0, "records must keep their fields aligned");
+
+    struct Size {
+        uintmax_t bytes = 0;
+        uintmax_t files = 0;
+    };
+
+    struct Entry {
+        Size size;
+        time_t created = 0;
+        time_t lastAccess = 0;
+        uint64_t hits = 0;
+        double setupSeconds = 0;
+    };
+
+    // by entry name, which is the key and the extension of the format
+    using Entries = std::map<std::string, Entry>;
+
+    std::string extension(uint8_t format) {
+        switch (format) {
+            case gzipArchive:
+                return ".tar.gz";
+            case chunkedArchive:
+                return cacheLayout::chunkedExtension;
+            default:
+                return "";
+        }
+    }
+
+    std::string entryName(const Record &record) {
+        return std::string(record.key, cacheLayout::entryKeyLength) + extension(record.format);
+    }
+
+    // false for names which are no entry of a known format
+    bool parseName(const std::string &name, char (&key)[cacheLayout::entryKeyLength], uint8_t &format) {
+        if (!cacheLayout::isEntryName(name))
+            return false;
+
+        const std::string suffix = name.substr(cacheLayout::entryKeyLength);
+        if (suffix.empty())
+            format = directory;
+        else if (suffix == extension(gzipArchive))
+            format = gzipArchive;
+        else if (suffix == extension(chunkedArchive))
+            format = chunkedArchive;
+        else
+            return false;
+
+        memcpy(key, name.data(), cacheLayout::entryKeyLength);
+
+        return true;
+    }
+
+    /**
+     * The stored chunks of a manifest, "<hash> <size> <stored size>" per line after its header. Chunks shared
+     * with other entries are counted for each of them.
+     */
+    Size measureChunks(const stdfs::path &manifestPath) {
+        Size size;
+        std::ifstream manifest(manifestPath);
+        std::string line;
+
+        std::getline(manifest, line);
+        while (std::getline(manifest, line)) {
+            std::istringstream fields(line);
+            std::string hash;
+            uintmax_t chunkSize = 0;
+            uintmax_t storedSize = 0;
+            if (fields >> hash >> chunkSize >> storedSize) {
+                size.bytes += storedSize;
+                size.files++;
+            }
+        }
+
+        return size;
+    }
+
+    Size measure(const stdfs::path &entryPath) {
+        Size size;
+        std::error_code errorCode;
+
+        // temporary entries are named <entry name>.<pid>.<sequence>
+        if (entryPath.filename().u8string().find(cacheLayout::chunkedExtension) != std::string::npos &&
+            stdfs::is_regular_file(entryPath, errorCode))
+            return measureChunks(entryPath);
+
+        if (!stdfs::is_directory(entryPath, errorCode)) {
+            uintmax_t bytes = stdfs::file_size(entryPath, errorCode);
+            if (!errorCode) {
+                size.bytes = bytes;
+                size.files = 1;
+            }
+
+            return size;
+        }
+
+        for (stdfs::recursive_directory_iterator iterator(entryPath, errorCode), end;
+             !errorCode && iterator != end; iterator.increment(errorCode)) {
+            if (iterator->is_regular_file(errorCode)) {
+                size.bytes += iterator->file_size(errorCode);
+                size.files++;
+            }
+        }
+
+        return size;
+    }
+
+    /**
+     * The index file mapped under the index lock, both are released when the object is destroyed.
+     */
+    class MappedIndex {
+    public:
+        /**
+         * Maps the index. With create a missing index or one in an older format is replaced by an empty
+         * one, which needs the exclusive lock. isOpen() tells whether it worked.
+         */
+        MappedIndex(const std::string &cacheDestination, bool exclusive, bool create = false) {
+            std::error_code errorCode;
+            stdfs::create_directories(cacheLayout::lockDirectory(cacheDestination), errorCode);
+
+            indexLock = std::make_unique<KeyLock>(cacheLayout::indexLockFile(cacheDestination));
+            // updates are short, only the first scan takes long
+            if (!(exclusive ? indexLock->lockExclusive(60) : indexLock->lockShared(60)))
+                return;
+
+            const std::string indexFile = cacheLayout::indexFile(cacheDestination);
+            fileDescriptor = open(indexFile.c_str(), O_RDWR | (create ? O_CREAT : 0) | O_CLOEXEC, 0666);
+            if (fileDescriptor < 0 || map() || !create)
+                return;
+
+            Header header{};
+            memcpy(header.magic, magic, sizeof(magic));
+            header.recordSize = sizeof(Record);
+            if (ftruncate(fileDescriptor, 0) != 0 ||
+                pwrite(fileDescriptor, &header, sizeof(header), 0) != (ssize_t) sizeof(header))
+                return;
+
+            map();
+        }
+
+        MappedIndex(const MappedIndex &) = delete;
+
+        MappedIndex &operator=(const MappedIndex &) = delete;
+
+        ~MappedIndex() {
+            unmap();
+            if (fileDescriptor >= 0)
+                close(fileDescriptor);
+        }
+
+        bool isOpen() const {
+            return mapping != nullptr;
+        }
+
+        size_t count() const {
+            return recordCount;
+        }
+
+        Record *records() {
+            return reinterpret_cast<Record *>(static_cast<char *>(mapping) + sizeof(Header));
+        }
+
+        Record *find(const std::string &name) {
+            char key[cacheLayout::entryKeyLength];
+            uint8_t format = unused;
+            if (!isOpen() || !parseName(name, key, format))
+                return nullptr;
+
+            for (size_t i = 0; i < recordCount; i++) {
+                if (records()[i].format == format && memcmp(records()[i].key, key, sizeof(key)) == 0)
+                    return &records()[i];
+            }
+
+            return nullptr;
+        }
+
+        /**
+         * The record of the entry, a new one if it has none. Needs the exclusive lock.
+         */
+        Record *add(const std::string &name) {
+            char key[cacheLayout::entryKeyLength];
+            uint8_t format = unused;
+            if (!isOpen() || !parseName(name, key, format))
+                return nullptr;
+
+            Record *record = find(name);
+            for (size_t i = 0; record == nullptr && i < recordCount; i++) {
+                if (records()[i].format == unused)
+                    record = &records()[i];
+            }
+
+            if (record == nullptr) {
+                size_t used = recordCount;
+                if (ftruncate(fileDescriptor, sizeof(Header) + (recordCount + growRecords) * sizeof(Record)) != 0)
+                    return nullptr;
+                unmap();
+                if (!map())
+                    return nullptr;
+                record = &records()[used];
+            }
+
+            memset(record, 0, sizeof(Record));
+            memcpy(record->key, key, sizeof(key));
+            record->format = format;
+
+            return record;
+        }
+
+    private:
+        std::unique_ptr<KeyLock> indexLock;
+        int fileDescriptor = -1;
+        void *mapping = nullptr;
+        size_t mappingSize = 0;
+        size_t recordCount = 0;
+
+        bool map() {
+            struct stat status{};
+            if (fstat(fileDescriptor, &status) != 0 || (size_t) status.st_size < sizeof(Header))
+                return false;
+
+            void *mapped = mmap(nullptr, status.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fileDescriptor, 0);
+            if (mapped == MAP_FAILED)
+                return false;
+
+            const Header *header = static_cast<const Header *>(mapped);
+            if (memcmp(header->magic, magic, sizeof(magic)) != 0 || header->recordSize != sizeof(Record)) {
+                munmap(mapped, status.st_size);
+                return false;
+            }
+
+            mapping = mapped;
+            mappingSize = status.st_size;
+            recordCount = (mappingSize - sizeof(Header)) / sizeof(Record);
+
+            return true;
+        }
+
+        void unmap() {
+            if (mapping != nullptr)
+                munmap(mapping, mappingSize);
+            mapping = nullptr;
+        }
+    };
+
+    // the first store creates the index, entries stored before are added by reconcile()
+    bool recordStore(const std::string &cacheDestination, const std::string &name, const Size &size) {
+        MappedIndex index(cacheDestination, true, true);
+        Record *record = index.add(name);
+        if (record == nullptr)
+            return false;
+
+        record->bytes = size.bytes;
+        record->files = size.files;
+        record->created = time(nullptr);
+        record->lastAccess = record->created;
+
+        return true;
+    }
+
+    /**
+     * Records the entry which replaces previous in another format. It keeps the age, last use and setup
+     * time of previous, its hits start over so the new format has to earn them.
+     */
+    bool recordMigration(const std::string &cacheDestination, const std::string &name, const Size &size,
+                         const Entry &previous) {
+        MappedIndex index(cacheDestination, true, true);
+        Record *record = index.add(name);
+        if (record == nullptr)
+            return false;
+
+        record->bytes = size.bytes;
+        record->files = size.files;
+        record->created = previous.created;
+        record->lastAccess = previous.lastAccess;
+        record->hits = 0;
+        record->setupMilliseconds = (uint64_t) (previous.setupSeconds * 1000);
+
+        return true;
+    }
+
+    // concurrent restores of the entry update the same record, both only under the shared lock
+    bool recordAccess(const std::string &cacheDestination, const std::string &name) {
+        MappedIndex index(cacheDestination, false);
+        Record *record = index.find(name);
+        if (record == nullptr)
+            return false;
+
+        __atomic_store_n(&record->lastAccess, (int64_t) time(nullptr), __ATOMIC_RELAXED);
+        __atomic_add_fetch(&record->hits, 1, __ATOMIC_RELAXED);
+
+        return true;
+    }
+
+    bool recordSetupTime(const std::string &cacheDestination, const std::string &name, double setupSeconds) {
+        MappedIndex index(cacheDestination, false);
+        Record *record = index.find(name);
+        if (record == nullptr)
+            return false;
+
+        __atomic_store_n(&record->setupMilliseconds, (uint64_t) (setupSeconds * 1000), __ATOMIC_RELAXED);
+
+        return true;
+    }
+
+    // one exclusive lock for all removals of an eviction
+    bool recordRemovals(const std::string &cacheDestination, const std::vector<std::string> &names) {
+        if (names.empty())
+            return true;
+
+        MappedIndex index(cacheDestination, true);
+        if (!index.isOpen())
+            return false;
+
+        for (auto &name: names) {
+            Record *record = index.find(name);
+            if (record != nullptr)
+                memset(record, 0, sizeof(Record));
+        }
+
+        return true;
+    }
+
+    /**
+     * Sizes and last use of the named entries, measured on jobs threads. The mtime of an entry is its last
+     * use, restores update it.
+     */
+    Entries measureEntries(const std::string &cacheDestination, const std::vector<std::string> &names,
+                           unsigned int jobs) {
+        std::vector<Entry> measured(names.size());
+        {
+            WorkerPool pool(jobs);
+            for (size_t i = 0; i < names.size(); i++) {
+                pool.submit([&cacheDestination, &names, &measured, i] {
+                    const stdfs::path entryPath = stdfs::path(cacheDestination) / names[i];
+                    struct stat status{};
+                    measured[i].size = measure(entryPath);
+                    measured[i].lastAccess = (stat(entryPath.c_str(), &status) == 0) ? status.st_mtime
+                                                                                     : time(nullptr);
+                    measured[i].created = measured[i].lastAccess;
+                });
+            }
+        }
+
+        Entries entries;
+        for (size_t i = 0; i < names.size(); i++)
+            entries[names[i]] = measured[i];
+
+        return entries;
+    }
+
+    // names of the entries in the cache destination, a listing without descending into them
+    std::vector<std::string> listEntries(const std::string &cacheDestination) {
+        std::vector<std::string> names;
+        std::error_code errorCode;
+
+        for (stdfs::directory_iterator iterator(cacheDestination, errorCode), end;
+             !errorCode && iterator != end; iterator.increment(errorCode)) {
+            const std::string name = iterator->path().filename().u8string();
+            char key[cacheLayout::entryKeyLength];
+            uint8_t format = unused;
+            if (parseName(name, key, format))
+                names.push_back(name);
+        }
+
+        return names;
+    }
+
+    void write(MappedIndex &index, const Entries &entries) {
+        for (auto &entry: entries) {
+            Record *record = index.add(entry.first);
+            if (record == nullptr)
+                return;
+
+            record->bytes = entry.second.size.bytes;
+            record->files = entry.second.size.files;
+            record->created = entry.second.created;
+            record->lastAccess = entry.second.lastAccess;
+            record->hits = entry.second.hits;
+            record->setupMilliseconds = (uint64_t) (entry.second.setupSeconds * 1000);
+        }
+    }
+
+    Entries read(MappedIndex &index) {
+        Entries entries;
+
+        for (size_t i = 0; i < index.count(); i++) {
+            const Record &record = index.records()[i];
+            if (record.format == unused)
+                continue;
+
+            Entry &entry = entries[entryName(record)];
+            entry.size.bytes = record.bytes;
+            entry.size.files = record.files;
+            entry.created = (time_t) record.created;
+            entry.lastAccess = (time_t) __atomic_load_n(&record.lastAccess, __ATOMIC_RELAXED);
+            entry.hits = __atomic_load_n(&record.hits, __ATOMIC_RELAXED);
+            entry.setupSeconds = __atomic_load_n(&record.setupMilliseconds, __ATOMIC_RELAXED) / 1000.0;
+        }
+
+        return entries;
+    }
+
+    // entries recorded in the index, none before the first store
+    Entries load(const std::string &cacheDestination) {
+        MappedIndex index(cacheDestination, false);
+
+        return index.isOpen() ? read(index) : Entries();
+    }
+
+    /**
+     * Brings the index in line with the entries on disk: entries removed by other tools leave it, entries
+     * stored without it are measured on jobs threads and added. Returns the entries.
+     */
+    Entries reconcile(const std::string &cacheDestination, unsigned int jobs) {
+        Entries entries = load(cacheDestination);
+        std::vector<std::string> names = listEntries(cacheDestination);
+        std::sort(names.begin(), names.end());
+
+        std::vector<std::string> unknown;
+        for (auto &name: names) {
+            if (!entries.count(name))
+                unknown.push_back(name);
+        }
+
+        std::vector<std::string> vanished;
+        for (auto &entry: entries) {
+            if (!std::binary_search(names.begin(), names.end(), entry.first))
+                vanished.push_back(entry.first);
+        }
+        for (auto &name: vanished)
+            entries.erase(name);
+        recordRemovals(cacheDestination, vanished);
+
+        if (!unknown.empty()) {
+            Entries measured = measureEntries(cacheDestination, unknown, jobs);
+            MappedIndex index(cacheDestination, true, true);
+            if (index.isOpen())
+                write(index, measured);
+            entries.insert(measured.begin(), measured.end());
+        }
+
+        return entries;
+    }
+}
@@ -0,0 +1,121 @@
+#pragma once //"cacheLayout.hpp"
+
+#include <cctype>
+#include <string>
+#include <sys/types.h>
+#include <config.h>
+
+/**
+ * Names of the files cadir keeps inside the cache destination next to the cache entries.
+ */
+namespace cacheLayout {
+    const std::string metadataDirectoryName = ".cadir";
+    // manifest of an entry stored as content defined chunks
+    const std::string chunkedExtension = ".tar.cdc";
+    const size_t entryKeyLength = 32;
+
+    std::string metadataDirectory(const std::string &cacheDestination) {
+        return (stdfs::path(cacheDestination) / metadataDirectoryName).u8string();
+    }
+
+    std::string chunkDirectory(const std::string &cacheDestination) {
+        return (stdfs::path(metadataDirectory(cacheDestination)) / "chunks").u8string();
+    }
+
+    // chunks are spread over 256 directories by the first byte of their hash
+    std::string chunkFile(const std::string &cacheDestination, const std::string &hash) {
+        return (stdfs::path(chunkDirectory(cacheDestination)) / hash.substr(0, 2) / hash).u8string();
+    }
+
+    // entries are built here and renamed into the cache destination when they are complete
+    std::string temporaryDirectory(const std::string &cacheDestination) {
+        return (stdfs::path(metadataDirectory(cacheDestination)) / "tmp").u8string();
+    }
+
+    // trees stored in the background, see --async-store
+    std::string snapshotDirectory(const std::string &cacheDestination) {
+        return (stdfs::path(metadataDirectory(cacheDestination)) / "snapshots").u8string();
+    }
+
+    std::string lockDirectory(const std::string &cacheDestination) {
+        return (stdfs::path(metadataDirectory(cacheDestination)) / "locks").u8string();
+    }
+
+    // held exclusively while the entry of the key is built
+    std::string lockFile(const std::string &cacheDestination, const std::string &key) {
+        return (stdfs::path(lockDirectory(cacheDestination)) / (key + ".lock")).u8string();
+    }
+
+    // eviction runs at most once at a time per cache destination
+    std::string evictionLockFile(const std::string &cacheDestination) {
+        return (stdfs::path(lockDirectory(cacheDestination)) / "eviction.lock").u8string();
+    }
+
+    // memory mapped file of fixed size records, one per entry, see cacheIndex.hpp
+    std::string indexFile(const std::string &cacheDestination) {
+        return (stdfs::path(metadataDirectory(cacheDestination)) / "index").u8string();
+    }
+
+    // held shared while the index is appended to, exclusive while it is rewritten
+    std::string indexLockFile(const std::string &cacheDestination) {
+        return (stdfs::path(lockDirectory(cacheDestination)) / "index.lock").u8string();
+    }
+
+    // evicted entries are renamed here and deleted afterwards
+    std::string trashDirectory(const std::string &cacheDestination) {
+        return (stdfs::path(metadataDirectory(cacheDestination)) / "trash").u8string();
+    }
+
+    std::string checksumDirectory(const std::string &cacheDestination) {
+        return (stdfs::path(metadataDirectory(cacheDestination)) / "checksums").u8string();
+    }
+
+    // sizes and hashes of the files of an entry, written when it is stored
+    std::string checksumFile(const std::string &cacheDestination, const std::string &name) {
+        return (stdfs::path(checksumDirectory(cacheDestination)) / name).u8string();
+    }
+
+    // corrupt entries and chunks are renamed here by "cadir verify" and kept for inspection
+    std::string quarantineDirectory(const std::string &cacheDestination) {
+        return (stdfs::path(metadataDirectory(cacheDestination)) / "quarantine").u8string();
+    }
+
+    std::string leaseDirectory(const std::string &cacheDestination) {
+        return (stdfs::path(metadataDirectory(cacheDestination)) / "leases").u8string();
+    }
+
+    std::string leaseFile(const std::string &cacheDestination, const std::string &key, const std::string &host,
+                          pid_t pid) {
+        return (stdfs::path(leaseDirectory(cacheDestination)) /
+                (key + "." + host + "." + std::to_string(pid))).u8string();
+    }
+
+    std::string failureDirectory(const std::string &cacheDestination) {
+        return (stdfs::path(metadataDirectory(cacheDestination)) / "failed").u8string();
+    }
+
+    // recorded failure of the setup command of the key
+    std::string failureFile(const std::string &cacheDestination, const std::string &key) {
+        return (stdfs::path(failureDirectory(cacheDestination)) / key).u8string();
+    }
+
+    // default socket of the daemon serving the cache destination
+    std::string socketFile(const std::string &cacheDestination) {
+        return (stdfs::path(metadataDirectory(cacheDestination)) / "cadird.sock").u8string();
+    }
+
+    /**
+     * Cache entries are named by the md5 of the identity file, optionally followed by an archive extension.
+     */
+    bool isEntryName(const std::string &name) {
+        if (name.size() < entryKeyLength)
+            return false;
+
+        for (size_t i = 0; i < entryKeyLength; i++) {
+            if (!isxdigit((unsigned char) name[i]))
+                return false;
+        }
+
+        return name.size() == entryKeyLength || name[entryKeyLength] == '.';
+    }
+}
@@ -0,0 +1,268 @@
+#pragma once //"cacheStore.hpp"
+
+#include <config.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <utime.h>
+#include "Exceptions/CreateCacheDirectoryException.h"
+#include "Exceptions/CopyToCacheFailedException.h"
+#include "Exceptions/CopyFromCacheException.h"
+#include "cacheIndex.hpp"
+#include "cacheLayout.hpp"
+#include "chunkStore.hpp"
+#include "compress.hpp"
+#include "integrity.hpp"
+#include "publish.hpp"
+#include "trace.hpp"
+
+/**
+ * Storing and restoring the data of cache entries, shared by the command line flow and the daemon.
+ * Setup and finalize commands are not part of it, they always run in the calling process.
+ */
+namespace cacheStore {
+    const std::string archiveExtension = ".tar.gz";
+    const std::string chunkedArchiveExtension = cacheLayout::chunkedExtension;
+    const auto defaultCopyOptions = stdfs::copy_options::recursive |
+                                    stdfs::copy_options::overwrite_existing |
+                                    stdfs::copy_options::copy_symlinks;
+
+    std::string findArchive(const std::string &targetDirectoryPath) {
+        for (auto &extension: {archiveExtension, chunkedArchiveExtension}) {
+            if (stdfs::exists(targetDirectoryPath + extension)) {
+                return targetDirectoryPath + extension;
+            }
+        }
+
+        return "";
+    }
+
+    int updateAccessTime(const char *fileName) {
+        struct utimbuf utimbuf{};
+
+        utimbuf.modtime = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+
+        return utime(fileName, &utimbuf);
+    }
+
+    // the cache destination is the directory of the entry
+    void recordAccess(const std::string &entryPath) {
+        const stdfs::path path(entryPath);
+
+        cacheIndex::recordAccess(path.parent_path().u8string(), path.filename().u8string());
+    }
+
+    // most recently used entries first, restores update the mtime of an entry
+    std::vector<stdfs::path> recentEntries(const std::string &cacheDestination, size_t count) {
+        std::vector<std::pair<stdfs::file_time_type, stdfs::path>> entries;
+
+        for (auto &directoryEntry: stdfs::directory_iterator(cacheDestination)) {
+            if (cacheLayout::isEntryName(directoryEntry.path().filename().u8string()))
+                entries.emplace_back(stdfs::last_write_time(directoryEntry.path()), directoryEntry.path());
+        }
+
+        std::sort(entries.begin(), entries.end(), [](const auto &left, const auto &right) {
+            return left.first > right.first;
+        });
+
+        std::vector<stdfs::path> paths;
+        for (size_t i = 0; i < entries.size() && i < count; i++)
+            paths.push_back(entries[i].second);
+
+        return paths;
+    }
+
+    bool isChunked(const std::string &entryPath) {
+        return entryPath.size() > chunkedArchiveExtension.size() &&
+               entryPath.compare(entryPath.size() - chunkedArchiveExtension.size(), std::string::npos,
+                                 chunkedArchiveExtension) == 0;
+    }
+
+    // the cache source without a trailing separator, "vendor/" is archived and restored like "vendor"
+    stdfs::path sourcePath(const std::string &cacheSource) {
+        stdfs::path path = stdfs::path(cacheSource).lexically_normal();
+        if (path.filename().empty() && path.has_relative_path())
+            path = path.parent_path();
+
+        return path;
+    }
+
+    /**
+     * Renames the directory of an archive entry to the name of cacheSource on extraction. Only archives
+     * migrated from a directory entry hold another directory than their cache source, the key.
+     */
+    compress::TopLevel restoredTopLevel(const std::string &archivePath, const std::string &cacheSource) {
+        compress::TopLevel topLevel;
+        topLevel.from = stdfs::path(archivePath).filename().u8string().substr(0, cacheLayout::entryKeyLength);
+        topLevel.to = sourcePath(stdfs::absolute(cacheSource).u8string()).filename().u8string();
+
+        return topLevel;
+    }
+
+    // extracts an archive entry of any format, see compress::extract()
+    void extractArchive(const std::string &archivePath, const bool &fastExtract, const std::string &extractRoot,
+                        const compress::TopLevel &topLevel) {
+        if (isChunked(archivePath))
+            chunkStore::extract(archivePath, fastExtract, extractRoot, topLevel);
+        else
+            compress::extract(archivePath.c_str(), fastExtract, extractRoot, -1, topLevel);
+    }
+
+    // path of the entry in the format it is stored in
+    std::string entryPath(const std::string &targetDirectoryPath, bool archive,
+                          const compress::ArchiveOptions &archiveOptions) {
+        if (!archive)
+            return targetDirectoryPath;
+
+        return targetDirectoryPath + (archiveOptions.chunked ? chunkedArchiveExtension : archiveExtension);
+    }
+
+    /**
+     * Copies or archives cacheSource into a temporary path and publishes it as the entry targetDirectoryPath.
+     * The checksums of the entry are hashed while it is written, so it is not read again.
+     */
+    void store(
+            const std::string &cacheSource,
+            const std::string &cacheDestination,
+            const std::string &targetDirectoryPath,
+            const stdfs::copy_options &copyOptions,
+            const bool &archive,
+            const compress::ArchiveOptions &archiveOptions,
+            const bool &syncToDisk
+    ) {
+        const std::string targetPath = entryPath(targetDirectoryPath, archive, archiveOptions);
+        std::string temporaryPath;
+
+        try {
+            temporaryPath = publish::temporaryPath(cacheDestination, stdfs::path(targetPath).filename().u8string());
+        } catch (...) {
+            throw (CreateCacheDirectoryException("Create cache directories failed",
+                                                 ExitCode::createCacheDirectoriesFailed));
+        }
+
+        const stdfs::path cacheSourcePath = sourcePath(cacheSource);
+        // hashed while the entry is written, computed afterwards only for small chunk manifests
+        std::string checksums;
+
+        if (archive) {
+            trace("Archive: " + targetPath);
+
+            try {
+                auto onAdd = [](const std::string &fileName) { trace("add: " + fileName); };
+
+                if (archiveOptions.chunked) {
+                    chunkStore::ChunkWriter chunkWriter(temporaryPath, cacheDestination,
+                                                        archiveOptions.compressionThreads, syncToDisk);
+                    compress::write_archive(cacheSourcePath.parent_path(), chunkWriter, cacheSourcePath.u8string(),
+                                            archiveOptions, onAdd);
+                    trace("Chunks: " + std::to_string(chunkWriter.written().chunks));
+                    checksums = integrity::computeChecksums(temporaryPath, 1);
+                } else {
+                    integrity::BlockHasher hasher;
+                    compress::write_archive(cacheSourcePath.parent_path(), temporaryPath.c_str(),
+                                            cacheSourcePath.u8string(), archiveOptions, onAdd,
+                                            [&hasher](const char *data, size_t size) { hasher.write(data, size); });
+                    checksums = integrity::writtenChecksums(temporaryPath, {0, {hasher.finish(".")}});
+                }
+            } catch (CadirException &exception) {
+                std::error_code errorCode;
+                stdfs::remove(temporaryPath, errorCode);
+                throw;
+            } catch (...) {
+                std::error_code errorCode;
+                stdfs::remove(temporaryPath, errorCode);
+                throw (CopyToCacheFailedException("Archive to cache failed", ExitCode::copyToCacheFailed));
+            }
+        } else {
+            trace("Copy: " + targetPath);
+            try {
+                trace("Create cache directory: " + temporaryPath);
+                stdfs::create_directories(temporaryPath);
+            } catch (...) {
+                throw (CreateCacheDirectoryException("Create cache directories failed",
+                                                     ExitCode::createCacheDirectoriesFailed));
+            }
+            try {
+                trace("Copy data from " + cacheSource + " to " + temporaryPath);
+                if (copyOptions == defaultCopyOptions) {
+                    checksums = integrity::writtenChecksums(temporaryPath,
+                                                            integrity::copyTree(cacheSourcePath, temporaryPath));
+                } else {
+                    stdfs::copy(cacheSource, temporaryPath, copyOptions);
+                    checksums = integrity::computeChecksums(temporaryPath, archiveOptions.compressionThreads);
+                }
+            } catch (...) {
+                trace("Copy to cache failed");
+                std::error_code errorCode;
+                stdfs::remove_all(temporaryPath, errorCode);
+                throw (CopyToCacheFailedException("Copy to cache failed", ExitCode::copyToCacheFailed));
+            }
+        }
+
+        try {
+            if (syncToDisk) {
+                trace("Sync " + temporaryPath);
+                publish::syncTree(temporaryPath);
+            }
+
+            const cacheIndex::Size size = cacheIndex::measure(temporaryPath);
+
+            trace("Publish " + temporaryPath + " as " + targetPath);
+            if (publish::publish(temporaryPath, targetPath)) {
+                const std::string entryName = stdfs::path(targetPath).filename().u8string();
+                cacheIndex::recordStore(cacheDestination, entryName, size);
+                integrity::record(cacheDestination, entryName, checksums);
+            } else {
+                trace("Cache was published by another process");
+                stdfs::remove_all(temporaryPath);
+            }
+
+            if (syncToDisk) {
+                publish::syncDirectory(cacheDestination);
+            }
+        } catch (...) {
+            std::error_code errorCode;
+            stdfs::remove_all(temporaryPath, errorCode);
+            throw (CopyToCacheFailedException("Publishing cache failed", ExitCode::copyToCacheFailed));
+        }
+    }
+
+    /**
+     * Copies or extracts the entry targetDirectoryPath to cacheSource. Archives hold paths relative to the
+     * parent of cacheSource, extractRoot is that directory if it is not the current working directory. The
+     * directory of an entry migrated from the directory format, its key, is renamed to the name of cacheSource.
+     */
+    void restore(
+            const std::string &cacheSource,
+            const std::string &targetDirectoryPath,
+            const stdfs::copy_options &copyOptions,
+            const bool &archive,
+            const bool &fastExtract,
+            const std::string &extractRoot = ""
+    ) {
+        if (archive) {
+            std::string fileNameWithExtension = findArchive(targetDirectoryPath);
+            trace("Extract data from " + fileNameWithExtension + " to " + cacheSource);
+
+            extractArchive(fileNameWithExtension, fastExtract, extractRoot,
+                           restoredTopLevel(fileNameWithExtension, cacheSource));
+
+            if (updateAccessTime(fileNameWithExtension.c_str()) != 0)
+                trace("could not update access time");
+            recordAccess(fileNameWithExtension);
+        } else {
+            try {
+                trace("Copy data from " + targetDirectoryPath + " to " + cacheSource);
+                stdfs::copy(targetDirectoryPath, cacheSource, copyOptions);
+
+                if (updateAccessTime(targetDirectoryPath.c_str()) != 0)
+                    trace("could not update access time");
+                recordAccess(targetDirectoryPath);
+
+            } catch (...) {
+                throw (CopyFromCacheException("Copy from cache failed", ExitCode::copyFromCacheFailed));
+            }
+        }
+    }
+}
@@ -0,0 +1,559 @@
+#pragma once //"chunkStore.hpp"
+
+#include <config.h>
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <limits>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <openssl/sha.h>
+#if HAS_ZSTD
+#include <zstd.h>
+#endif
+#include "Exceptions/GzipWriteReadException.h"
+#include "cacheLayout.hpp"
+#include "compress.hpp"
+#include "exitCodeEnum.hpp"
+#include "publish.hpp"
+#include "workerPool.hpp"
+#include "trace.hpp"
+
+/**
+ * Content defined chunks of archive entries (--chunked). The uncompressed tar stream is split with FastCDC,
+ * every chunk is compressed on its own and stored once per cache destination under its SHA-256 in
+ * .cadir/chunks. The entry itself, <key>.tar.cdc, is a manifest listing its chunks:
+ *
+ *   cadir-chunks 1
+ *   <sha256> <size> <stored size>
+ *   ...
+ *
+ * Entries of similar trees share most of their chunks, a new entry only adds the chunks which changed.
+ * Chunks no manifest refers to are removed by sweep(), which eviction and "cadir gc" run.
+ */
+namespace chunkStore {
+    const std::string manifestHeader = "cadir-chunks 1";
+    const size_t minimumChunkSize = 16 * 1024;
+    const size_t averageChunkSize = 64 * 1024;
+    const size_t maximumChunkSize = 256 * 1024;
+    // normalized chunking: two more bits before the average size, two less after it
+    const uint64_t maskSmall = ~0ULL << (64 - 18);
+    const uint64_t maskLarge = ~0ULL << (64 - 14);
+    const int chunkCompressionLevel = 3;
+    // chunks written or reused by a store are referenced by its manifest only when it is finished
+    const unsigned int sweepGraceSeconds = 600;
+    // decompressed chunks read ahead of the extraction per thread
+    const size_t prefetchPerThread = 4;
+
+    struct Chunk {
+        std::string hash;
+        uint64_t size = 0;
+        uint64_t storedSize = 0;
+    };
+
+    struct Statistics {
+        size_t chunks = 0;
+        uintmax_t bytes = 0;
+    };
+
+    // random 64 bit values per byte, generated with splitmix64 from a fixed seed so every build cuts alike
+    const std::array<uint64_t, 256> &gear() {
+        static const std::array<uint64_t, 256> table = [] {
+            std::array<uint64_t, 256> values{};
+            uint64_t state = 0x6361646972636463ULL;
+
+            for (auto &value: values) {
+                uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+                z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+                z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+                value = z ^ (z >> 31);
+            }
+
+            return values;
+        }();
+
+        return table;
+    }
+
+    /**
+     * Length of the chunk at the start of data (FastCDC). Data shorter than the minimum chunk size is one chunk.
+     */
+    size_t cutPoint(const unsigned char *data, size_t length) {
+        if (length <= minimumChunkSize)
+            return length;
+
+        const auto &table = gear();
+        const size_t normalSize = std::min(length, averageChunkSize);
+        const size_t end = std::min(length, maximumChunkSize);
+        uint64_t hash = 0;
+        size_t i = minimumChunkSize;
+
+        for (; i < normalSize; i++) {
+            hash = (hash << 1) + table[data[i]];
+            if ((hash & maskSmall) == 0)
+                return i + 1;
+        }
+        for (; i < end; i++) {
+            hash = (hash << 1) + table[data[i]];
+            if ((hash & maskLarge) == 0)
+                return i + 1;
+        }
+
+        return end;
+    }
+
+    std::string hashChunk(const char *data, size_t length) {
+        static const char digits[] = "0123456789abcdef";
+        unsigned char digest[SHA256_DIGEST_LENGTH];
+        std::string hash;
+
+        SHA256(reinterpret_cast<const unsigned char *>(data), length, digest);
+        for (unsigned char byte: digest) {
+            hash += digits[byte >> 4];
+            hash += digits[byte & 0x0f];
+        }
+
+        return hash;
+    }
+
+    bool isChunkName(const std::string &name) {
+        return name.size() == 2 * SHA256_DIGEST_LENGTH &&
+               std::all_of(name.begin(), name.end(), [](char c) { return isxdigit((unsigned char) c); });
+    }
+
+    // zstd if cadir is built with it, zlib otherwise, the reader tells them apart by the zstd magic
+    std::string compressChunk(const char *data, size_t length) {
+        std::string compressed;
+#if HAS_ZSTD
+        compressed.resize(ZSTD_compressBound(length));
+        size_t result = ZSTD_compress(&compressed[0], compressed.size(), data, length, chunkCompressionLevel);
+        if (ZSTD_isError(result))
+            throw (GzipWriteReadException("Cannot compress chunk", ExitCode::gzipException));
+        compressed.resize(result);
+#else
+        uLongf compressedLength = compressBound(length);
+        compressed.resize(compressedLength);
+        if (compress2(reinterpret_cast<Bytef *>(&compressed[0]), &compressedLength,
+                      reinterpret_cast<const Bytef *>(data), length, chunkCompressionLevel) != Z_OK)
+            throw (GzipWriteReadException("Cannot compress chunk", ExitCode::gzipException));
+        compressed.resize(compressedLength);
+#endif
+
+        return compressed;
+    }
+
+    std::string decompressChunk(const std::string &compressed, uint64_t size) {
+        std::string data(size, '\0');
+        const unsigned char zstdMagic[4] = {0x28, 0xb5, 0x2f, 0xfd};
+
+        if (compressed.size() >= 4 && memcmp(compressed.data(), zstdMagic, 4) == 0) {
+#if HAS_ZSTD
+            size_t result = ZSTD_decompress(&data[0], data.size(), compressed.data(), compressed.size());
+            if (!ZSTD_isError(result) && result == size)
+                return data;
+#endif
+        } else {
+            uLongf length = size;
+            if (uncompress(reinterpret_cast<Bytef *>(&data[0]), &length,
+                           reinterpret_cast<const Bytef *>(compressed.data()), compressed.size()) == Z_OK &&
+                length == size)
+                return data;
+        }
+
+        throw (GzipWriteReadException("Cannot decompress chunk", ExitCode::gzipException));
+    }
+
+    std::string readFile(const std::string &path) {
+        std::ifstream file(path, std::ios::binary);
+        if (!file)
+            throw (GzipWriteReadException("Cannot read " + path, ExitCode::gzipException));
+
+        std::ostringstream content;
+        content << file.rdbuf();
+
+        return content.str();
+    }
+
+    // chunks a store reuses are touched, so a sweep running meanwhile keeps them
+    bool touch(const std::string &path) {
+        return utimensat(AT_FDCWD, path.c_str(), nullptr, 0) == 0;
+    }
+
+    bool writeAll(int fileDescriptor, const std::string &content) {
+        const char *data = content.data();
+        size_t length = content.size();
+
+        while (length > 0) {
+            ssize_t count = write(fileDescriptor, data, length);
+            if (count < 0 && errno == EINTR)
+                continue;
+            if (count <= 0)
+                return false;
+
+            data += count;
+            length -= (size_t) count;
+        }
+
+        return true;
+    }
+
+    // creates the file, which must not exist
+    void writeFile(const std::string &path, const std::string &content, bool syncToDisk) {
+        int fileDescriptor = open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (fileDescriptor < 0)
+            throw (GzipWriteReadException("Cannot create " + path, ExitCode::gzipException));
+
+        bool written = writeAll(fileDescriptor, content);
+        if (written && syncToDisk)
+            written = fsync(fileDescriptor) == 0;
+        if (close(fileDescriptor) != 0 || !written) {
+            unlink(path.c_str());
+            throw (GzipWriteReadException("Cannot write " + path, ExitCode::gzipException));
+        }
+    }
+
+    /**
+     * Writes the file under a temporary name and renames it to path, unless another store was faster.
+     */
+    void publishFile(const std::string &cacheDestination, const std::string &path, const std::string &content,
+                     bool syncToDisk) {
+        const std::string temporaryPath = publish::temporaryPath(cacheDestination,
+                                                                 stdfs::path(path).filename().u8string());
+        writeFile(temporaryPath, content, syncToDisk);
+
+        std::error_code errorCode;
+        stdfs::create_directories(stdfs::path(path).parent_path(), errorCode);
+        if (!publish::publish(temporaryPath, path))
+            unlink(temporaryPath.c_str());
+    }
+
+    /**
+     * Stores the chunk in the cache destination unless it is there already. Returns the chunk with its
+     * stored size.
+     */
+    Chunk storeChunk(const std::string &cacheDestination, const char *data, size_t length, bool syncToDisk) {
+        Chunk chunk;
+        chunk.hash = hashChunk(data, length);
+        chunk.size = length;
+
+        const std::string path = cacheLayout::chunkFile(cacheDestination, chunk.hash);
+        struct stat status{};
+        if (stat(path.c_str(), &status) == 0 && touch(path)) {
+            chunk.storedSize = (uint64_t) status.st_size;
+            return chunk;
+        }
+
+        const std::string compressed = compressChunk(data, length);
+        publishFile(cacheDestination, path, compressed, syncToDisk);
+        chunk.storedSize = compressed.size();
+
+        return chunk;
+    }
+
+    std::string manifestLine(const Chunk &chunk) {
+        return chunk.hash + " " + std::to_string(chunk.size) + " " + std::to_string(chunk.storedSize) + "\n";
+    }
+
+    std::vector<Chunk> parseManifest(const std::string &content, const std::string &path) {
+        std::istringstream lines(content);
+        std::string line;
+        std::vector<Chunk> chunks;
+
+        if (!std::getline(lines, line) || line != manifestHeader)
+            throw (GzipWriteReadException("Invalid chunk manifest " + path, ExitCode::gzipException));
+
+        while (std::getline(lines, line)) {
+            std::istringstream fields(line);
+            Chunk chunk;
+            if (!(fields >> chunk.hash >> chunk.size >> chunk.storedSize) || !isChunkName(chunk.hash) ||
+                chunk.size > maximumChunkSize)
+                throw (GzipWriteReadException("Invalid chunk manifest " + path, ExitCode::gzipException));
+            chunks.push_back(chunk);
+        }
+
+        return chunks;
+    }
+
+    std::vector<Chunk> readManifest(const std::string &path) {
+        return parseManifest(readFile(path), path);
+    }
+
+    /**
+     * Receives the tar stream of write_archive(), cuts it into chunks and stores them on worker threads. The
+     * manifest at manifestPath, a new file, lists the chunks in stream order. It grows while the chunks are
+     * stored, so sweep() keeps the chunks of an unfinished store.
+     */
+    class ChunkWriter : public compress::ArchiveSink {
+    public:
+        ChunkWriter(const std::string &manifestPath, const std::string &cacheDestination, unsigned int threads,
+                    bool syncToDisk)
+                : cacheDestination(cacheDestination), syncToDisk(syncToDisk),
+                  pool(threads > 0 ? threads : std::max(std::thread::hardware_concurrency(), 1u)) {
+            manifestDescriptor = open(manifestPath.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+            if (manifestDescriptor < 0 || !writeAll(manifestDescriptor, manifestHeader + "\n"))
+                throw (GzipWriteReadException("Cannot create " + manifestPath, ExitCode::gzipException));
+        }
+
+        ~ChunkWriter() override {
+            if (manifestDescriptor >= 0)
+                ::close(manifestDescriptor);
+        }
+
+        bool write(const char *data, size_t size) override {
+            if (failed)
+                return false;
+
+            buffer.append(data, size);
+            while (buffer.size() - offset >= maximumChunkSize) {
+                if (!cut())
+                    return false;
+            }
+            // the consumed front is dropped once it is larger than what is left
+            if (offset > buffer.size() / 2) {
+                buffer.erase(0, offset);
+                offset = 0;
+            }
+
+            return true;
+        }
+
+        bool close() override {
+            while (!failed && offset < buffer.size()) {
+                cut();
+            }
+            while (!pending.empty()) {
+                collect();
+            }
+            if (!failed && syncToDisk && fsync(manifestDescriptor) != 0)
+                failed = true;
+            if (::close(manifestDescriptor) != 0)
+                failed = true;
+            manifestDescriptor = -1;
+
+            return !failed;
+        }
+
+        const Statistics &written() const {
+            return statistics;
+        }
+
+    private:
+        bool cut() {
+            const size_t length = cutPoint(reinterpret_cast<const unsigned char *>(buffer.data()) + offset,
+                                           buffer.size() - offset);
+            std::string data = buffer.substr(offset, length);
+            offset += length;
+
+            // the pool limits the chunks in flight, the results are kept in stream order
+            while (pending.size() >= maximumPending)
+                collect();
+            try {
+                pending.push_back(pool.submit(
+                        [this, data = std::move(data)] {
+                            return storeChunk(cacheDestination, data.data(), data.size(), syncToDisk);
+                        }));
+            } catch (...) {
+                failed = true;
+            }
+
+            return !failed;
+        }
+
+        void collect() {
+            try {
+                Chunk chunk = pending.front().get();
+                if (!writeAll(manifestDescriptor, manifestLine(chunk)))
+                    failed = true;
+                statistics.chunks++;
+                statistics.bytes += chunk.storedSize;
+            } catch (std::exception &exception) {
+                trace(std::string("Chunk store failed: ") + exception.what());
+                failed = true;
+            }
+            pending.pop_front();
+        }
+
+        const size_t maximumPending = 64;
+        std::string cacheDestination;
+        bool syncToDisk;
+        int manifestDescriptor = -1;
+        std::string buffer;
+        size_t offset = 0;
+        std::deque<std::future<Chunk>> pending;
+        Statistics statistics;
+        bool failed = false;
+        // last member, its threads end before the members their tasks use
+        WorkerPool pool;
+    };
+
+    /**
+     * Produces the tar stream of a manifest for compress::ArchiveReader. Chunks are read and decompressed
+     * ahead of the extraction on worker threads.
+     */
+    class ChunkSource {
+    public:
+        ChunkSource(std::vector<Chunk> chunks, const std::string &cacheDestination, unsigned int threads)
+                : chunks(std::move(chunks)), cacheDestination(cacheDestination),
+                  pool(threads > 0 ? threads : std::max(std::thread::hardware_concurrency(), 1u)),
+                  readAhead(prefetchPerThread * (threads > 0 ? threads
+                                                             : std::max(std::thread::hardware_concurrency(), 1u))) {
+            while (requested < this->chunks.size() && prefetched.size() < readAhead)
+                request();
+        }
+
+        ssize_t read(char *target, size_t length) {
+            while (position == current.size()) {
+                if (prefetched.empty())
+                    return 0;
+
+                try {
+                    current = prefetched.front().get();
+                } catch (std::exception &exception) {
+                    trace(std::string("Chunk read failed: ") + exception.what());
+                    prefetched.pop_front();
+                    return -1;
+                }
+                prefetched.pop_front();
+                position = 0;
+                if (requested < chunks.size())
+                    request();
+            }
+
+            length = std::min(length, current.size() - position);
+            memcpy(target, current.data() + position, length);
+            position += length;
+
+            return (ssize_t) length;
+        }
+
+    private:
+        void request() {
+            const Chunk &chunk = chunks[requested++];
+            prefetched.push_back(pool.submit([this, &chunk] {
+                return decompressChunk(readFile(cacheLayout::chunkFile(cacheDestination, chunk.hash)), chunk.size);
+            }));
+        }
+
+        std::vector<Chunk> chunks;
+        std::string cacheDestination;
+        WorkerPool pool;
+        size_t readAhead;
+        size_t requested = 0;
+        std::deque<std::future<std::string>> prefetched;
+        std::string current;
+        size_t position = 0;
+    };
+
+    /**
+     * Extracts the chunked entry like compress::extract(). Its chunks are in the cache destination of the manifest.
+     */
+    int extract(const std::string &manifestPath, const bool fastExtract = false,
+                const std::string &destinationRoot = "",
+                const compress::TopLevel &topLevel = compress::TopLevel()) {
+        const std::string cacheDestination = stdfs::path(manifestPath).parent_path().u8string();
+        ChunkSource source(readManifest(manifestPath), cacheDestination, 0);
+
+        return compress::extract_source([&source](char *buffer, size_t length) {
+            return source.read(buffer, length);
+        }, fastExtract, destinationRoot, topLevel);
+    }
+
+    /**
+     * Copies the chunks of the manifest missing in toDestination, e.g. from the shared tier to the local
+     * one. The manifest itself is published by the caller afterwards.
+     */
+    void copyChunks(const std::vector<Chunk> &chunks, const std::string &fromDestination,
+                    const std::string &toDestination, unsigned int threads = 0) {
+        WorkerPool pool(threads > 0 ? threads : std::max(std::thread::hardware_concurrency(), 1u));
+        std::vector<std::future<void>> copies;
+
+        for (auto &chunk: chunks) {
+            copies.push_back(pool.submit([&chunk, &fromDestination, &toDestination] {
+                const std::string target = cacheLayout::chunkFile(toDestination, chunk.hash);
+                if (stdfs::exists(target) && touch(target))
+                    return;
+
+                publishFile(toDestination, target,
+                            readFile(cacheLayout::chunkFile(fromDestination, chunk.hash)), false);
+            }));
+        }
+        for (auto &copy: copies)
+            copy.get();
+    }
+
+    // hashes of the chunks all manifests of the cache destination refer to, including unfinished stores
+    std::unordered_set<std::string> referencedChunks(const std::string &cacheDestination) {
+        std::unordered_set<std::string> referenced;
+
+        for (auto &directory: {cacheDestination, cacheLayout::temporaryDirectory(cacheDestination)}) {
+            std::error_code errorCode;
+            for (stdfs::directory_iterator iterator(directory, errorCode), end;
+                 !errorCode && iterator != end; iterator.increment(errorCode)) {
+                const std::string name = iterator->path().filename().u8string();
+                if (name.find(cacheLayout::chunkedExtension) == std::string::npos)
+                    continue;
+
+                // manifests of unfinished stores may end with half a line
+                std::ifstream manifest(iterator->path());
+                std::string hash;
+                while (manifest >> hash) {
+                    if (isChunkName(hash))
+                        referenced.insert(hash);
+                    manifest.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+                }
+            }
+        }
+
+        return referenced;
+    }
+
+    /**
+     * Removes the chunks no manifest refers to and which were not written or reused within the grace
+     * period. The caller holds the eviction lock.
+     */
+    Statistics sweep(const std::string &cacheDestination, bool dryRun = false) {
+        Statistics statistics;
+        const std::string chunkDirectory = cacheLayout::chunkDirectory(cacheDestination);
+        if (!stdfs::exists(chunkDirectory))
+            return statistics;
+
+        const std::unordered_set<std::string> referenced = referencedChunks(cacheDestination);
+        const time_t staleBefore = time(nullptr) - sweepGraceSeconds;
+        std::error_code errorCode;
+
+        for (stdfs::recursive_directory_iterator iterator(chunkDirectory, errorCode), end;
+             !errorCode && iterator != end; iterator.increment(errorCode)) {
+            const std::string name = iterator->path().filename().u8string();
+            if (!isChunkName(name) || referenced.count(name) > 0)
+                continue;
+
+            struct stat status{};
+            if (stat(iterator->path().c_str(), &status) != 0 || status.st_mtime > staleBefore)
+                continue;
+
+            if (dryRun || unlink(iterator->path().c_str()) == 0) {
+                statistics.chunks++;
+                statistics.bytes += (uintmax_t) status.st_size;
+            }
+        }
+
+        if (statistics.chunks > 0)
+            trace((dryRun ? "Would remove " : "Removed ") + std::to_string(statistics.chunks) +
+                  " unreferenced chunks (" + std::to_string(statistics.bytes) + " bytes)", dryRun);
+
+        return statistics;
+    }
+}
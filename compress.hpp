@@ -2,63 +2,564 @@
 
 #include <iostream>
 #include <fstream>
+#include <array>
+#include <cerrno>
 #include <archive.h>
 #include <archive_entry.h>
+#include <openssl/sha.h>
 #include <vector>
+#include <functional>
+#include <unordered_map>
+#include <unordered_set>
+#include <algorithm>
+#include <cmath>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <utility>
+// zlib declares a global compress() which would collide with the namespace below
+#define compress zlib_compress
+#include <zlib.h>
+#undef compress
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "fileSystem.hpp"
+#include "boundedQueue.hpp"
 #include "exitCodeEnum.hpp"
 #include "Exceptions/GzipWriteReadException.h"
 #include <config.h>
 
 namespace compress {
     const int bufferSize = 1024 * 1024 * 4;
+    const size_t bufferAlignment = 4096;
+    // files of at least this size are mapped instead of read through the buffer
+    const off_t mmapThreshold = bufferSize;
+    // uncompressed size after which a new independently compressed frame is started
+    const size_t frameSize = 1024 * 1024;
+    const int defaultCompressionLevel = Z_DEFAULT_COMPRESSION;
+    const int storeCompressionLevel = Z_NO_COMPRESSION;
+    // the adaptive policy probes this many leading bytes and stores files above the entropy limit (bits per byte)
+    const size_t entropyProbeSize = 64 * 1024;
+    const double incompressibleEntropy = 7.5;
+    // archives are read in blocks of this size, or mapped completely with fast extraction
+    const size_t readBlockSize = 1024 * 1024;
+    const std::unordered_set<std::string> incompressibleExtensions = {
+            ".gz", ".tgz", ".bz2", ".xz", ".zst", ".br", ".lz4", ".zip", ".jar", ".7z", ".rar",
+            ".png", ".jpg", ".jpeg", ".gif", ".webp", ".avif", ".ico",
+            ".woff", ".woff2", ".mp3", ".mp4", ".webm", ".ogg", ".pdf"
+    };
 
-    void write_archive(const std::string &rootPath, const char *outname, std::vector<std::string> files) {
+    /**
+     * Page aligned heap buffer which is allocated once per archive and reused for every file,
+     * so the memory needed for reading does not depend on the stack size or the number of files.
+     */
+    class AlignedBuffer {
+    public:
+        explicit AlignedBuffer(size_t size) : bufferLength(size) {
+            if (posix_memalign(reinterpret_cast<void **>(&bufferData), bufferAlignment, size) != 0)
+                throw (GzipWriteReadException("Cannot allocate read buffer", ExitCode::gzipException));
+        }
+
+        AlignedBuffer(const AlignedBuffer &) = delete;
+
+        AlignedBuffer &operator=(const AlignedBuffer &) = delete;
+
+        ~AlignedBuffer() {
+            free(bufferData);
+        }
+
+        char *data() const {
+            return bufferData;
+        }
+
+        size_t size() const {
+            return bufferLength;
+        }
+
+    private:
+        char *bufferData = nullptr;
+        size_t bufferLength;
+    };
+
+    static void write_data(struct archive *archive, const char *data, size_t size) {
+        while (size > 0) {
+            la_ssize_t written = archive_write_data(archive, data, size);
+            if (written <= 0)
+                throw (GzipWriteReadException("GZip Exception", ExitCode::gzipException));
+
+            data += written;
+            size -= (size_t) written;
+        }
+    }
+
+    /**
+     * Complete content of a regular file, either read into the shared buffer or mapped for large files.
+     */
+    class FileContent {
+    public:
+        FileContent(const std::string &fileName, const struct stat &st, AlignedBuffer &buffer) {
+            int fileDescriptor = open(fileName.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fileDescriptor < 0)
+                throw (GzipWriteReadException("Cannot read " + fileName, ExitCode::gzipException));
+
+            if (st.st_size >= mmapThreshold) {
+                void *mapped = mmap(nullptr, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fileDescriptor, 0);
+                close(fileDescriptor);
+
+                if (mapped == MAP_FAILED)
+                    throw (GzipWriteReadException("Cannot map " + fileName, ExitCode::gzipException));
+
+                madvise(mapped, (size_t) st.st_size, MADV_SEQUENTIAL);
+                contentData = static_cast<const char *>(mapped);
+                contentLength = (size_t) st.st_size;
+                mappedLength = contentLength;
+
+                return;
+            }
+
+            ssize_t length = 0;
+            while (contentLength < buffer.size() &&
+                   (length = read(fileDescriptor, buffer.data() + contentLength, buffer.size() - contentLength)) > 0) {
+                contentLength += (size_t) length;
+            }
+            close(fileDescriptor);
+
+            if (length < 0)
+                throw (GzipWriteReadException("Cannot read " + fileName, ExitCode::gzipException));
+
+            contentData = buffer.data();
+        }
+
+        FileContent(const FileContent &) = delete;
+
+        FileContent &operator=(const FileContent &) = delete;
+
+        ~FileContent() {
+            if (mappedLength > 0)
+                munmap(const_cast<char *>(contentData), mappedLength);
+        }
+
+        const char *data() const {
+            return contentData;
+        }
+
+        size_t size() const {
+            return contentLength;
+        }
+
+    private:
+        const char *contentData = nullptr;
+        size_t contentLength = 0;
+        size_t mappedLength = 0;
+    };
+
+    /**
+     * Key under which identical files are deduplicated. The mode is part of the key because
+     * all hardlinks of a file share its permissions.
+     */
+    static std::string content_key(const FileContent &content, const struct stat &st) {
+        unsigned char digest[SHA256_DIGEST_LENGTH];
+
+        SHA256(reinterpret_cast<const unsigned char *>(content.data()), content.size(), digest);
+
+        std::string key(reinterpret_cast<const char *>(digest), SHA256_DIGEST_LENGTH);
+        key.append(reinterpret_cast<const char *>(&st.st_mode), sizeof(st.st_mode));
+
+        return key;
+    }
+
+    /**
+     * Receives the uncompressed tar stream of write_archive(), e.g. to compress it into a file.
+     */
+    class ArchiveSink {
+    public:
+        virtual ~ArchiveSink() = default;
+
+        virtual bool write(const char *data, size_t size) = 0;
+
+        // data written afterwards should be compressed with the given level, if the sink compresses
+        virtual bool setLevel(int /*level*/) {
+            return true;
+        }
+
+        virtual bool close() = 0;
+
+        static la_ssize_t archiveWrite(struct archive *archive, void *clientData, const void *buffer, size_t length) {
+            auto *sink = static_cast<ArchiveSink *>(clientData);
+
+            if (!sink->write(static_cast<const char *>(buffer), length)) {
+                archive_set_error(archive, EIO, "Cannot write archive data");
+                return -1;
+            }
+
+            return (la_ssize_t) length;
+        }
+    };
+
+    /**
+     * Part of the tar stream which is compressed independently. Frames are recycled after they
+     * were written, so the number of frames and with it the memory of the pipeline is fixed.
+     */
+    struct Frame {
+        std::vector<char> data;
+        std::vector<unsigned char> compressed;
+        int level = defaultCompressionLevel;
+        bool compressedSuccessfully = false;
+        bool done = false;
+        std::mutex mutex;
+        std::condition_variable finished;
+    };
+
+    /**
+     * Writes the tar stream as a sequence of independent gzip members ("frames"). Every frame is
+     * compressed with its own level, so incompressible files can be stored without compressing
+     * the rest of the archive less. Concatenated members are a valid gzip file for every reader.
+     *
+     * Writing is a pipeline: the caller fills frames, compressor threads deflate them and an output
+     * thread writes them in order, so reading files, compressing and writing overlap. onWritten sees the
+     * written file in order on the output thread, e.g. to hash it without reading it again.
+     */
+    class FrameWriter : public ArchiveSink {
+    public:
+        FrameWriter(
+                const char *outname,
+                int level,
+                unsigned int compressionThreads = 0,
+                std::function<void(const char *, size_t)> onWritten = nullptr
+        ) : currentLevel(level), onWritten(std::move(onWritten)) {
+            fileDescriptor = open(outname, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+            if (fileDescriptor < 0)
+                throw (GzipWriteReadException("Cannot create " + std::string(outname), ExitCode::gzipException));
+
+            if (compressionThreads == 0)
+                compressionThreads = std::max(1u, std::thread::hardware_concurrency());
+
+            const size_t frameCount = 2 * compressionThreads + 2;
+            freeFrames = std::make_unique<BoundedQueue<std::shared_ptr<Frame>>>(frameCount);
+            compressQueue = std::make_unique<BoundedQueue<std::shared_ptr<Frame>>>(frameCount);
+            writeQueue = std::make_unique<BoundedQueue<std::shared_ptr<Frame>>>(frameCount);
+
+            for (size_t i = 0; i < frameCount; i++) {
+                auto frame = std::make_shared<Frame>();
+                frame->data.reserve(frameSize);
+                freeFrames->push(frame);
+            }
+            freeFrames->pop(frame);
+
+            for (unsigned int i = 0; i < compressionThreads; i++)
+                compressors.emplace_back(&FrameWriter::compressFrames, this);
+            outputThread = std::thread(&FrameWriter::writeFrames, this);
+        }
+
+        FrameWriter(const FrameWriter &) = delete;
+
+        FrameWriter &operator=(const FrameWriter &) = delete;
+
+        ~FrameWriter() override {
+            stopPipeline();
+
+            if (fileDescriptor >= 0)
+                ::close(fileDescriptor);
+        }
+
+        /**
+         * Data written afterwards is compressed with the given level, a new frame is started if needed.
+         */
+        bool setLevel(int level) override {
+            if (level == currentLevel)
+                return true;
+
+            bool flushed = flushFrame();
+            currentLevel = level;
+
+            return flushed;
+        }
+
+        bool write(const char *data, size_t size) override {
+            while (size > 0) {
+                size_t length = std::min(size, frameSize - frame->data.size());
+
+                frame->data.insert(frame->data.end(), data, data + length);
+                data += length;
+                size -= length;
+
+                if (frame->data.size() >= frameSize && !flushFrame())
+                    return false;
+            }
+
+            return true;
+        }
+
+        bool close() override {
+            flushFrame();
+            stopPipeline();
+
+            if (::close(fileDescriptor) != 0)
+                failed = true;
+            fileDescriptor = -1;
+
+            return !failed;
+        }
+
+    private:
+        /**
+         * Hands the current frame to the pipeline and continues with a free one, waits if all frames are in use.
+         */
+        bool flushFrame() {
+            if (frame->data.empty())
+                return !failed;
+
+            frame->level = currentLevel;
+            frame->done = false;
+
+            writeQueue->push(frame);
+            compressQueue->push(frame);
+            frame.reset();
+
+            return freeFrames->pop(frame) && !failed;
+        }
+
+        void compressFrames() {
+            std::shared_ptr<Frame> next;
+
+            while (compressQueue->pop(next)) {
+                bool compressedSuccessfully = deflateFrame(*next);
+
+                std::lock_guard<std::mutex> lock(next->mutex);
+                next->compressedSuccessfully = compressedSuccessfully;
+                next->done = true;
+                next->finished.notify_one();
+            }
+        }
+
+        void writeFrames() {
+            std::shared_ptr<Frame> next;
+
+            while (writeQueue->pop(next)) {
+                {
+                    std::unique_lock<std::mutex> lock(next->mutex);
+                    next->finished.wait(lock, [&next] { return next->done; });
+                }
+
+                if (!next->compressedSuccessfully || (!failed && !writeCompressed(*next)))
+                    failed = true;
+                else if (onWritten && !failed)
+                    onWritten(reinterpret_cast<const char *>(next->compressed.data()), next->compressed.size());
+
+                next->data.clear();
+                freeFrames->push(next);
+            }
+        }
+
+        static bool deflateFrame(Frame &next) {
+            z_stream stream{};
+            if (deflateInit2(&stream, next.level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+                return false;
+
+            next.compressed.resize(deflateBound(&stream, next.data.size()));
+            stream.next_in = reinterpret_cast<Bytef *>(next.data.data());
+            stream.avail_in = (uInt) next.data.size();
+            stream.next_out = next.compressed.data();
+            stream.avail_out = (uInt) next.compressed.size();
+
+            int result = deflate(&stream, Z_FINISH);
+            next.compressed.resize(next.compressed.size() - stream.avail_out);
+            deflateEnd(&stream);
+
+            return result == Z_STREAM_END;
+        }
+
+        bool writeCompressed(const Frame &next) const {
+            const unsigned char *data = next.compressed.data();
+            size_t length = next.compressed.size();
+
+            while (length > 0) {
+                ssize_t written = ::write(fileDescriptor, data, length);
+                if (written < 0 && errno == EINTR)
+                    continue;
+                if (written <= 0)
+                    return false;
+
+                data += written;
+                length -= (size_t) written;
+            }
+
+            return true;
+        }
+
+        void stopPipeline() {
+            if (!outputThread.joinable())
+                return;
+
+            compressQueue->close();
+            writeQueue->close();
+
+            for (auto &compressor: compressors)
+                compressor.join();
+            outputThread.join();
+            freeFrames->close();
+        }
+
+        int fileDescriptor;
+        int currentLevel;
+        std::function<void(const char *, size_t)> onWritten;
+        std::atomic<bool> failed{false};
+        std::shared_ptr<Frame> frame;
+        std::unique_ptr<BoundedQueue<std::shared_ptr<Frame>>> freeFrames;
+        std::unique_ptr<BoundedQueue<std::shared_ptr<Frame>>> compressQueue;
+        std::unique_ptr<BoundedQueue<std::shared_ptr<Frame>>> writeQueue;
+        std::vector<std::thread> compressors;
+        std::thread outputThread;
+    };
+
+    static double entropy(const char *data, size_t size) {
+        std::array<size_t, 256> histogram{};
+
+        for (size_t i = 0; i < size; i++)
+            histogram[(unsigned char) data[i]]++;
+
+        double bits = 0;
+        for (size_t count: histogram) {
+            if (count == 0)
+                continue;
+
+            double probability = (double) count / (double) size;
+            bits -= probability * std::log2(probability);
+        }
+
+        return bits;
+    }
+
+    /**
+     * Files which are already compressed are recognized by extension or by the entropy of their first block.
+     */
+    static bool is_incompressible(const stdfs::path &filePath, const FileContent &content) {
+        std::string extension = filePath.extension().u8string();
+        std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+
+        if (incompressibleExtensions.count(extension) > 0)
+            return true;
+
+        return entropy(content.data(), std::min(content.size(), entropyProbeSize)) > incompressibleEntropy;
+    }
+
+    struct ArchiveOptions {
+        // files whose content was already written are stored as hardlinks to the first copy
+        bool deduplicate = false;
+        // files which do not compress well are stored in uncompressed frames
+        bool adaptiveCompression = false;
+        // 0 starts one compressor thread per core
+        unsigned int compressionThreads = 0;
+        // the tar stream is stored as content defined chunks in the chunk store of the cache destination
+        bool chunked = false;
+    };
+
+    /**
+     * Writes every entry below sourceDirectory while the directory is traversed, the file list is never
+     * materialized. Entry names are relative to rootPath, onAdd is called for each written entry.
+     */
+    void write_archive(
+            const std::string &rootPath,
+            ArchiveSink &sink,
+            const std::string &sourceDirectory,
+            const ArchiveOptions &options = ArchiveOptions(),
+            const std::function<void(const std::string &)> &onAdd = nullptr
+    ) {
         struct archive *archive;
         struct archive_entry *archiveEntry;
-        struct stat st;
-        int len;
-        std::ifstream fileStream;
-        char buffer[bufferSize];
+        struct stat st{};
+        const stdfs::path rootDirectory(rootPath);
+        AlignedBuffer buffer(bufferSize);
+        std::unordered_map<std::string, std::string> writtenContents;
 
         archive = archive_write_new();
+        // unblocked output, so a frame boundary can be placed exactly in front of an entry
         if (
-                archive_write_add_filter_gzip(archive) ||
                 archive_write_set_format_pax_restricted(archive) ||
-                archive_write_open_filename(archive, outname) != 0)
+                archive_write_set_bytes_per_block(archive, 0) ||
+                archive_write_set_bytes_in_last_block(archive, 1) ||
+                archive_write_open(archive, &sink, nullptr, ArchiveSink::archiveWrite, nullptr) != 0)
             throw (GzipWriteReadException("GZip Exception", ExitCode::gzipException));
 
-        for (auto iterator = files.begin(); iterator != files.end(); iterator++) {
-            std::string fileName = *iterator;
-            std::string relativeFileName = stdfs::relative(fileName, rootPath).u8string();
+        archiveEntry = archive_entry_new();
+
+        for (auto &directoryEntry: stdfs::recursive_directory_iterator(sourceDirectory)) {
+            const stdfs::path &filePath = directoryEntry.path();
+            std::string fileName = filePath.u8string();
+            std::string relativeFileName = rootDirectory.empty()
+                                           ? fileName
+                                           : filePath.lexically_relative(rootDirectory).u8string();
 
-            stat(fileName.c_str(), &st);
-            archiveEntry = archive_entry_new();
+            if (stat(fileName.c_str(), &st) != 0)
+                throw (GzipWriteReadException("Cannot stat " + fileName, ExitCode::gzipException));
 
+            archive_entry_clear(archiveEntry);
             archive_entry_set_pathname_utf8(archiveEntry, relativeFileName.c_str());
             archive_entry_copy_stat(archiveEntry, &st);
 
-            if (archive_write_header(archive, archiveEntry) != 0)
-                throw (GzipWriteReadException("GZip Exception", ExitCode::gzipException));
+            if (!S_ISREG(st.st_mode) || st.st_size == 0) {
+                if (archive_write_header(archive, archiveEntry) != 0)
+                    throw (GzipWriteReadException("GZip Exception", ExitCode::gzipException));
+            } else {
+                FileContent content(fileName, st, buffer);
+                bool isHardlink = false;
 
-            fileStream.open(fileName, std::ifstream::binary | std::ifstream::out);
+                if (options.deduplicate) {
+                    auto inserted = writtenContents.emplace(content_key(content, st), relativeFileName);
 
-            while (fileStream.good()) {
-                fileStream.read(buffer, sizeof(buffer));
-                archive_write_data(archive, buffer, (size_t) fileStream.gcount());
-            }
+                    if (!inserted.second) {
+                        archive_entry_set_hardlink_utf8(archiveEntry, inserted.first->second.c_str());
+                        archive_entry_set_size(archiveEntry, 0);
+                        isHardlink = true;
+                    }
+                }
+
+                if (options.adaptiveCompression && !isHardlink) {
+                    int level = is_incompressible(filePath, content) ? storeCompressionLevel
+                                                                     : defaultCompressionLevel;
+                    if (!sink.setLevel(level))
+                        throw (GzipWriteReadException("GZip Exception", ExitCode::gzipException));
+                }
 
-            fileStream.close();
-            archive_entry_free(archiveEntry);
+                if (archive_write_header(archive, archiveEntry) != 0)
+                    throw (GzipWriteReadException("GZip Exception", ExitCode::gzipException));
+
+                if (!isHardlink)
+                    write_data(archive, content.data(), content.size());
+            }
 
+            if (onAdd)
+                onAdd(fileName);
         }
 
+        archive_entry_free(archiveEntry);
+
         if (
                 archive_write_close(archive) ||
-                archive_write_free(archive) != 0)
+                archive_write_free(archive) ||
+                !sink.close())
             throw (GzipWriteReadException("GZip Exception", ExitCode::gzipException));
     }
 
+    // writes the archive compressed into the file outname, onWritten sees the file as it is written
+    void write_archive(
+            const std::string &rootPath,
+            const char *outname,
+            const std::string &sourceDirectory,
+            const ArchiveOptions &options = ArchiveOptions(),
+            const std::function<void(const std::string &)> &onAdd = nullptr,
+            const std::function<void(const char *, size_t)> &onWritten = nullptr
+    ) {
+        FrameWriter frameWriter(outname, defaultCompressionLevel, options.compressionThreads, onWritten);
+
+        write_archive(rootPath, frameWriter, sourceDirectory, options, onAdd);
+    }
+
     static int copy_data(struct archive *ar, struct archive *aw) {
         int r;
         const void *buff;
@@ -79,7 +580,303 @@ namespace compress {
         }
     }
 
-    static int extract(const char *filename) {
+    /**
+     * Writes a regular file of the archive without archive_write_disk: the file is preallocated with
+     * fallocate and written with pwrite, only mode and times are restored.
+     */
+    static int write_regular_file(struct archive *a, struct archive_entry *entry) {
+        const char *pathName = archive_entry_pathname(entry);
+        const mode_t mode = archive_entry_perm(entry);
+        const la_int64_t size = archive_entry_size(entry);
+        // like archive_write_disk an existing file or symlink is replaced, never written through
+        const int openFlags = O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC;
+
+        int fileDescriptor = open(pathName, openFlags, mode);
+        if (fileDescriptor < 0 && errno == EEXIST && unlink(pathName) == 0)
+            fileDescriptor = open(pathName, openFlags, mode);
+        if (fileDescriptor < 0 && errno == ENOENT) {
+            std::error_code errorCode;
+            stdfs::create_directories(stdfs::path(pathName).parent_path(), errorCode);
+            fileDescriptor = open(pathName, openFlags, mode);
+        }
+        if (fileDescriptor < 0)
+            return ARCHIVE_FATAL;
+
+        if (size > 0)
+            fallocate(fileDescriptor, 0, 0, size);
+
+        int r = ARCHIVE_OK;
+        const void *buff;
+        size_t length;
+        la_int64_t offset;
+
+        while ((r = archive_read_data_block(a, &buff, &length, &offset)) == ARCHIVE_OK) {
+            const char *data = static_cast<const char *>(buff);
+
+            while (length > 0) {
+                ssize_t written = pwrite(fileDescriptor, data, length, offset);
+                if (written < 0 && errno == EINTR)
+                    continue;
+                if (written <= 0) {
+                    close(fileDescriptor);
+                    return ARCHIVE_FATAL;
+                }
+
+                data += written;
+                length -= (size_t) written;
+                offset += written;
+            }
+        }
+
+        struct timespec times[2] = {
+                {archive_entry_atime(entry), archive_entry_atime_nsec(entry)},
+                {archive_entry_mtime(entry), archive_entry_mtime_nsec(entry)}
+        };
+        if (!archive_entry_atime_is_set(entry))
+            times[0] = times[1];
+
+        if (fchmod(fileDescriptor, mode) != 0 ||
+            futimens(fileDescriptor, times) != 0)
+            r = ARCHIVE_FATAL;
+
+        if (close(fileDescriptor) != 0)
+            r = ARCHIVE_FATAL;
+
+        return r == ARCHIVE_EOF ? ARCHIVE_OK : r;
+    }
+
+    // raw archive bytes from a file, a pipe or a function
+    class ArchiveInput {
+    public:
+        explicit ArchiveInput(int fileDescriptor) : fileDescriptor(fileDescriptor) {}
+
+        // bytes produced by a function instead of a descriptor, e.g. assembled from chunks
+        explicit ArchiveInput(std::function<ssize_t(char *, size_t)> source) : source(std::move(source)) {}
+
+        ssize_t read(char *buffer, size_t length) {
+            if (source)
+                return source(buffer, length);
+
+            ssize_t count;
+            do {
+                count = ::read(fileDescriptor, buffer, length);
+            } while (count < 0 && errno == EINTR);
+
+            return count;
+        }
+
+    private:
+        int fileDescriptor = -1;
+        std::function<ssize_t(char *, size_t)> source;
+    };
+
+    /**
+     * Second destination of the raw archive bytes while they are read, so an archive is copied while it is
+     * extracted. A failing write stops the copy, the extraction continues.
+     */
+    class Tee {
+    public:
+        explicit Tee(int fileDescriptor) : fileDescriptor(fileDescriptor) {}
+
+        bool active() const {
+            return fileDescriptor >= 0;
+        }
+
+        bool failed() const {
+            return writeFailed;
+        }
+
+        void write(const char *data, size_t length) {
+            while (active() && !writeFailed && length > 0) {
+                ssize_t written = ::write(fileDescriptor, data, length);
+                if (written < 0 && errno == EINTR)
+                    continue;
+                if (written <= 0) {
+                    writeFailed = true;
+                    return;
+                }
+
+                data += written;
+                length -= (size_t) written;
+            }
+        }
+
+    private:
+        int fileDescriptor;
+        bool writeFailed = false;
+    };
+
+    /**
+     * Reads a gzip archive in blocks for libarchive and passes every block to the tee, if there is one.
+     */
+    class TeeReader {
+    public:
+        TeeReader(ArchiveInput &input, Tee &tee) : input(input), tee(tee), block(readBlockSize) {}
+
+        static la_ssize_t archiveRead(struct archive *archive, void *clientData, const void **buffer) {
+            auto *reader = static_cast<TeeReader *>(clientData);
+            ssize_t length = reader->input.read(reader->block.data(), reader->block.size());
+
+            if (length < 0) {
+                archive_set_error(archive, errno, "Cannot read archive");
+                return -1;
+            }
+
+            reader->tee.write(reader->block.data(), (size_t) length);
+            *buffer = reader->block.data();
+
+            return (la_ssize_t) length;
+        }
+
+    private:
+        ArchiveInput &input;
+        Tee &tee;
+        std::vector<char> block;
+    };
+
+    /**
+     * Opens a gzip compressed archive for reading. It is read in large blocks or mapped with sequential
+     * read ahead. With a teeFileDescriptor the archive is copied to it while it is read.
+     */
+    class ArchiveReader {
+    public:
+        ArchiveReader(const char *filename, const bool mapArchive, int teeFileDescriptor = -1)
+                : input(-1), tee(teeFileDescriptor) {
+            fileDescriptor = open(filename, O_RDONLY | O_CLOEXEC);
+            if (fileDescriptor < 0)
+                throw (GzipWriteReadException("Cannot open " + std::string(filename), ExitCode::gzipException));
+
+            posix_fadvise(fileDescriptor, 0, 0, POSIX_FADV_SEQUENTIAL);
+            input = ArchiveInput(fileDescriptor);
+            ownsDescriptor = true;
+
+            open_archive(mapArchive);
+        }
+
+        /**
+         * Reads the archive from a pipe or socket, e.g. while it is downloaded. The descriptor stays open.
+         */
+        ArchiveReader(int streamFileDescriptor, int teeFileDescriptor)
+                : input(streamFileDescriptor), tee(teeFileDescriptor) {
+            open_archive(false);
+        }
+
+        // reads the archive from a function, which returns 0 at its end and -1 on errors
+        explicit ArchiveReader(std::function<ssize_t(char *, size_t)> source)
+                : input(std::move(source)), tee(-1) {
+            open_archive(false);
+        }
+
+        ArchiveReader(const ArchiveReader &) = delete;
+
+        ArchiveReader &operator=(const ArchiveReader &) = delete;
+
+        ~ArchiveReader() {
+            if (archive != nullptr)
+                archive_read_free(archive);
+            if (mapped != MAP_FAILED)
+                munmap(mapped, mappedLength);
+            if (ownsDescriptor)
+                ::close(fileDescriptor);
+        }
+
+        struct archive *get() const {
+            return archive;
+        }
+
+        /**
+         * Copies the rest of the archive which libarchive did not need to the tee. Returns false if the
+         * copy is incomplete.
+         */
+        bool finishTee() {
+            char block[64 * 1024];
+            ssize_t length;
+
+            while ((length = input.read(block, sizeof(block))) != 0) {
+                if (length < 0)
+                    return false;
+                tee.write(block, (size_t) length);
+            }
+
+            return !tee.failed();
+        }
+
+        bool close() {
+            bool closed = archive_read_close(archive) == ARCHIVE_OK &&
+                          archive_read_free(archive) == ARCHIVE_OK;
+            archive = nullptr;
+
+            return closed;
+        }
+
+    private:
+        void open_archive(const bool mapArchive) {
+            int r;
+
+            archive = archive_read_new();
+
+            if (archive_read_support_filter_all(archive) ||
+                archive_read_support_format_all(archive) != 0)
+                throw (GzipWriteReadException("GZip Exception", ExitCode::gzipException));
+
+            struct stat st{};
+            if (tee.active() || !ownsDescriptor) {
+                teeReader = std::make_unique<TeeReader>(input, tee);
+                r = archive_read_open(archive, teeReader.get(), nullptr, TeeReader::archiveRead, nullptr);
+            } else if (mapArchive && fstat(fileDescriptor, &st) == 0 && st.st_size > 0 &&
+                       (mapped = mmap(nullptr, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fileDescriptor, 0))
+                       != MAP_FAILED) {
+                mappedLength = (size_t) st.st_size;
+                madvise(mapped, mappedLength, MADV_SEQUENTIAL);
+                madvise(mapped, mappedLength, MADV_WILLNEED);
+                r = archive_read_open_memory(archive, mapped, mappedLength);
+            } else {
+                r = archive_read_open_fd(archive, fileDescriptor, readBlockSize);
+            }
+
+            if (r != ARCHIVE_OK)
+                throw (GzipWriteReadException(archive_error_string(archive) ? archive_error_string(archive)
+                                                                            : "GZip Exception",
+                                              ExitCode::gzipException));
+        }
+
+        struct archive *archive = nullptr;
+        int fileDescriptor = -1;
+        bool ownsDescriptor = false;
+        void *mapped = MAP_FAILED;
+        size_t mappedLength = 0;
+        ArchiveInput input;
+        Tee tee;
+        std::unique_ptr<TeeReader> teeReader;
+    };
+
+    /**
+     * Archives hold the directory of their cache source, the first component of every path. An extraction
+     * renames it from "from" to "to", from any name if from is empty, and keeps it if to is empty.
+     */
+    struct TopLevel {
+        std::string from;
+        std::string to;
+    };
+
+    static std::string replace_top_level(const std::string &path, const TopLevel &topLevel) {
+        size_t separator = path.find('/');
+        if (topLevel.to.empty() || (!topLevel.from.empty() && path.substr(0, separator) != topLevel.from))
+            return path;
+
+        return separator == std::string::npos ? topLevel.to : topLevel.to + path.substr(separator);
+    }
+
+    /**
+     * Restores the archive relative to the current working directory, or below destinationRoot if it is
+     * given; the daemon extracts for its clients this way, as the working directory is shared by all threads.
+     * The fast profile skips ACLs and file flags and writes regular files itself. With tee the reader copies
+     * the archive to its tee as well, the result is 1 if that copy failed.
+     * topLevel renames the archived directory, e.g. to the name of the cache source restoring an entry which
+     * was archived from a directory entry and holds the key as its directory.
+     */
+    static int extract_from(ArchiveReader &reader, const bool fastExtract, const std::string &destinationRoot,
+                            bool tee, const TopLevel &topLevel = TopLevel()) {
         struct archive *a;
         struct archive *ext;
         struct archive_entry *entry;
@@ -89,26 +886,18 @@ namespace compress {
         /* Select which attributes we want to restore. */
         flags = ARCHIVE_EXTRACT_TIME;
         flags |= ARCHIVE_EXTRACT_PERM;
-        flags |= ARCHIVE_EXTRACT_ACL;
-        flags |= ARCHIVE_EXTRACT_FFLAGS;
-
-        a = archive_read_new();
+        if (!fastExtract) {
+            flags |= ARCHIVE_EXTRACT_ACL;
+            flags |= ARCHIVE_EXTRACT_FFLAGS;
+        }
 
-        if (archive_read_support_filter_all(a) ||
-            archive_read_support_format_all(a) != 0)
-            throw (GzipWriteReadException("GZip Exception", ExitCode::gzipException));
+        a = reader.get();
 
         ext = archive_write_disk_new();
         if (archive_write_disk_set_options(ext, flags) ||
             archive_write_disk_set_standard_lookup(ext) != 0)
             throw (GzipWriteReadException("GZip Exception", ExitCode::gzipException));
 
-        if ((r = archive_read_open_filename(a, filename, 10240))) {
-            fprintf(stderr, "%s\n", archive_error_string(a));
-
-            return 1;
-        }
-
         for (;;) {
             r = archive_read_next_header(a, &entry);
             if (r == ARCHIVE_EOF)
@@ -117,6 +906,26 @@ namespace compress {
                 throw (GzipWriteReadException("GZip Exception", ExitCode::gzipException));
             if (r < ARCHIVE_WARN)
                 throw (GzipWriteReadException("GZip Exception", ExitCode::gzipException));
+            if (!topLevel.to.empty()) {
+                archive_entry_copy_pathname(entry, replace_top_level(archive_entry_pathname(entry),
+                                                                     topLevel).c_str());
+                if (archive_entry_hardlink(entry) != nullptr)
+                    archive_entry_copy_hardlink(entry, replace_top_level(archive_entry_hardlink(entry),
+                                                                         topLevel).c_str());
+            }
+            if (!destinationRoot.empty()) {
+                archive_entry_copy_pathname(entry, (destinationRoot + "/" + archive_entry_pathname(entry)).c_str());
+                if (archive_entry_hardlink(entry) != nullptr)
+                    archive_entry_copy_hardlink(entry,
+                                                (destinationRoot + "/" + archive_entry_hardlink(entry)).c_str());
+            }
+            if (fastExtract &&
+                archive_entry_filetype(entry) == AE_IFREG &&
+                archive_entry_hardlink(entry) == nullptr) {
+                if (write_regular_file(a, entry) != ARCHIVE_OK)
+                    throw (GzipWriteReadException("GZip Exception", ExitCode::gzipException));
+                continue;
+            }
             r = archive_write_header(ext, entry);
             if (r < ARCHIVE_OK)
                 throw (GzipWriteReadException("GZip Exception", ExitCode::gzipException));
@@ -135,12 +944,38 @@ namespace compress {
                 throw (GzipWriteReadException("GZip Exception", ExitCode::gzipException));
         }
 
-        if (archive_read_close(a) ||
-            archive_read_free(a) ||
+        bool teeComplete = !tee || reader.finishTee();
+
+        if (!reader.close() ||
             archive_write_close(ext) ||
             archive_write_free(ext) != 0)
             throw (GzipWriteReadException("GZip Exception", ExitCode::gzipException));
 
-        return 0;
+        return teeComplete ? 0 : 1;
+    }
+
+    static int extract(const char *filename, const bool fastExtract = false, const std::string &destinationRoot = "",
+                       int teeFileDescriptor = -1, const TopLevel &topLevel = TopLevel()) {
+        ArchiveReader reader(filename, fastExtract, teeFileDescriptor);
+
+        return extract_from(reader, fastExtract, destinationRoot, teeFileDescriptor >= 0, topLevel);
+    }
+
+    // extracts an archive while it arrives on a pipe or socket, see extract()
+    static int extract_stream(int streamFileDescriptor, const bool fastExtract = false,
+                              const std::string &destinationRoot = "", int teeFileDescriptor = -1,
+                              const TopLevel &topLevel = TopLevel()) {
+        ArchiveReader reader(streamFileDescriptor, teeFileDescriptor);
+
+        return extract_from(reader, fastExtract, destinationRoot, teeFileDescriptor >= 0, topLevel);
+    }
+
+    // extracts an archive produced by source, see ArchiveReader
+    static int extract_source(const std::function<ssize_t(char *, size_t)> &source, const bool fastExtract = false,
+                              const std::string &destinationRoot = "",
+                              const TopLevel &topLevel = TopLevel()) {
+        ArchiveReader reader(source);
+
+        return extract_from(reader, fastExtract, destinationRoot, false, topLevel);
     }
 }
\ No newline at end of file
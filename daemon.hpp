@@ -0,0 +1,800 @@
+#pragma once //"daemon.hpp"
+
+#include <config.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <deque>
+#include <cerrno>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+#include <grp.h>
+#include <poll.h>
+#include <pwd.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "Exceptions/DaemonException.h"
+#include "cacheIndex.hpp"
+#include "cacheLayout.hpp"
+#include "cacheStore.hpp"
+#include "gc.hpp"
+#include "migration.hpp"
+#include "workerPool.hpp"
+#include "trace.hpp"
+
+/**
+ * cadird, the resident cache daemon. It keeps the entries of one cache destination indexed in memory, lets
+ * only one client build a missing entry and restores and stores entries for its clients on a pool of worker
+ * threads. Clients talk to it over a Unix socket, one request line and one reply line at a time, the fields
+ * of a line are separated by tabs.
+ *
+ *   LOOKUP  key mode                                    -> HIT entry | MISS
+ *   ACQUIRE key mode timeout                            -> HIT entry | BUILD | TIMEOUT
+ *   RELEASE key mode                                    -> OK
+ *   RESTORE key mode cacheSource extractRoot fast       -> OK | ERROR exitCode message
+ *   STORE   key mode cacheSource sync deduplicate adaptive threads chunked
+ *                                                       -> OK | ERROR exitCode message
+ *   STATS                                               -> OK entries bytes hits builds
+ *
+ * mode is "directory" or "archive", paths are absolute. HIT names an entry of the other format if the key exists
+ * only in that one. A client which got BUILD builds the entry and sends
+ * RELEASE, if it disconnects before, the next waiting client builds instead.
+ *
+ * The daemon restores and stores with its own permissions, so only its user and the members of the socket
+ * group are served. The socket file is created 0600, or 0660 with a socket group, and the credentials of
+ * every client are checked as well.
+ */
+namespace cadird {
+    const std::string directoryMode = "directory";
+    const std::string archiveMode = "archive";
+    const size_t maxLineLength = 64 * 1024;
+    const int acceptPollMilliseconds = 500;
+    const gid_t noGroup = (gid_t) -1;
+
+    std::atomic<bool> stopRequested(false);
+
+    void requestStop(int) {
+        stopRequested = true;
+    }
+
+    std::string modeName(bool archive) {
+        return archive ? archiveMode : directoryMode;
+    }
+
+    std::vector<std::string> splitFields(const std::string &line) {
+        std::vector<std::string> fields;
+        size_t start = 0;
+
+        for (;;) {
+            size_t end = line.find('\t', start);
+            fields.push_back(line.substr(start, end == std::string::npos ? std::string::npos : end - start));
+            if (end == std::string::npos)
+                return fields;
+            start = end + 1;
+        }
+    }
+
+    bool socketAddress(const std::string &socketPath, struct sockaddr_un &address) {
+        address = {};
+        address.sun_family = AF_UNIX;
+        if (socketPath.size() >= sizeof(address.sun_path))
+            return false;
+
+        socketPath.copy(address.sun_path, socketPath.size());
+
+        return true;
+    }
+
+    // keys are the md5 of the identity, a key never names another path than its entry
+    bool isKey(const std::string &key) {
+        return key.size() == cacheLayout::entryKeyLength && cacheLayout::isEntryName(key);
+    }
+
+    // the groups of the client process, or of its user in the group database on kernels before 4.13
+    bool isMemberOf(int connection, const struct ucred &credentials, gid_t group) {
+        if (credentials.gid == group)
+            return true;
+
+        std::vector<gid_t> groups(64);
+#ifdef SO_PEERGROUPS
+        socklen_t length = groups.size() * sizeof(gid_t);
+        int result = getsockopt(connection, SOL_SOCKET, SO_PEERGROUPS, groups.data(), &length);
+        if (result != 0 && errno == ERANGE) {
+            groups.resize(length / sizeof(gid_t));
+            result = getsockopt(connection, SOL_SOCKET, SO_PEERGROUPS, groups.data(), &length);
+        }
+        if (result == 0) {
+            groups.resize(length / sizeof(gid_t));
+
+            return std::find(groups.begin(), groups.end(), group) != groups.end();
+        }
+#endif
+
+        struct passwd user{};
+        struct passwd *found = nullptr;
+        std::vector<char> buffer(16 * 1024);
+        if (getpwuid_r(credentials.uid, &user, buffer.data(), buffer.size(), &found) != 0 || found == nullptr)
+            return false;
+
+        int groupCount = groups.size();
+        if (getgrouplist(user.pw_name, credentials.gid, groups.data(), &groupCount) < 0) {
+            groups.resize(groupCount);
+            if (getgrouplist(user.pw_name, credentials.gid, groups.data(), &groupCount) < 0)
+                return false;
+        }
+        groups.resize(groupCount);
+
+        return std::find(groups.begin(), groups.end(), group) != groups.end();
+    }
+
+    /**
+     * Line based reading and writing on a connected socket, the socket is closed with the object.
+     */
+    class Connection {
+    public:
+        explicit Connection(int fileDescriptor) : fileDescriptor(fileDescriptor) {}
+
+        Connection(const Connection &) = delete;
+
+        Connection &operator=(const Connection &) = delete;
+
+        ~Connection() {
+            close(fileDescriptor);
+        }
+
+        bool readLine(std::string &line) {
+            for (;;) {
+                size_t end = buffer.find('\n');
+                if (end != std::string::npos) {
+                    line = buffer.substr(0, end);
+                    buffer.erase(0, end + 1);
+                    return true;
+                }
+                if (buffer.size() > maxLineLength)
+                    return false;
+
+                char chunk[4096];
+                ssize_t bytesRead = recv(fileDescriptor, chunk, sizeof(chunk), 0);
+                if (bytesRead < 0 && errno == EINTR)
+                    continue;
+                if (bytesRead <= 0)
+                    return false;
+
+                buffer.append(chunk, bytesRead);
+            }
+        }
+
+        bool writeLine(const std::vector<std::string> &fields) {
+            std::string line;
+            for (auto &field: fields) {
+                if (field.find_first_of("\t\n") != std::string::npos)
+                    return false;
+                line.append(line.empty() ? "" : "\t").append(field);
+            }
+            line.append("\n");
+
+            size_t written = 0;
+            while (written < line.size()) {
+                ssize_t bytesWritten = send(fileDescriptor, line.data() + written, line.size() - written,
+                                            MSG_NOSIGNAL);
+                if (bytesWritten < 0 && errno == EINTR)
+                    continue;
+                if (bytesWritten <= 0)
+                    return false;
+
+                written += bytesWritten;
+            }
+
+            return true;
+        }
+
+    private:
+        int fileDescriptor;
+        std::string buffer;
+    };
+
+    class Server {
+    public:
+        /**
+         * With gcIntervalSeconds the garbage collection runs with gcOptions in the background that often,
+         * with migrateIntervalSeconds the migration of entries between the formats with migrationOptions.
+         * Besides the user of the daemon the members of socketGroup are served.
+         */
+        Server(const std::string &cacheDestination, const std::string &socketPath, unsigned int workerCount,
+               const gc::Options &gcOptions = gc::Options(), unsigned int gcIntervalSeconds = 0,
+               const migration::Options &migrationOptions = migration::Options(),
+               unsigned int migrateIntervalSeconds = 0, gid_t socketGroup = noGroup)
+                : cacheDestination(cacheDestination), socketPath(socketPath), gcOptions(gcOptions),
+                  gcInterval(gcIntervalSeconds), migrationOptions(migrationOptions),
+                  migrateInterval(migrateIntervalSeconds), socketGroup(socketGroup), workers(workerCount) {}
+
+        /**
+         * Serves until SIGINT or SIGTERM, returns the exit code.
+         */
+        int run() {
+            int listener = listenOnSocket();
+
+            struct sigaction action{};
+            action.sa_handler = requestStop;
+            sigaction(SIGINT, &action, nullptr);
+            sigaction(SIGTERM, &action, nullptr);
+            signal(SIGPIPE, SIG_IGN);
+
+            scan();
+            sizeThread = std::thread([this] { computeSizes(); });
+            trace("Serving " + cacheDestination + " on " + socketPath, true);
+
+            auto nextCollection = std::chrono::steady_clock::now() + gcInterval;
+            auto nextMigration = std::chrono::steady_clock::now() + migrateInterval;
+            while (!stopRequested) {
+                // one maintenance thread runs what is due, the migration first
+                const auto now = std::chrono::steady_clock::now();
+                const bool collectionDue = gcInterval.count() > 0 && now >= nextCollection;
+                const bool migrationDue = migrateInterval.count() > 0 && now >= nextMigration;
+                if ((collectionDue || migrationDue) && !collecting) {
+                    if (gcThread.joinable())
+                        gcThread.join();
+                    collecting = true;
+                    gcThread = std::thread([this, collectionDue, migrationDue] {
+                        if (migrationDue)
+                            migrateEntries();
+                        if (collectionDue)
+                            collectGarbage();
+                        collecting = false;
+                    });
+                    if (collectionDue)
+                        nextCollection = now + gcInterval;
+                    if (migrationDue)
+                        nextMigration = now + migrateInterval;
+                }
+
+                struct pollfd listenerPoll{listener, POLLIN, 0};
+                if (poll(&listenerPoll, 1, acceptPollMilliseconds) <= 0)
+                    continue;
+
+                int connection = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+                if (connection < 0)
+                    continue;
+                if (!isPeerAllowed(connection)) {
+                    close(connection);
+                    continue;
+                }
+
+                std::lock_guard<std::mutex> lock(mutex);
+                connections.insert(connection);
+                activeConnections++;
+                std::thread([this, connection] { serve(connection); }).detach();
+            }
+
+            close(listener);
+            unlink(socketPath.c_str());
+
+            // wake the clients waiting for a build and the blocked reads, then wait for the connection threads
+            std::unique_lock<std::mutex> lock(mutex);
+            stopping = true;
+            for (int connection: connections) {
+                shutdown(connection, SHUT_RDWR);
+            }
+            changed.notify_all();
+            changed.wait(lock, [this] { return activeConnections == 0; });
+            sizesPending.notify_all();
+            lock.unlock();
+            sizeThread.join();
+            if (gcThread.joinable())
+                gcThread.join();
+
+            trace("Stopped", true);
+
+            return ExitCode::ok;
+        }
+
+    private:
+        struct Entry {
+            uintmax_t bytes = 0;
+            time_t lastAccess = 0;
+            uint64_t hits = 0;
+        };
+
+        const std::string cacheDestination;
+        const std::string socketPath;
+        std::mutex mutex;
+        std::condition_variable changed;
+        std::map<std::string, Entry> index;
+        std::set<std::string> buildsInProgress;
+        std::set<int> connections;
+        size_t activeConnections = 0;
+        bool stopping = false;
+        // entries whose size is not known yet, sizes are computed in the background
+        std::deque<std::string> unsized;
+        std::condition_variable sizesPending;
+        std::thread sizeThread;
+        const gc::Options gcOptions;
+        const std::chrono::seconds gcInterval;
+        const migration::Options migrationOptions;
+        const std::chrono::seconds migrateInterval;
+        const gid_t socketGroup;
+        // the garbage collection or migration runs
+        std::atomic<bool> collecting{false};
+        std::thread gcThread;
+        WorkerPool workers;
+
+        int listenOnSocket() {
+            struct sockaddr_un address{};
+            if (!socketAddress(socketPath, address))
+                throw (DaemonException("Socket path is too long", ExitCode::daemonFailed));
+
+            std::error_code errorCode;
+            stdfs::create_directories(stdfs::path(socketPath).parent_path(), errorCode);
+
+            int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            if (listener < 0)
+                throw (DaemonException("Cannot create socket", ExitCode::daemonFailed));
+
+            if (bind(listener, (struct sockaddr *) &address, sizeof(address)) != 0) {
+                if (errno != EADDRINUSE) {
+                    close(listener);
+                    throw (DaemonException("Cannot bind " + socketPath, ExitCode::daemonFailed));
+                }
+
+                // the socket file remains if a daemon was killed, it is only in use if someone answers on it
+                int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+                bool inUse = probe >= 0 && connect(probe, (struct sockaddr *) &address, sizeof(address)) == 0;
+                if (probe >= 0)
+                    close(probe);
+                if (inUse) {
+                    close(listener);
+                    throw (DaemonException("A daemon is already serving " + socketPath, ExitCode::daemonFailed));
+                }
+
+                unlink(socketPath.c_str());
+                if (bind(listener, (struct sockaddr *) &address, sizeof(address)) != 0) {
+                    close(listener);
+                    throw (DaemonException("Cannot bind " + socketPath, ExitCode::daemonFailed));
+                }
+            }
+
+            // until chmod the umask decides, the credential check of every connection covers that moment
+            const mode_t mode = (socketGroup == noGroup) ? S_IRUSR | S_IWUSR : S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP;
+            if ((socketGroup != noGroup && chown(socketPath.c_str(), (uid_t) -1, socketGroup) != 0) ||
+                chmod(socketPath.c_str(), mode) != 0) {
+                close(listener);
+                unlink(socketPath.c_str());
+                throw (DaemonException("Cannot set the permissions of " + socketPath, ExitCode::daemonFailed));
+            }
+
+            if (listen(listener, SOMAXCONN) != 0) {
+                close(listener);
+                throw (DaemonException("Cannot listen on " + socketPath, ExitCode::daemonFailed));
+            }
+
+            return listener;
+        }
+
+        bool isPeerAllowed(int connection) {
+            struct ucred credentials{};
+            socklen_t length = sizeof(credentials);
+            if (getsockopt(connection, SOL_SOCKET, SO_PEERCRED, &credentials, &length) != 0)
+                return false;
+
+            if (credentials.uid == geteuid() ||
+                (socketGroup != noGroup && isMemberOf(connection, credentials, socketGroup)))
+                return true;
+
+            trace("Refused client of user " + std::to_string(credentials.uid));
+
+            return false;
+        }
+
+        // keys, modes and paths of a request, the paths are used with the permissions of the daemon
+        static bool isValidRequest(const std::vector<std::string> &request) {
+            const std::string &command = request[0];
+            if (command == "STATS")
+                return true;
+            if (request.size() < 3 || !isKey(request[1]) ||
+                (request[2] != directoryMode && request[2] != archiveMode))
+                return false;
+            if (command == "RESTORE" && request.size() == 6)
+                return stdfs::path(request[3]).is_absolute() && stdfs::path(request[4]).is_absolute();
+            if (command == "STORE" && request.size() == 9)
+                return stdfs::path(request[3]).is_absolute();
+
+            return true;
+        }
+
+        /**
+         * The only directory walk, afterwards the index is kept up to date by the requests. Sizes are taken
+         * from the index file of the cache destination if it exists, only the other entries are measured.
+         */
+        void scan() {
+            std::error_code errorCode;
+            cacheIndex::Entries indexed;
+            {
+                cacheIndex::MappedIndex indexFile(cacheDestination, false);
+                if (indexFile.isOpen())
+                    indexed = cacheIndex::read(indexFile);
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+
+            for (stdfs::directory_iterator iterator(cacheDestination, errorCode), end;
+                 !errorCode && iterator != end; iterator.increment(errorCode)) {
+                const std::string name = iterator->path().filename().u8string();
+                if (!cacheLayout::isEntryName(name))
+                    continue;
+
+                auto found = indexed.find(name);
+                if (found == indexed.end()) {
+                    addEntry(name);
+                    continue;
+                }
+
+                Entry &entry = index[name];
+                entry.bytes = found->second.size.bytes;
+                entry.lastAccess = found->second.lastAccess;
+                entry.hits = found->second.hits;
+            }
+
+            trace("Indexed " + std::to_string(index.size()) + " entries");
+        }
+
+        // mutex must be held
+        void addEntry(const std::string &name) {
+            Entry &entry = index[name];
+            struct stat status{};
+            const std::string entryPath = (stdfs::path(cacheDestination) / name).u8string();
+            entry.lastAccess = (stat(entryPath.c_str(), &status) == 0) ? status.st_mtime : time(nullptr);
+
+            unsized.push_back(name);
+            sizesPending.notify_one();
+        }
+
+        void computeSizes() {
+            std::unique_lock<std::mutex> lock(mutex);
+
+            for (;;) {
+                sizesPending.wait(lock, [this] { return stopping || !unsized.empty(); });
+                if (stopping)
+                    return;
+
+                const std::string name = unsized.front();
+                unsized.pop_front();
+
+                lock.unlock();
+                uintmax_t bytes = cacheIndex::measure(stdfs::path(cacheDestination) / name).bytes;
+                lock.lock();
+
+                auto found = index.find(name);
+                if (found != index.end())
+                    found->second.bytes = bytes;
+            }
+        }
+
+        void collectGarbage() {
+            gc::Statistics statistics = gc::collect(cacheDestination, gcOptions);
+
+            if (statistics.skipped) {
+                trace("Garbage collection skipped, an eviction runs");
+            } else {
+                trace("Garbage collection evicted " + std::to_string(statistics.evicted.evicted) + " entries, " +
+                      std::to_string(statistics.evicted.bytes) + " bytes");
+                forgetRemovedEntries();
+            }
+        }
+
+        void migrateEntries() {
+            migration::Statistics statistics = migration::migrateEntries(cacheDestination, migrationOptions);
+
+            if (statistics.skipped) {
+                trace("Migration skipped, an eviction runs");
+            } else {
+                trace("Migration archived " + std::to_string(statistics.archived) + " and expanded " +
+                      std::to_string(statistics.expanded) + " entries");
+                // the new formats are added by their next lookup
+                forgetRemovedEntries();
+            }
+        }
+
+        void forgetRemovedEntries() {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (auto iterator = index.begin(); iterator != index.end();) {
+                if (stdfs::exists(stdfs::path(cacheDestination) / iterator->first))
+                    ++iterator;
+                else
+                    iterator = index.erase(iterator);
+            }
+        }
+
+        /**
+         * Name of the entry of the key, mutex must be held. Entries stored by processes which do not use
+         * the daemon are not in the index yet, they are looked up on disk and added.
+         */
+        std::string lookup(const std::string &key, bool archive) {
+            // migrations move entries between the formats, the requested one is preferred
+            std::vector<std::string> names = {key + cacheStore::archiveExtension,
+                                              key + cacheStore::chunkedArchiveExtension};
+            if (archive)
+                names.push_back(key);
+            else
+                names.insert(names.begin(), key);
+
+            // other processes may have evicted the entry meanwhile
+            for (auto &name: names) {
+                auto found = index.find(name);
+                if (found == index.end())
+                    continue;
+                if (stdfs::exists(stdfs::path(cacheDestination) / name))
+                    return name;
+                index.erase(found);
+            }
+            for (auto &name: names) {
+                if (stdfs::exists(stdfs::path(cacheDestination) / name)) {
+                    addEntry(name);
+                    return name;
+                }
+            }
+
+            return "";
+        }
+
+        void serve(int fileDescriptor) {
+            auto connection = std::make_unique<Connection>(fileDescriptor);
+            // builds granted to this connection, they are abandoned if it closes without RELEASE
+            std::set<std::string> building;
+            std::string line;
+
+            while (connection->readLine(line)) {
+                if (!connection->writeLine(handle(splitFields(line), building)))
+                    break;
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                for (auto &buildKey: building) {
+                    trace("Build of " + buildKey + " abandoned");
+                    buildsInProgress.erase(buildKey);
+                }
+                // erased before the descriptor is closed, afterwards accept may reuse the number
+                connections.erase(fileDescriptor);
+            }
+            connection.reset();
+
+            std::lock_guard<std::mutex> lock(mutex);
+            activeConnections--;
+            changed.notify_all();
+        }
+
+        std::vector<std::string> handle(const std::vector<std::string> &request, std::set<std::string> &building) {
+            try {
+                const std::string &command = request[0];
+                bool archive = request.size() > 2 && request[2] == archiveMode;
+                if (!isValidRequest(request))
+                    return {"ERROR", std::to_string(ExitCode::argumentParsingFailed), "Invalid request"};
+
+                if (command == "LOOKUP" && request.size() == 3) {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    std::string name = lookup(request[1], archive);
+
+                    return name.empty() ? std::vector<std::string>{"MISS"} : std::vector<std::string>{"HIT", name};
+                }
+                if (command == "ACQUIRE" && request.size() == 4) {
+                    return acquire(request[1], archive, std::stoul(request[3]), building);
+                }
+                if (command == "RELEASE" && request.size() == 3) {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    buildsInProgress.erase(request[1] + "/" + request[2]);
+                    building.erase(request[1] + "/" + request[2]);
+                    lookup(request[1], archive);
+                    changed.notify_all();
+
+                    return {"OK"};
+                }
+                if (command == "RESTORE" && request.size() == 6) {
+                    return restore(request[1], archive, request[3], request[4], request[5] == "1");
+                }
+                if (command == "STORE" && request.size() == 9) {
+                    compress::ArchiveOptions archiveOptions;
+                    archiveOptions.deduplicate = request[5] == "1";
+                    archiveOptions.adaptiveCompression = request[6] == "1";
+                    archiveOptions.compressionThreads = std::stoul(request[7]);
+                    archiveOptions.chunked = request[8] == "1";
+
+                    return store(request[1], archive, request[3], request[4] == "1", archiveOptions);
+                }
+                if (command == "STATS" && request.size() == 1) {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    uintmax_t bytes = 0;
+                    uint64_t hits = 0;
+                    for (auto &entry: index) {
+                        bytes += entry.second.bytes;
+                        hits += entry.second.hits;
+                    }
+
+                    return {"OK", std::to_string(index.size()), std::to_string(bytes), std::to_string(hits),
+                            std::to_string(buildsInProgress.size())};
+                }
+            } catch (std::exception &exception) {
+                return {"ERROR", std::to_string(ExitCode::argumentParsingFailed), exception.what()};
+            }
+
+            return {"ERROR", std::to_string(ExitCode::argumentParsingFailed), "Unknown request"};
+        }
+
+        std::vector<std::string> acquire(const std::string &key, bool archive, unsigned long timeoutSeconds,
+                                         std::set<std::string> &building) {
+            const std::string buildKey = key + "/" + modeName(archive);
+            const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(timeoutSeconds);
+            std::unique_lock<std::mutex> lock(mutex);
+
+            for (;;) {
+                std::string name = lookup(key, archive);
+                if (!name.empty())
+                    return {"HIT", name};
+                if (timeoutSeconds == 0)
+                    return {"BUILD"};
+                if (buildsInProgress.insert(buildKey).second) {
+                    building.insert(buildKey);
+                    return {"BUILD"};
+                }
+                if (stopping || changed.wait_until(lock, deadline) == std::cv_status::timeout)
+                    return {"TIMEOUT"};
+            }
+        }
+
+        std::vector<std::string> restore(const std::string &key, bool archive, const std::string &cacheSource,
+                                         const std::string &extractRoot, bool fastExtract) {
+            std::string name;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                name = lookup(key, archive);
+            }
+            if (name.empty())
+                return {"ERROR", std::to_string(ExitCode::copyFromCacheFailed), "No cache entry"};
+
+            const std::string targetDirectoryPath = (stdfs::path(cacheDestination) / key).u8string();
+            auto reply = runOnWorker([&] {
+                cacheStore::restore(cacheSource, targetDirectoryPath, cacheStore::defaultCopyOptions, name != key,
+                                    fastExtract, extractRoot);
+            }, ExitCode::copyFromCacheFailed);
+
+            std::lock_guard<std::mutex> lock(mutex);
+            if (reply[0] == "OK") {
+                Entry &entry = index[name];
+                entry.hits++;
+                entry.lastAccess = time(nullptr);
+            } else if (!stdfs::exists(stdfs::path(cacheDestination) / name)) {
+                index.erase(name);
+            }
+
+            return reply;
+        }
+
+        std::vector<std::string> store(const std::string &key, bool archive, const std::string &cacheSource,
+                                       bool syncToDisk, const compress::ArchiveOptions &archiveOptions) {
+            const std::string targetDirectoryPath = (stdfs::path(cacheDestination) / key).u8string();
+            auto reply = runOnWorker([&] {
+                cacheStore::store(cacheSource, cacheDestination, targetDirectoryPath, cacheStore::defaultCopyOptions,
+                                  archive, archiveOptions, syncToDisk);
+            }, ExitCode::copyToCacheFailed);
+
+            std::lock_guard<std::mutex> lock(mutex);
+            lookup(key, archive);
+
+            return reply;
+        }
+
+        std::vector<std::string> runOnWorker(const std::function<void()> &task, ExitCode failureCode) {
+            try {
+                workers.submit(task).get();
+            } catch (CadirException &exception) {
+                return {"ERROR", std::to_string(exception.getErrorCode()), exception.what()};
+            } catch (std::exception &exception) {
+                return {"ERROR", std::to_string(failureCode), exception.what()};
+            }
+
+            return {"OK"};
+        }
+    };
+
+    enum class Acquired {
+        hit,
+        build,
+        timeout,
+        unavailable
+    };
+
+    /**
+     * Client side of the protocol. If the daemon cannot be reached, or goes away, the requests report it
+     * and the caller continues without the daemon.
+     */
+    class Client {
+    public:
+        bool connect(const std::string &socketPath) {
+            struct sockaddr_un address{};
+            if (!socketAddress(socketPath, address))
+                return false;
+
+            int fileDescriptor = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            if (fileDescriptor < 0)
+                return false;
+
+            if (::connect(fileDescriptor, (struct sockaddr *) &address, sizeof(address)) != 0) {
+                close(fileDescriptor);
+                return false;
+            }
+
+            connection = std::make_unique<Connection>(fileDescriptor);
+
+            return true;
+        }
+
+        bool isConnected() const {
+            return connection != nullptr;
+        }
+
+        Acquired acquire(const std::string &key, bool archive, unsigned int timeoutSeconds) {
+            auto reply = request({"ACQUIRE", key, modeName(archive), std::to_string(timeoutSeconds)});
+
+            if (reply.empty())
+                return Acquired::unavailable;
+            if (reply[0] == "HIT")
+                return Acquired::hit;
+            if (reply[0] == "BUILD")
+                return Acquired::build;
+
+            return Acquired::timeout;
+        }
+
+        void release(const std::string &key, bool archive) {
+            request({"RELEASE", key, modeName(archive)});
+        }
+
+        /**
+         * Returns false if the daemon is unavailable, failures of the daemon are thrown with their exit code.
+         */
+        bool restore(const std::string &key, bool archive, const std::string &cacheSource,
+                     const std::string &extractRoot, bool fastExtract) {
+            return succeeded(request({"RESTORE", key, modeName(archive), cacheSource, extractRoot,
+                                      fastExtract ? "1" : "0"}));
+        }
+
+        bool store(const std::string &key, bool archive, const std::string &cacheSource, bool syncToDisk,
+                   const compress::ArchiveOptions &archiveOptions) {
+            return succeeded(request({"STORE", key, modeName(archive), cacheSource, syncToDisk ? "1" : "0",
+                                      archiveOptions.deduplicate ? "1" : "0",
+                                      archiveOptions.adaptiveCompression ? "1" : "0",
+                                      std::to_string(archiveOptions.compressionThreads),
+                                      archiveOptions.chunked ? "1" : "0"}));
+        }
+
+    private:
+        std::unique_ptr<Connection> connection;
+
+        std::vector<std::string> request(const std::vector<std::string> &fields) {
+            std::string line;
+
+            if (!connection || !connection->writeLine(fields) || !connection->readLine(line)) {
+                connection.reset();
+                return {};
+            }
+
+            return splitFields(line);
+        }
+
+        static bool succeeded(const std::vector<std::string> &reply) {
+            if (reply.empty())
+                return false;
+            if (reply[0] == "ERROR" && reply.size() == 3)
+                throw (CadirException(reply[2], std::stoi(reply[1])));
+
+            return true;
+        }
+    };
+}
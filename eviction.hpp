@@ -0,0 +1,180 @@
+#pragma once //"eviction.hpp"
+
+#include <config.h>
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <cerrno>
+#include <cstdio>
+#include <functional>
+#include <unistd.h>
+#include "cacheIndex.hpp"
+#include "cacheLayout.hpp"
+#include "chunkStore.hpp"
+#include "keyLock.hpp"
+#include "lease.hpp"
+#include "workerPool.hpp"
+#include "trace.hpp"
+
+/**
+ * Keeps the cache destination within a size and an entry count by evicting the least recently used
+ * entries. Entries with an active lease or a held key lock (building or restoring) are skipped.
+ */
+namespace eviction {
+    struct Limits {
+        uintmax_t maxBytes = 0;
+        size_t maxEntries = 0;
+
+        bool any() const {
+            return maxBytes > 0 || maxEntries > 0;
+        }
+
+        bool exceeded(uintmax_t bytes, size_t entries) const {
+            return (maxBytes > 0 && bytes > maxBytes) || (maxEntries > 0 && entries > maxEntries);
+        }
+    };
+
+    struct Statistics {
+        size_t evicted = 0;
+        uintmax_t bytes = 0;
+    };
+
+    /**
+     * Renames the entry into the trash, it disappears from the cache destination at once and is deleted
+     * later, its checksums at once. Returns false if the entry does not exist.
+     */
+    bool moveToTrash(const std::string &cacheDestination, const std::string &name) {
+        static std::atomic<unsigned int> sequence(0);
+        const stdfs::path trashDirectory(cacheLayout::trashDirectory(cacheDestination));
+        std::error_code errorCode;
+        stdfs::create_directories(trashDirectory, errorCode);
+
+        const std::string trashPath = (trashDirectory / (name + "." + std::to_string(getpid()) + "." +
+                                                         std::to_string(sequence++))).u8string();
+
+        if (rename((stdfs::path(cacheDestination) / name).c_str(), trashPath.c_str()) != 0)
+            return false;
+        unlink(cacheLayout::checksumFile(cacheDestination, name).c_str());
+
+        return true;
+    }
+
+    // deletes in parallel, the entries of a package manager have many small files
+    void emptyTrash(const std::string &cacheDestination, unsigned int jobs = 1) {
+        std::error_code errorCode;
+        WorkerPool pool(jobs);
+
+        for (stdfs::directory_iterator iterator(cacheLayout::trashDirectory(cacheDestination), errorCode), end;
+             !errorCode && iterator != end; iterator.increment(errorCode)) {
+            pool.submit([path = iterator->path()] {
+                std::error_code removeError;
+                stdfs::remove_all(path, removeError);
+            });
+        }
+    }
+
+    enum class Removal {
+        removed,
+        missing,
+        inUse
+    };
+
+    /**
+     * Moves the entry to the trash unless it is leased or its key lock is taken. With dryRun it only checks.
+     */
+    Removal removeEntry(const std::string &cacheDestination, const std::string &name, bool dryRun) {
+        const std::string key = name.substr(0, cacheLayout::entryKeyLength);
+        if (lease::isLeased(cacheDestination, key))
+            return Removal::inUse;
+
+        // held while the entry is renamed, so no restore reads it meanwhile
+        KeyLock keyLock(cacheLayout::lockFile(cacheDestination, key));
+        if (!keyLock.lockExclusive(0))
+            return Removal::inUse;
+
+        if (dryRun)
+            return stdfs::exists(stdfs::path(cacheDestination) / name) ? Removal::removed : Removal::missing;
+        if (moveToTrash(cacheDestination, name))
+            return Removal::removed;
+
+        return (errno == ENOENT) ? Removal::missing : Removal::inUse;
+    }
+
+    /**
+     * Removes the entries in the given order while done(bytes, count) of the remaining entries is false.
+     * The index is updated once for all of them. The caller holds the eviction lock.
+     */
+    Statistics removeInOrder(const std::string &cacheDestination, const cacheIndex::Entries &entries,
+                             const std::vector<std::string> &order,
+                             const std::function<bool(uintmax_t, size_t)> &done, bool dryRun) {
+        Statistics statistics;
+        uintmax_t bytes = 0;
+        for (auto &entry: entries)
+            bytes += entry.second.size.bytes;
+        size_t count = entries.size();
+        std::vector<std::string> removedNames;
+
+        for (auto &name: order) {
+            if (done(bytes, count))
+                break;
+
+            const uintmax_t entryBytes = entries.at(name).size.bytes;
+            Removal removal = removeEntry(cacheDestination, name, dryRun);
+            if (removal == Removal::inUse)
+                continue;
+
+            if (removal == Removal::removed) {
+                trace((dryRun ? "Would evict " : "Evict ") + name + " (" + std::to_string(entryBytes) + " bytes)",
+                      dryRun);
+                statistics.evicted++;
+                statistics.bytes += entryBytes;
+            }
+            // a missing entry was removed by someone else, it only leaves the index
+            removedNames.push_back(name);
+            bytes -= entryBytes;
+            count--;
+        }
+
+        if (!dryRun)
+            cacheIndex::recordRemovals(cacheDestination, removedNames);
+
+        return statistics;
+    }
+
+    /**
+     * Evicts the least recently used entries until the limits hold. Returns at once if another process is
+     * evicting.
+     */
+    Statistics evict(const std::string &cacheDestination, const Limits &limits) {
+        std::error_code errorCode;
+        stdfs::create_directories(cacheLayout::lockDirectory(cacheDestination), errorCode);
+
+        KeyLock evictionLock(cacheLayout::evictionLockFile(cacheDestination));
+        if (!evictionLock.lockExclusive(0)) {
+            trace("Eviction runs in another process");
+            return Statistics();
+        }
+
+        cacheIndex::Entries entries = cacheIndex::reconcile(cacheDestination, 1);
+
+        std::vector<std::pair<time_t, std::string>> leastRecentlyUsed;
+        for (auto &entry: entries)
+            leastRecentlyUsed.emplace_back(entry.second.lastAccess, entry.first);
+        std::sort(leastRecentlyUsed.begin(), leastRecentlyUsed.end());
+
+        std::vector<std::string> order;
+        for (auto &candidate: leastRecentlyUsed)
+            order.push_back(candidate.second);
+
+        Statistics statistics = removeInOrder(cacheDestination, entries, order,
+                                              [&limits](uintmax_t bytes, size_t count) {
+                                                  return !limits.exceeded(bytes, count);
+                                              }, false);
+        emptyTrash(cacheDestination);
+        if (statistics.evicted > 0)
+            chunkStore::sweep(cacheDestination);
+
+        return statistics;
+    }
+}
@@ -1,3 +1,5 @@
+#pragma once //"exitCodeEnum.hpp"
+
 enum ExitCode {
     ok = 0,
     argumentParsingFailed = 1,
@@ -10,4 +12,8 @@ enum ExitCode {
     cleaningFailed = 8,
     createCacheDirectoriesFailed = 9,
     gzipException = 10,
+    daemonFailed = 11,
+    setupCommandTimedOut = 12,
+    remoteStorageFailed = 13,
+    verificationFailed = 14,
 };
\ No newline at end of file
@@ -0,0 +1,115 @@
+#pragma once //"failureCache.hpp"
+
+#include <config.h>
+#include <cstdio>
+#include <ctime>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <unistd.h>
+#include "cacheLayout.hpp"
+#include "publish.hpp"
+
+/**
+ * Negative cache: failed setup commands are recorded per key, so the jobs of a broken identity file fail
+ * at once instead of running the setup again. A record is a small text file
+ *
+ *   exitCode <exit code of the setup command>
+ *   timedOut <0 or 1>
+ *   time <unix time of the failure>
+ *
+ * followed by an empty line and the end of the output of the setup command.
+ */
+namespace failureCache {
+    // enough for the error of a package manager, small enough to print on every replay
+    const size_t outputTailBytes = 8192;
+
+    struct Failure {
+        bool found = false;
+        int exitCode = 0;
+        bool timedOut = false;
+        time_t time = 0;
+        std::string output;
+    };
+
+    /**
+     * Records the failure, replacing an older record of the key. The record is written under a temporary
+     * name and renamed, readers never see half of it.
+     */
+    bool record(const std::string &cacheDestination, const std::string &key, int exitCode, bool timedOut,
+                const std::string &output) {
+        std::error_code errorCode;
+        stdfs::create_directories(cacheLayout::failureDirectory(cacheDestination), errorCode);
+        if (errorCode)
+            return false;
+
+        std::string temporaryPath;
+        try {
+            temporaryPath = publish::temporaryPath(cacheDestination, key + ".failed");
+        } catch (...) {
+            return false;
+        }
+
+        {
+            std::ofstream file(temporaryPath, std::ios::binary | std::ios::trunc);
+            file << "exitCode " << exitCode << "\n"
+                 << "timedOut " << (timedOut ? 1 : 0) << "\n"
+                 << "time " << (long long) ::time(nullptr) << "\n"
+                 << "\n"
+                 << output;
+            if (!file.good()) {
+                stdfs::remove(temporaryPath, errorCode);
+                return false;
+            }
+        }
+
+        if (rename(temporaryPath.c_str(), cacheLayout::failureFile(cacheDestination, key).c_str()) != 0) {
+            stdfs::remove(temporaryPath, errorCode);
+            return false;
+        }
+
+        return true;
+    }
+
+    /**
+     * The failure of the key if it is younger than ttlSeconds. Expired records are removed.
+     */
+    Failure lookup(const std::string &cacheDestination, const std::string &key, unsigned int ttlSeconds) {
+        Failure failure;
+        const std::string failureFile = cacheLayout::failureFile(cacheDestination, key);
+        std::ifstream file(failureFile, std::ios::binary);
+        if (!file.good())
+            return failure;
+
+        std::string name;
+        long long value = 0;
+        for (int field = 0; field < 3 && file >> name >> value; field++) {
+            if (name == "exitCode")
+                failure.exitCode = (int) value;
+            else if (name == "timedOut")
+                failure.timedOut = value != 0;
+            else if (name == "time")
+                failure.time = (time_t) value;
+        }
+        if (!file.good() || failure.time == 0)
+            return failure;
+
+        if (failure.time + (time_t) ttlSeconds <= ::time(nullptr)) {
+            file.close();
+            unlink(failureFile.c_str());
+            return failure;
+        }
+
+        // skip the rest of the time line and the empty line
+        file.ignore(2);
+        failure.output.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        failure.found = true;
+
+        return failure;
+    }
+
+    // a successful setup ends the failure of the key
+    void clear(const std::string &cacheDestination, const std::string &key) {
+        unlink(cacheLayout::failureFile(cacheDestination, key).c_str());
+    }
+}
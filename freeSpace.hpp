@@ -0,0 +1,114 @@
+#pragma once //"freeSpace.hpp"
+
+#include <config.h>
+#include <future>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/stat.h>
+#include "cacheIndex.hpp"
+#include "gc.hpp"
+#include "workerPool.hpp"
+#include "trace.hpp"
+
+/**
+ * Checks that a new entry fits on the filesystem of its cache destination before it is stored. If it does
+ * not, the least recently used entries are collected until it does, or the entry is not stored at all: a
+ * full disk must not fail the build.
+ */
+namespace freeSpace {
+    // files of a copied entry occupy whole blocks
+    const uintmax_t blockSize = 4096;
+    // for metadata of the copy, archives are smaller than the estimate anyway
+    const double estimateMargin = 1.1;
+
+    uintmax_t roundToBlocks(uintmax_t bytes) {
+        return (bytes + blockSize - 1) / blockSize * blockSize;
+    }
+
+    // bytes of the regular files and directories below path, symlinks are not followed
+    uintmax_t measureTree(const stdfs::path &path) {
+        uintmax_t bytes = blockSize;
+        std::error_code errorCode;
+
+        for (stdfs::recursive_directory_iterator iterator(path, errorCode), end;
+             !errorCode && iterator != end; iterator.increment(errorCode)) {
+            struct stat status{};
+            if (lstat(iterator->path().c_str(), &status) != 0)
+                continue;
+
+            if (S_ISREG(status.st_mode))
+                bytes += roundToBlocks((uintmax_t) status.st_size);
+            else if (S_ISDIR(status.st_mode))
+                bytes += blockSize;
+        }
+
+        return bytes;
+    }
+
+    /**
+     * Size an entry of cacheSource needs at most, like "du". The subdirectories of cacheSource, the
+     * packages of a vendor directory, are measured on jobs threads.
+     */
+    uintmax_t estimateEntrySize(const std::string &cacheSource, unsigned int jobs = 0) {
+        WorkerPool pool(jobs > 0 ? jobs : std::max(std::thread::hardware_concurrency(), 1u));
+        std::vector<std::future<uintmax_t>> sizes;
+        uintmax_t bytes = blockSize;
+        std::error_code errorCode;
+
+        for (stdfs::directory_iterator iterator(cacheSource, errorCode), end;
+             !errorCode && iterator != end; iterator.increment(errorCode)) {
+            struct stat status{};
+            if (lstat(iterator->path().c_str(), &status) != 0)
+                continue;
+
+            if (S_ISDIR(status.st_mode))
+                sizes.push_back(pool.submit([path = iterator->path()] { return measureTree(path); }));
+            else if (S_ISREG(status.st_mode))
+                bytes += roundToBlocks((uintmax_t) status.st_size);
+        }
+
+        for (auto &size: sizes)
+            bytes += size.get();
+
+        return (uintmax_t) ((double) bytes * estimateMargin);
+    }
+
+    /**
+     * True if neededBytes fit into the cache destination with reserveBytes left free. Otherwise the least
+     * recently used entries are collected first, false if that is not enough or could not be enough.
+     * True as well if the free space cannot be read.
+     */
+    bool makeRoom(const std::string &cacheDestination, uintmax_t neededBytes, uintmax_t reserveBytes,
+                  unsigned int jobs = 1) {
+        uintmax_t freeBytes = 0;
+        uintmax_t totalBytes = 0;
+        const uintmax_t wantedBytes = neededBytes + reserveBytes;
+
+        if (!gc::filesystemSpace(cacheDestination, freeBytes, totalBytes))
+            return true;
+        if (freeBytes >= wantedBytes)
+            return true;
+
+        // nothing is removed for an entry which would not fit anyway
+        uintmax_t entryBytes = 0;
+        for (auto &entry: cacheIndex::load(cacheDestination))
+            entryBytes += entry.second.size.bytes;
+        if (freeBytes + entryBytes < wantedBytes) {
+            trace(std::to_string(freeBytes) + " bytes free in " + cacheDestination + " and " +
+                  std::to_string(entryBytes) + " bytes in entries, " + std::to_string(wantedBytes) + " needed");
+            return false;
+        }
+
+        trace(std::to_string(freeBytes) + " bytes free in " + cacheDestination + ", " +
+              std::to_string(wantedBytes) + " needed, collect least recently used entries");
+        gc::Options options;
+        options.freeBytes = wantedBytes;
+        options.jobs = jobs;
+        gc::Statistics statistics = gc::collect(cacheDestination, options);
+        if (statistics.skipped)
+            trace("An eviction or garbage collection of " + cacheDestination + " runs already");
+
+        return gc::filesystemSpace(cacheDestination, freeBytes, totalBytes) && freeBytes >= wantedBytes;
+    }
+}
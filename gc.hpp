@@ -0,0 +1,208 @@
+#pragma once //"gc.hpp"
+
+#include <config.h>
+#include <algorithm>
+#include <chrono>
+#include <ctime>
+#include <limits>
+#include <map>
+#include <string>
+#include <tuple>
+#include <vector>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include "cacheIndex.hpp"
+#include "cacheLayout.hpp"
+#include "chunkStore.hpp"
+#include "eviction.hpp"
+#include "keyLock.hpp"
+#include "snapshot.hpp"
+#include "trace.hpp"
+
+/**
+ * Garbage collection of a cache destination, run by "cadir gc", periodically by the daemon or before a store
+ * which does not fit. It removes entries by a policy until a target size or free space is reached, leftovers
+ * of interrupted stores and chunks which are no longer part of an entry.
+ *
+ *   lru   least recently used first
+ *   lfu   least often restored first
+ *   ttl   every entry unused for maxAgeSeconds, no target needed
+ *   cost  cheapest to rebuild per byte first, the recorded setup duration divided by the entry size
+ */
+namespace gc {
+    enum class Policy {
+        lru,
+        lfu,
+        ttl,
+        cost
+    };
+
+    const std::map<std::string, Policy> policyNames = {
+            {"lru",  Policy::lru},
+            {"lfu",  Policy::lfu},
+            {"ttl",  Policy::ttl},
+            {"cost", Policy::cost}
+    };
+
+    // temporary files and snapshots of stores which did not finish within a day are abandoned
+    const unsigned int defaultStaleSeconds = 86400;
+
+    struct Options {
+        Policy policy = Policy::lru;
+        uintmax_t targetBytes = 0;
+        double freePercent = 0;
+        // bytes which should be free on the filesystem, like freePercent
+        uintmax_t freeBytes = 0;
+        unsigned int maxAgeSeconds = 0;
+        bool dryRun = false;
+        unsigned int jobs = 1;
+        unsigned int staleSeconds = defaultStaleSeconds;
+
+        bool hasTarget() const {
+            return targetBytes > 0 || freePercent > 0 || freeBytes > 0 || (policy == Policy::ttl && maxAgeSeconds > 0);
+        }
+    };
+
+    struct Statistics {
+        bool skipped = false;
+        size_t entries = 0;
+        uintmax_t bytes = 0;
+        eviction::Statistics evicted;
+        size_t staleFiles = 0;
+        chunkStore::Statistics chunks;
+    };
+
+    /**
+     * Names of the entries in the order the policy removes them.
+     */
+    std::vector<std::string> order(const cacheIndex::Entries &entries, const Options &options, time_t now) {
+        // sort key: the value of the policy, then the last access as tie breaker
+        std::vector<std::tuple<double, time_t, std::string>> candidates;
+
+        for (auto &entry: entries) {
+            const cacheIndex::Entry &values = entry.second;
+            double value = 0;
+
+            switch (options.policy) {
+                case Policy::ttl:
+                    if (values.lastAccess + (time_t) options.maxAgeSeconds > now)
+                        continue;
+                    break;
+                case Policy::lfu:
+                    value = (double) values.hits;
+                    break;
+                case Policy::cost:
+                    value = (values.size.bytes > 0) ? values.setupSeconds / (double) values.size.bytes
+                                                    : std::numeric_limits<double>::max();
+                    break;
+                case Policy::lru:
+                    break;
+            }
+
+            candidates.emplace_back(value, values.lastAccess, entry.first);
+        }
+        std::sort(candidates.begin(), candidates.end());
+
+        std::vector<std::string> names;
+        for (auto &candidate: candidates)
+            names.push_back(std::get<2>(candidate));
+
+        return names;
+    }
+
+    bool filesystemSpace(const std::string &cacheDestination, uintmax_t &freeBytes, uintmax_t &totalBytes) {
+        struct statvfs status{};
+        if (statvfs(cacheDestination.c_str(), &status) != 0)
+            return false;
+
+        freeBytes = (uintmax_t) status.f_bavail * status.f_frsize;
+        totalBytes = (uintmax_t) status.f_blocks * status.f_frsize;
+
+        return true;
+    }
+
+    /**
+     * Removes temporary entries and snapshots older than staleSeconds, left by stores which were killed,
+     * and what "cadir verify" quarantined that long ago. Snapshots next to their cache source are removed
+     * through their symlink. Returns the number of removed paths.
+     */
+    size_t removeStale(const std::string &cacheDestination, unsigned int staleSeconds, bool dryRun) {
+        const time_t staleBefore = time(nullptr) - (time_t) staleSeconds;
+        size_t removed = 0;
+
+        for (auto &directory: {cacheLayout::temporaryDirectory(cacheDestination),
+                               cacheLayout::snapshotDirectory(cacheDestination),
+                               cacheLayout::quarantineDirectory(cacheDestination)}) {
+            std::error_code errorCode;
+            for (stdfs::directory_iterator iterator(directory, errorCode), end;
+                 !errorCode && iterator != end; iterator.increment(errorCode)) {
+                // the symlink of a registered snapshot has the time the snapshot was started
+                struct stat status{};
+                if (lstat(iterator->path().c_str(), &status) != 0 || status.st_mtime > staleBefore)
+                    continue;
+
+                trace((dryRun ? "Would remove stale " : "Remove stale ") + iterator->path().u8string(), dryRun);
+                std::error_code removeError;
+                if (dryRun)
+                    removed++;
+                else if (S_ISLNK(status.st_mode) ? snapshot::removeRegistered(iterator->path())
+                                                 : stdfs::remove_all(iterator->path(), removeError) > 0)
+                    removed++;
+            }
+        }
+
+        return removed;
+    }
+
+    /**
+     * Runs the garbage collection. Skipped if an eviction or another collection runs.
+     */
+    Statistics collect(const std::string &cacheDestination, const Options &options) {
+        Statistics statistics;
+        std::error_code errorCode;
+        stdfs::create_directories(cacheLayout::lockDirectory(cacheDestination), errorCode);
+
+        KeyLock evictionLock(cacheLayout::evictionLockFile(cacheDestination));
+        if (!evictionLock.lockExclusive(0)) {
+            statistics.skipped = true;
+            return statistics;
+        }
+
+        // sizes come from the index, only entries it does not know are measured
+        cacheIndex::Entries entries = cacheIndex::reconcile(cacheDestination, options.jobs);
+        statistics.entries = entries.size();
+        for (auto &entry: entries)
+            statistics.bytes += entry.second.size.bytes;
+
+        uintmax_t freeBytes = 0;
+        uintmax_t totalBytes = 0;
+        if ((options.freePercent > 0 || options.freeBytes > 0) &&
+            !filesystemSpace(cacheDestination, freeBytes, totalBytes))
+            trace("Cannot read the free space of " + cacheDestination);
+        const uintmax_t wantedFreeBytes = std::max((uintmax_t) ((double) totalBytes * options.freePercent / 100),
+                                                   totalBytes > 0 ? options.freeBytes : 0);
+        const uintmax_t initialBytes = statistics.bytes;
+
+        auto done = [&options, freeBytes, wantedFreeBytes, initialBytes](uintmax_t bytes, size_t) {
+            if (options.policy == Policy::ttl && options.targetBytes == 0 && options.freePercent <= 0 &&
+                options.freeBytes == 0)
+                return false;
+
+            bool sizeReached = options.targetBytes == 0 || bytes <= options.targetBytes;
+            bool spaceReached = wantedFreeBytes == 0 || freeBytes + (initialBytes - bytes) >= wantedFreeBytes;
+
+            return sizeReached && spaceReached;
+        };
+
+        statistics.evicted = eviction::removeInOrder(cacheDestination, entries,
+                                                     order(entries, options, time(nullptr)), done, options.dryRun);
+        if (!options.dryRun)
+            eviction::emptyTrash(cacheDestination, options.jobs);
+
+        statistics.staleFiles = removeStale(cacheDestination, options.staleSeconds, options.dryRun);
+        // after the stale temporary manifests, which keep their chunks
+        statistics.chunks = chunkStore::sweep(cacheDestination, options.dryRun);
+
+        return statistics;
+    }
+}
@@ -0,0 +1,810 @@
+#pragma once //"integrity.hpp"
+
+#include <config.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <future>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "cacheIndex.hpp"
+#include "cacheLayout.hpp"
+#include "chunkStore.hpp"
+#include "keyLock.hpp"
+#include "lease.hpp"
+#include "publish.hpp"
+#include "workerPool.hpp"
+#include "trace.hpp"
+
+/**
+ * Checksums of cache entries and their verification by "cadir verify" and, sampled, before restores with
+ * --verify-sample. When an entry is stored the size of each of its files and the XXH64 of every 4M block
+ * is written to .cadir/checksums/<entry>:
+ *
+ *   cadir-checksums 1 <inode of the entry>
+ *   f <size> <hash>,<hash>,... <path>
+ *   l <length> <hash> <path>
+ *
+ * Paths are relative to the entry, "." is the file of an archive entry and l lines are symlinks with the
+ * hash of their target. The inode ties the checksums to the entry they were computed for: it survives the
+ * rename which publishes the entry, an entry stored again has another one. Chunks of chunked entries are
+ * checked against their SHA-256 names instead. Corrupt entries are renamed into .cadir/quarantine, so the
+ * next build of the key rebuilds them.
+ */
+namespace integrity {
+    const std::string checksumHeader = "cadir-checksums 1";
+    const uint64_t blockSize = 4 * 1024 * 1024;
+
+    struct File {
+        bool symlink = false;
+        uint64_t size = 0;
+        std::vector<uint64_t> blocks;
+        std::string path;
+    };
+
+    struct Checksums {
+        uint64_t inode = 0;
+        std::vector<File> files;
+    };
+
+    enum class Status {
+        intact,
+        corrupt,
+        // no checksums were recorded for the entry, e.g. it was stored by an older cadir
+        unverified,
+        missing
+    };
+
+    struct Result {
+        Status status = Status::intact;
+        std::string problem;
+        std::vector<std::string> corruptChunks;
+        uint64_t bytes = 0;
+    };
+
+    struct Options {
+        unsigned int jobs = 1;
+        // fraction of the blocks and chunks which are hashed, sizes are always compared
+        double sample = 1;
+        bool dryRun = false;
+    };
+
+    struct Statistics {
+        size_t intact = 0;
+        size_t corrupt = 0;
+        size_t quarantined = 0;
+        size_t unverified = 0;
+        uint64_t bytes = 0;
+    };
+
+    static uint64_t rotateLeft(uint64_t value, int bits) {
+        return (value << bits) | (value >> (64 - bits));
+    }
+
+    static uint64_t read64(const unsigned char *data) {
+        uint64_t value;
+        memcpy(&value, data, sizeof(value));
+        return value;
+    }
+
+    static uint32_t read32(const unsigned char *data) {
+        uint32_t value;
+        memcpy(&value, data, sizeof(value));
+        return value;
+    }
+
+    /**
+     * XXH64, several times faster than the SHA-256 of the chunks. Little endian reads, checksums are only
+     * compared on the machines which share a cache destination.
+     */
+    uint64_t xxh64(const void *input, size_t length, uint64_t seed = 0) {
+        const uint64_t prime1 = 0x9E3779B185EBCA87ULL;
+        const uint64_t prime2 = 0xC2B2AE3D27D4EB4FULL;
+        const uint64_t prime3 = 0x165667B19E3779F9ULL;
+        const uint64_t prime4 = 0x85EBCA77C2B2AE63ULL;
+        const uint64_t prime5 = 0x27D4EB2F165667C5ULL;
+        auto round = [&](uint64_t accumulator, uint64_t lane) {
+            return rotateLeft(accumulator + lane * prime2, 31) * prime1;
+        };
+        auto merge = [&](uint64_t hash, uint64_t accumulator) {
+            return (hash ^ round(0, accumulator)) * prime1 + prime4;
+        };
+
+        const unsigned char *data = static_cast<const unsigned char *>(input);
+        const unsigned char *end = data + length;
+        uint64_t hash;
+
+        if (length >= 32) {
+            uint64_t v1 = seed + prime1 + prime2;
+            uint64_t v2 = seed + prime2;
+            uint64_t v3 = seed;
+            uint64_t v4 = seed - prime1;
+            for (; data + 32 <= end; data += 32) {
+                v1 = round(v1, read64(data));
+                v2 = round(v2, read64(data + 8));
+                v3 = round(v3, read64(data + 16));
+                v4 = round(v4, read64(data + 24));
+            }
+            hash = rotateLeft(v1, 1) + rotateLeft(v2, 7) + rotateLeft(v3, 12) + rotateLeft(v4, 18);
+            hash = merge(merge(merge(merge(hash, v1), v2), v3), v4);
+        } else {
+            hash = seed + prime5;
+        }
+
+        hash += length;
+        for (; data + 8 <= end; data += 8)
+            hash = rotateLeft(hash ^ round(0, read64(data)), 27) * prime1 + prime4;
+        if (data + 4 <= end) {
+            hash = rotateLeft(hash ^ (read32(data) * prime1), 23) * prime2 + prime3;
+            data += 4;
+        }
+        for (; data < end; data++)
+            hash = rotateLeft(hash ^ (*data * prime5), 11) * prime1;
+
+        hash ^= hash >> 33;
+        hash *= prime2;
+        hash ^= hash >> 29;
+        hash *= prime3;
+        hash ^= hash >> 32;
+
+        return hash;
+    }
+
+    uint64_t blockCount(uint64_t size) {
+        return std::max<uint64_t>(1, (size + blockSize - 1) / blockSize);
+    }
+
+    // hash of the block with the index of the file of the given size, throws if it cannot be read completely
+    uint64_t hashBlock(const std::string &path, uint64_t index, uint64_t size) {
+        thread_local std::vector<char> buffer(blockSize);
+        const uint64_t offset = index * blockSize;
+        const size_t length = (size_t) std::min(blockSize, size > offset ? size - offset : 0);
+
+        int fileDescriptor = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fileDescriptor < 0)
+            throw std::runtime_error("cannot open " + path);
+
+        size_t done = 0;
+        while (done < length) {
+            ssize_t count = pread(fileDescriptor, buffer.data() + done, length - done, (off_t) (offset + done));
+            if (count < 0 && errno == EINTR)
+                continue;
+            if (count <= 0)
+                break;
+            done += (size_t) count;
+        }
+        close(fileDescriptor);
+
+        if (done < length)
+            throw std::runtime_error("cannot read " + path);
+
+        return xxh64(buffer.data(), length);
+    }
+
+    std::string readSymlink(const std::string &path) {
+        std::error_code errorCode;
+        const std::string target = stdfs::read_symlink(path, errorCode).u8string();
+        if (errorCode)
+            throw std::runtime_error("cannot read symlink " + path);
+
+        return target;
+    }
+
+    // path of a file listed in the checksums of the entry
+    std::string filePath(const std::string &entryPath, const std::string &relative) {
+        return relative == "." ? entryPath : (stdfs::path(entryPath) / relative).u8string();
+    }
+
+    /**
+     * Sizes and block hashes of the files of the entry at entryPath, an archive or a directory. The blocks
+     * are hashed on the pool.
+     */
+    Checksums compute(const std::string &entryPath, WorkerPool &pool) {
+        Checksums checksums;
+        struct stat status{};
+        if (lstat(entryPath.c_str(), &status) != 0)
+            throw std::runtime_error("cannot read " + entryPath);
+        checksums.inode = (uint64_t) status.st_ino;
+
+        auto add = [&checksums](const std::string &path, const std::string &relative, const struct stat &status) {
+            File file;
+            file.path = relative;
+            if (S_ISLNK(status.st_mode)) {
+                const std::string target = readSymlink(path);
+                file.symlink = true;
+                file.size = target.size();
+                file.blocks.push_back(xxh64(target.data(), target.size()));
+            } else {
+                file.size = (uint64_t) status.st_size;
+            }
+            checksums.files.push_back(file);
+        };
+
+        if (S_ISREG(status.st_mode)) {
+            add(entryPath, ".", status);
+        } else {
+            for (stdfs::recursive_directory_iterator iterator(entryPath), end; iterator != end; ++iterator) {
+                const std::string relative = iterator->path().lexically_relative(entryPath).u8string();
+                struct stat fileStatus{};
+                // a line per file, such paths stay unverified
+                if (relative.find('\n') != std::string::npos || lstat(iterator->path().c_str(), &fileStatus) != 0)
+                    continue;
+                if (S_ISREG(fileStatus.st_mode) || S_ISLNK(fileStatus.st_mode))
+                    add(iterator->path().u8string(), relative, fileStatus);
+            }
+        }
+
+        std::vector<std::future<uint64_t>> hashes;
+        for (auto &file: checksums.files) {
+            if (file.symlink)
+                continue;
+            const std::string path = filePath(entryPath, file.path);
+            for (uint64_t index = 0; index < blockCount(file.size); index++)
+                hashes.push_back(pool.submit([path, index, size = file.size] { return hashBlock(path, index, size); }));
+        }
+        size_t next = 0;
+        for (auto &file: checksums.files) {
+            if (file.symlink)
+                continue;
+            for (uint64_t index = 0; index < blockCount(file.size); index++)
+                file.blocks.push_back(hashes[next++].get());
+        }
+
+        return checksums;
+    }
+
+    /**
+     * Hashes a file in blocks while it is written, so its checksums need no second read.
+     */
+    class BlockHasher {
+    public:
+        void write(const char *data, size_t length) {
+            size += length;
+            while (length > 0) {
+                const size_t part = std::min(length, (size_t) blockSize - block.size());
+                block.insert(block.end(), data, data + part);
+                data += part;
+                length -= part;
+
+                if (block.size() == blockSize) {
+                    blocks.push_back(xxh64(block.data(), block.size()));
+                    block.clear();
+                }
+            }
+        }
+
+        // the checksums of the file written so far, its path relative to the entry
+        File finish(const std::string &path) {
+            if (!block.empty() || blocks.empty())
+                blocks.push_back(xxh64(block.data(), block.size()));
+            block.clear();
+
+            File file;
+            file.path = path;
+            file.size = size;
+            file.blocks = blocks;
+
+            return file;
+        }
+
+    private:
+        std::vector<char> block;
+        std::vector<uint64_t> blocks;
+        uint64_t size = 0;
+    };
+
+    /**
+     * Copies the regular file source to target and hashes it on the way.
+     */
+    File copyFile(const stdfs::path &source, const stdfs::path &target, const std::string &relative) {
+        thread_local std::vector<char> buffer(blockSize);
+
+        int sourceDescriptor = open(source.c_str(), O_RDONLY | O_CLOEXEC);
+        if (sourceDescriptor < 0)
+            throw stdfs::filesystem_error("Cannot open", source, std::error_code(errno, std::generic_category()));
+
+        struct stat status{};
+        fstat(sourceDescriptor, &status);
+        posix_fadvise(sourceDescriptor, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+        int targetDescriptor = open(target.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, status.st_mode & 07777);
+        if (targetDescriptor < 0) {
+            int error = errno;
+            close(sourceDescriptor);
+            throw stdfs::filesystem_error("Cannot create", target, std::error_code(error, std::generic_category()));
+        }
+
+        File file;
+        file.path = relative;
+        bool complete = true;
+        while (complete) {
+            // whole blocks are read, so every block is hashed once from the buffer
+            size_t length = 0;
+            while (length < buffer.size()) {
+                ssize_t count = read(sourceDescriptor, buffer.data() + length, buffer.size() - length);
+                if (count < 0 && errno == EINTR)
+                    continue;
+                if (count < 0)
+                    complete = false;
+                if (count <= 0)
+                    break;
+                length += (size_t) count;
+            }
+            if (!complete || (length == 0 && !file.blocks.empty()))
+                break;
+
+            file.size += length;
+            file.blocks.push_back(xxh64(buffer.data(), length));
+            for (size_t done = 0; complete && done < length;) {
+                ssize_t written = write(targetDescriptor, buffer.data() + done, length - done);
+                if (written < 0 && errno == EINTR)
+                    continue;
+                if (written <= 0)
+                    complete = false;
+                else
+                    done += (size_t) written;
+            }
+            if (length < buffer.size())
+                break;
+        }
+
+        close(sourceDescriptor);
+        if (close(targetDescriptor) != 0 || !complete)
+            throw stdfs::filesystem_error("Cannot copy", source, target,
+                                          std::error_code(EIO, std::generic_category()));
+
+        return file;
+    }
+
+    /**
+     * Copies the directory source to the new directory target like stdfs::copy() with recursive and
+     * copy_symlinks, and returns the checksums of the copy, hashed while it was written. Other files than
+     * directories, regular files and symlinks cannot be copied.
+     */
+    Checksums copyTree(const stdfs::path &source, const stdfs::path &target) {
+        Checksums checksums;
+        stdfs::create_directories(target);
+
+        for (stdfs::recursive_directory_iterator iterator(source), end; iterator != end; ++iterator) {
+            const std::string relative = iterator->path().lexically_relative(source).u8string();
+            const stdfs::path targetPath = target / relative;
+            // a line per file, such paths stay unverified
+            const bool listed = relative.find('\n') == std::string::npos;
+
+            if (iterator->is_symlink()) {
+                stdfs::copy_symlink(iterator->path(), targetPath);
+                if (listed) {
+                    const std::string symlinkTarget = readSymlink(targetPath.u8string());
+                    File file;
+                    file.symlink = true;
+                    file.path = relative;
+                    file.size = symlinkTarget.size();
+                    file.blocks.push_back(xxh64(symlinkTarget.data(), symlinkTarget.size()));
+                    checksums.files.push_back(file);
+                }
+            } else if (iterator->is_directory()) {
+                stdfs::create_directory(targetPath, iterator->path());
+            } else if (iterator->is_regular_file()) {
+                File file = copyFile(iterator->path(), targetPath, relative);
+                if (listed)
+                    checksums.files.push_back(file);
+            } else {
+                throw stdfs::filesystem_error("Cannot copy", iterator->path(),
+                                              std::make_error_code(std::errc::not_supported));
+            }
+        }
+
+        return checksums;
+    }
+
+    std::string serialize(const Checksums &checksums) {
+        std::ostringstream content;
+        content << checksumHeader << " " << checksums.inode << "\n";
+
+        for (auto &file: checksums.files) {
+            content << (file.symlink ? "l " : "f ") << file.size << " ";
+            char hex[17];
+            for (size_t i = 0; i < file.blocks.size(); i++) {
+                snprintf(hex, sizeof(hex), "%016llx", (unsigned long long) file.blocks[i]);
+                content << (i > 0 ? "," : "") << hex;
+            }
+            content << " " << file.path << "\n";
+        }
+
+        return content.str();
+    }
+
+    Checksums parse(const std::string &content) {
+        std::istringstream lines(content);
+        std::string line;
+        Checksums checksums;
+
+        if (!std::getline(lines, line) || line.compare(0, checksumHeader.size() + 1, checksumHeader + " ") != 0)
+            throw std::runtime_error("invalid checksums");
+        checksums.inode = std::stoull(line.substr(checksumHeader.size() + 1));
+
+        while (std::getline(lines, line)) {
+            // type, size and hashes contain no spaces, the path is the rest of the line
+            const size_t sizeEnd = line.find(' ', 2);
+            const size_t hashesEnd = sizeEnd == std::string::npos ? sizeEnd : line.find(' ', sizeEnd + 1);
+            if (line.size() < 2 || (line[0] != 'f' && line[0] != 'l') || line[1] != ' ' ||
+                hashesEnd == std::string::npos)
+                throw std::runtime_error("invalid checksums");
+
+            File file;
+            file.symlink = line[0] == 'l';
+            file.size = std::stoull(line.substr(2, sizeEnd - 2));
+            std::istringstream hashes(line.substr(sizeEnd + 1, hashesEnd - sizeEnd - 1));
+            std::string hash;
+            while (std::getline(hashes, hash, ','))
+                file.blocks.push_back(std::stoull(hash, nullptr, 16));
+            file.path = line.substr(hashesEnd + 1);
+
+            if (file.blocks.size() != (file.symlink ? 1 : blockCount(file.size)))
+                throw std::runtime_error("invalid checksums");
+            checksums.files.push_back(file);
+        }
+
+        return checksums;
+    }
+
+    /**
+     * Checksums of the entry at entryPath before it is published, see record(). Empty if they cannot be
+     * computed, the entry stays unverified then. jobs 0 hashes on one thread per core.
+     */
+    std::string computeChecksums(const std::string &entryPath, unsigned int jobs = 0) {
+        try {
+            WorkerPool pool(jobs > 0 ? jobs : std::max(std::thread::hardware_concurrency(), 1u));
+            return serialize(compute(entryPath, pool));
+        } catch (std::exception &exception) {
+            trace(std::string("Cannot compute checksums: ") + exception.what());
+            return "";
+        }
+    }
+
+    /**
+     * Checksums of the entry at entryPath before it is published from the files hashed while they were
+     * written, see BlockHasher and copyTree(). Empty if the entry differs in a size, e.g. the hashes missed
+     * a write, the entry stays unverified then.
+     */
+    std::string writtenChecksums(const std::string &entryPath, Checksums checksums) {
+        struct stat status{};
+        if (lstat(entryPath.c_str(), &status) != 0)
+            return "";
+        checksums.inode = (uint64_t) status.st_ino;
+
+        for (auto &file: checksums.files) {
+            struct stat fileStatus{};
+            if (lstat(filePath(entryPath, file.path).c_str(), &fileStatus) != 0 ||
+                (!file.symlink && (uint64_t) fileStatus.st_size != file.size)) {
+                trace("Cannot compute checksums: " + file.path + " changed");
+                return "";
+            }
+        }
+
+        return serialize(checksums);
+    }
+
+    /**
+     * Writes the checksums of the entry name after it was published. Written afterwards, the checksums of
+     * a store which lost the race to publish never replace those of the published entry.
+     */
+    void record(const std::string &cacheDestination, const std::string &name, const std::string &checksums) {
+        if (checksums.empty())
+            return;
+
+        try {
+            std::error_code errorCode;
+            stdfs::create_directories(cacheLayout::checksumDirectory(cacheDestination), errorCode);
+            const std::string temporaryPath = publish::temporaryPath(cacheDestination, name + ".checksums");
+            chunkStore::writeFile(temporaryPath, checksums, false);
+            if (rename(temporaryPath.c_str(), cacheLayout::checksumFile(cacheDestination, name).c_str()) != 0) {
+                unlink(temporaryPath.c_str());
+                trace("Cannot record checksums of " + name);
+            }
+        } catch (std::exception &exception) {
+            trace("Cannot record checksums of " + name + ": " + exception.what());
+        }
+    }
+
+    /**
+     * Checksums of the entry name in fromDestination for its copy at copyPath, which is published in
+     * another cache destination, e.g. a tier. The copy is verified against the original, so a broken copy
+     * is found as well. Empty if the original has none.
+     */
+    std::string copyChecksums(const std::string &fromDestination, const std::string &name,
+                              const std::string &copyPath) {
+        struct stat original{};
+        struct stat copy{};
+        if (lstat((stdfs::path(fromDestination) / name).c_str(), &original) != 0 ||
+            lstat(copyPath.c_str(), &copy) != 0)
+            return "";
+
+        try {
+            Checksums checksums = parse(chunkStore::readFile(cacheLayout::checksumFile(fromDestination, name)));
+            if (checksums.inode != (uint64_t) original.st_ino)
+                return "";
+            checksums.inode = (uint64_t) copy.st_ino;
+
+            return serialize(checksums);
+        } catch (std::exception &) {
+            return "";
+        }
+    }
+
+    /**
+     * Compares the entry name with its checksums. All sizes are compared, a sample of the blocks and chunks
+     * is hashed on the pool; sample 1 hashes everything and at least one block is hashed.
+     */
+    Result verify(const std::string &cacheDestination, const std::string &name, double sample, WorkerPool &pool) {
+        Result result;
+        const std::string entryPath = (stdfs::path(cacheDestination) / name).u8string();
+        struct stat status{};
+        if (lstat(entryPath.c_str(), &status) != 0) {
+            result.status = Status::missing;
+            return result;
+        }
+
+        thread_local std::mt19937_64 random(std::random_device{}());
+        std::uniform_real_distribution<double> distribution(0, 1);
+        auto sampled = [&]() { return sample >= 1 || distribution(random) < sample; };
+        auto fail = [&result](const std::string &problem) {
+            if (result.status != Status::corrupt) {
+                result.status = Status::corrupt;
+                result.problem = problem;
+            }
+        };
+
+        Checksums checksums;
+        try {
+            checksums = parse(chunkStore::readFile(cacheLayout::checksumFile(cacheDestination, name)));
+        } catch (std::exception &) {
+            result.status = Status::unverified;
+        }
+        // left over from an entry of the same name which was removed
+        if (result.status == Status::intact && checksums.inode != (uint64_t) status.st_ino)
+            result.status = Status::unverified;
+
+        // the blocks to hash, as file and block index
+        std::vector<std::pair<const File *, uint64_t>> blocks;
+        std::vector<std::future<uint64_t>> hashes;
+        auto describe = [&name](const File &file) { return file.path == "." ? name : file.path; };
+        if (result.status == Status::intact) {
+            for (auto &file: checksums.files) {
+                const std::string path = filePath(entryPath, file.path);
+                struct stat fileStatus{};
+                if (lstat(path.c_str(), &fileStatus) != 0) {
+                    fail("missing " + describe(file));
+                    continue;
+                }
+
+                if (file.symlink) {
+                    std::string target;
+                    try {
+                        target = readSymlink(path);
+                    } catch (std::exception &) {
+                    }
+                    if (!S_ISLNK(fileStatus.st_mode) || xxh64(target.data(), target.size()) != file.blocks[0])
+                        fail("changed symlink " + describe(file));
+                    continue;
+                }
+                if (!S_ISREG(fileStatus.st_mode) || (uint64_t) fileStatus.st_size != file.size) {
+                    fail("size of " + describe(file) + " is " + std::to_string(fileStatus.st_size) +
+                         " instead of " + std::to_string(file.size));
+                    continue;
+                }
+
+                result.bytes += file.size;
+                for (uint64_t index = 0; index < file.blocks.size(); index++) {
+                    if (sampled())
+                        blocks.emplace_back(&file, index);
+                }
+            }
+
+            if (blocks.empty() && result.status == Status::intact && sample > 0) {
+                for (auto &file: checksums.files) {
+                    if (!file.symlink) {
+                        blocks.emplace_back(&file, 0);
+                        break;
+                    }
+                }
+            }
+            for (auto &block: blocks) {
+                hashes.push_back(pool.submit([path = filePath(entryPath, block.first->path), index = block.second,
+                                                     size = block.first->size] {
+                    return hashBlock(path, index, size);
+                }));
+            }
+        }
+
+        // chunks are named by their hash, they are checked with or without checksums of the manifest
+        std::vector<std::pair<std::string, std::future<bool>>> chunkChecks;
+        if (name.size() > cacheLayout::chunkedExtension.size() &&
+            name.compare(name.size() - cacheLayout::chunkedExtension.size(), std::string::npos,
+                         cacheLayout::chunkedExtension) == 0) {
+            std::vector<chunkStore::Chunk> chunks;
+            try {
+                chunks = chunkStore::readManifest(entryPath);
+            } catch (std::exception &) {
+                fail("invalid chunk manifest");
+            }
+
+            std::unordered_set<std::string> seen;
+            for (auto &chunk: chunks) {
+                if (!seen.insert(chunk.hash).second)
+                    continue;
+
+                const std::string path = cacheLayout::chunkFile(cacheDestination, chunk.hash);
+                struct stat chunkStatus{};
+                if (lstat(path.c_str(), &chunkStatus) != 0) {
+                    fail("missing chunk " + chunk.hash);
+                    continue;
+                }
+                if ((uint64_t) chunkStatus.st_size != chunk.storedSize) {
+                    fail("size of chunk " + chunk.hash + " is " + std::to_string(chunkStatus.st_size) +
+                         " instead of " + std::to_string(chunk.storedSize));
+                    result.corruptChunks.push_back(chunk.hash);
+                    continue;
+                }
+                if (sampled()) {
+                    chunkChecks.emplace_back(chunk.hash, pool.submit([path, chunk] {
+                        return chunkStore::hashChunk(chunkStore::decompressChunk(chunkStore::readFile(path),
+                                                                                 chunk.size).data(),
+                                                     chunk.size) == chunk.hash;
+                    }));
+                }
+            }
+            if (result.status == Status::unverified && !chunks.empty())
+                result.status = Status::intact;
+        }
+
+        for (size_t i = 0; i < hashes.size(); i++) {
+            try {
+                if (hashes[i].get() != blocks[i].first->blocks[blocks[i].second])
+                    fail("changed content of " + describe(*blocks[i].first));
+            } catch (std::exception &exception) {
+                fail(exception.what());
+            }
+        }
+        for (auto &check: chunkChecks) {
+            bool intact = false;
+            try {
+                intact = check.second.get();
+            } catch (std::exception &) {
+            }
+            if (!intact) {
+                fail("changed content of chunk " + check.first);
+                result.corruptChunks.push_back(check.first);
+            }
+        }
+
+        return result;
+    }
+
+    // renamed into the quarantine and touched, "cadir gc" removes it after --stale-after seconds
+    bool moveToQuarantine(const std::string &cacheDestination, const std::string &path, const std::string &name) {
+        static std::atomic<unsigned int> sequence(0);
+        std::error_code errorCode;
+        stdfs::create_directories(cacheLayout::quarantineDirectory(cacheDestination), errorCode);
+
+        const std::string quarantinePath = (stdfs::path(cacheLayout::quarantineDirectory(cacheDestination)) /
+                                            (name + "." + std::to_string(getpid()) + "." +
+                                             std::to_string(sequence++))).u8string();
+        if (rename(path.c_str(), quarantinePath.c_str()) != 0)
+            return false;
+        chunkStore::touch(quarantinePath);
+
+        return true;
+    }
+
+    /**
+     * Renames the corrupt entry and its corrupt chunks into the quarantine, waiting up to timeoutSeconds for
+     * restores of the entry to end. Returns false if the entry is leased or still in use. Chunks are
+     * quarantined in any case, a new store of the key would reuse them otherwise.
+     */
+    bool quarantine(const std::string &cacheDestination, const std::string &name,
+                    const std::vector<std::string> &corruptChunks, unsigned int timeoutSeconds) {
+        for (auto &hash: corruptChunks) {
+            if (moveToQuarantine(cacheDestination, cacheLayout::chunkFile(cacheDestination, hash), hash))
+                trace("Quarantined chunk " + hash);
+        }
+
+        const std::string key = name.substr(0, cacheLayout::entryKeyLength);
+        if (lease::isLeased(cacheDestination, key))
+            return false;
+
+        std::error_code errorCode;
+        stdfs::create_directories(cacheLayout::lockDirectory(cacheDestination), errorCode);
+        KeyLock keyLock(cacheLayout::lockFile(cacheDestination, key));
+        if (!keyLock.lockExclusive(timeoutSeconds))
+            return false;
+
+        if (!moveToQuarantine(cacheDestination, (stdfs::path(cacheDestination) / name).u8string(), name))
+            return false;
+        unlink(cacheLayout::checksumFile(cacheDestination, name).c_str());
+        cacheIndex::recordRemovals(cacheDestination, {name});
+        trace("Quarantined " + name);
+
+        return true;
+    }
+
+    /**
+     * Entry names of keys, or of all entries of the cache destination if keys is empty. A key may also be
+     * given as an entry name.
+     */
+    std::vector<std::string> entryNames(const std::string &cacheDestination, const std::vector<std::string> &keys) {
+        std::vector<std::string> entries;
+        std::error_code errorCode;
+
+        for (stdfs::directory_iterator iterator(cacheDestination, errorCode), end;
+             !errorCode && iterator != end; iterator.increment(errorCode)) {
+            const std::string name = iterator->path().filename().u8string();
+            if (cacheLayout::isEntryName(name))
+                entries.push_back(name);
+        }
+        std::sort(entries.begin(), entries.end());
+        if (keys.empty())
+            return entries;
+
+        // a key may exist in several formats
+        std::vector<std::string> names;
+        for (auto &key: keys) {
+            const size_t count = names.size();
+            for (auto &name: entries) {
+                if (name == key ||
+                    (key.size() == cacheLayout::entryKeyLength && name.compare(0, key.size(), key) == 0))
+                    names.push_back(name);
+            }
+            if (names.size() == count)
+                trace("No entry for key " + key, true);
+        }
+
+        return names;
+    }
+
+    /**
+     * Verifies the entries of keys, or all entries, and quarantines the corrupt ones unless dryRun. Entries
+     * in use are only reported, the next verification quarantines them.
+     */
+    Statistics verifyEntries(const std::string &cacheDestination, const std::vector<std::string> &keys,
+                             const Options &options) {
+        Statistics statistics;
+        WorkerPool pool(options.jobs);
+
+        for (auto &name: entryNames(cacheDestination, keys)) {
+            Result result = verify(cacheDestination, name, options.sample, pool);
+
+            if (result.status == Status::intact) {
+                trace("Intact: " + name);
+                statistics.intact++;
+                statistics.bytes += result.bytes;
+            } else if (result.status == Status::unverified) {
+                trace("No checksums: " + name);
+                statistics.unverified++;
+            } else if (result.status == Status::corrupt) {
+                trace("Corrupt: " + name + ", " + result.problem, true);
+                statistics.corrupt++;
+                if (options.dryRun)
+                    continue;
+                if (quarantine(cacheDestination, name, result.corruptChunks, 0))
+                    statistics.quarantined++;
+                else
+                    trace(name + " is in use, it is quarantined by the next verification", true);
+            }
+        }
+
+        return statistics;
+    }
+}
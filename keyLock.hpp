@@ -0,0 +1,73 @@
+#pragma once //"keyLock.hpp"
+
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <chrono>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+
+/**
+ * Advisory flock on a lock file of a cache key. The lock is released when the object is destroyed,
+ * also if the process dies, so a crashed build never blocks the key.
+ */
+class KeyLock {
+public:
+    explicit KeyLock(const std::string &lockFile) {
+        fileDescriptor = open(lockFile.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    }
+
+    KeyLock(const KeyLock &) = delete;
+
+    KeyLock &operator=(const KeyLock &) = delete;
+
+    ~KeyLock() {
+        if (fileDescriptor >= 0)
+            close(fileDescriptor);
+    }
+
+    bool isOpen() const {
+        return fileDescriptor >= 0;
+    }
+
+    /**
+     * Waits up to timeoutSeconds for the lock, polling with a growing interval up to one second.
+     */
+    bool lock(int operation, unsigned int timeoutSeconds) {
+        if (fileDescriptor < 0)
+            return false;
+
+        const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(timeoutSeconds);
+        auto interval = std::chrono::milliseconds(10);
+
+        while (flock(fileDescriptor, operation | LOCK_NB) != 0) {
+            if (errno != EWOULDBLOCK && errno != EINTR)
+                return false;
+            if (std::chrono::steady_clock::now() >= deadline)
+                return false;
+
+            std::this_thread::sleep_for(interval);
+            interval = std::min(interval * 2, std::chrono::milliseconds(1000));
+        }
+
+        return true;
+    }
+
+    bool lockExclusive(unsigned int timeoutSeconds) {
+        return lock(LOCK_EX, timeoutSeconds);
+    }
+
+    bool lockShared(unsigned int timeoutSeconds) {
+        return lock(LOCK_SH, timeoutSeconds);
+    }
+
+    void unlock() {
+        if (fileDescriptor >= 0)
+            flock(fileDescriptor, LOCK_UN);
+    }
+
+private:
+    int fileDescriptor = -1;
+};
@@ -0,0 +1,99 @@
+#pragma once //"lease.hpp"
+
+#include <config.h>
+#include <string>
+#include <ctime>
+#include <cerrno>
+#include <csignal>
+#include <utime.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "cacheLayout.hpp"
+
+/**
+ * Read leases protect cache entries which are in use, e.g. linked into a running build, from eviction.
+ * A lease is a file per holder whose mtime is its expiry. On the holder's host the lease also ends
+ * when the holder process is gone, on other hosts (shared cache destinations) only the expiry counts.
+ */
+namespace lease {
+    std::string hostName() {
+        char name[256] = {};
+
+        if (gethostname(name, sizeof(name) - 1) != 0)
+            return "localhost";
+
+        return std::string(name);
+    }
+
+    /**
+     * Takes or extends the lease of holderPid on the entry for ttlSeconds.
+     */
+    bool acquire(const std::string &cacheDestination, const std::string &key, unsigned int ttlSeconds,
+                 pid_t holderPid) {
+        std::error_code errorCode;
+        stdfs::create_directories(cacheLayout::leaseDirectory(cacheDestination), errorCode);
+        if (errorCode)
+            return false;
+
+        const std::string leaseFile = cacheLayout::leaseFile(cacheDestination, key, hostName(), holderPid);
+        int fileDescriptor = open(leaseFile.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0666);
+        if (fileDescriptor < 0)
+            return false;
+        close(fileDescriptor);
+
+        struct utimbuf expiry{};
+        expiry.actime = time(nullptr);
+        expiry.modtime = expiry.actime + ttlSeconds;
+
+        struct stat st{};
+        if (stat(leaseFile.c_str(), &st) == 0 && st.st_mtime > expiry.modtime)
+            return true;
+
+        return utime(leaseFile.c_str(), &expiry) == 0;
+    }
+
+    bool isActive(const stdfs::path &leaseFile, const std::string &localHostName) {
+        struct stat st{};
+        if (stat(leaseFile.c_str(), &st) != 0 || st.st_mtime <= time(nullptr))
+            return false;
+
+        // <key>.<host>.<pid>
+        std::string name = leaseFile.filename().u8string();
+        size_t pidSeparator = name.rfind('.');
+        size_t hostSeparator = name.find('.');
+        if (pidSeparator == std::string::npos || hostSeparator == pidSeparator)
+            return true;
+
+        std::string host = name.substr(hostSeparator + 1, pidSeparator - hostSeparator - 1);
+        if (host != localHostName)
+            return true;
+
+        pid_t pid = (pid_t) std::strtol(name.c_str() + pidSeparator + 1, nullptr, 10);
+
+        return pid <= 0 || kill(pid, 0) == 0 || errno == EPERM;
+    }
+
+    /**
+     * True if any holder has an active lease on the entry. Leases which ended are removed.
+     */
+    bool isLeased(const std::string &cacheDestination, const std::string &key) {
+        const std::string localHostName = hostName();
+        const std::string prefix = key + ".";
+        std::error_code errorCode;
+        bool leased = false;
+
+        for (auto &directoryEntry: stdfs::directory_iterator(cacheLayout::leaseDirectory(cacheDestination),
+                                                             errorCode)) {
+            const stdfs::path &leaseFile = directoryEntry.path();
+            if (leaseFile.filename().u8string().compare(0, prefix.size(), prefix) != 0)
+                continue;
+
+            if (isActive(leaseFile, localHostName))
+                leased = true;
+            else
+                stdfs::remove(leaseFile, errorCode);
+        }
+
+        return leased;
+    }
+}
@@ -5,7 +5,6 @@
 #include <fstream>
 #include <utime.h>
 #include <chrono>
-#include <array>
 #include <config.h>
 #include "openssl/md5.h"
 #include "CLI11.hpp"
@@ -16,19 +15,37 @@
 #include "Exceptions/CleaningFailedException.h"
 #include "Exceptions/CopyFromCacheException.h"
 #include "Exceptions/LinkFromCacheException.h"
+#include "Exceptions/IdentityFileException.h"
+#include "Exceptions/ManifestException.h"
 #include "fileSystem.hpp"
+#include "trace.hpp"
 #include "compress.hpp"
+#include "cacheLayout.hpp"
+#include "keyLock.hpp"
+#include "publish.hpp"
+#include "lease.hpp"
+#include "cacheStore.hpp"
+#include "daemon.hpp"
+#include "batch.hpp"
+#include "snapshot.hpp"
+#include "prewarm.hpp"
+#include "process.hpp"
+#include "metrics.hpp"
+#include "failureCache.hpp"
+#include "freeSpace.hpp"
+#include "eviction.hpp"
+#include "gc.hpp"
+#include "integrity.hpp"
+#include "migration.hpp"
+#include "tier.hpp"
+#include "remote.hpp"
 
 
 
-const std::string archiveExtension = ".tar.gz";
-
 const int currentWorkingDirectoryArgument = 0;
-const auto defaultCopyOptions = stdfs::copy_options::recursive |
-                                stdfs::copy_options::overwrite_existing |
-                                stdfs::copy_options::copy_symlinks;
-
-bool verbose = false;
+const unsigned int defaultLockTimeout = 900;
+// linked entries are leased while the build process lives, at most this long
+const unsigned int defaultLinkLeaseTtl = 86400;
 
 void showHelpText(const std::string &help);
 
@@ -40,66 +57,347 @@ std::string generatePath(std::string &directory, const std::string &name);
 
 bool isAbsolutePath(const std::string &directory);
 
-std::string generateCommand(const std::string &workingDirectory, const std::string &command);
+process::Command generateCommand(const std::string &workingDirectory, const std::string &command, bool shell);
 
 std::string removeLastStringAfterSlash(const std::string &content);
 
-int executeCommand(std::string command);
+std::unique_ptr<KeyLock> lockKey(
+        const std::string &cacheDestination,
+        const std::string &key,
+        unsigned int timeout,
+        bool exclusive = true
+);
+
+int runDaemon(const std::string &cacheDestination, const std::string &socketPath, unsigned int workers,
+              const gc::Options &gcOptions, unsigned int gcInterval, migration::Options migrationOptions,
+              unsigned int migrateInterval, const std::string &socketGroup);
+
+int collectGarbage(const std::string &cacheDestination, const gc::Options &options);
+
+int runMigration(const std::string &cacheDestination, const migration::Options &options);
 
-void trace(const std::string &log, bool const &force = false);
+int verifyEntries(const std::string &cacheDestination, const std::vector<std::string> &keys, bool all,
+                  const integrity::Options &options);
 
-void trace(bool const &force = false);
+int prewarmCache(const std::string &cacheDestination, const std::vector<std::string> &keys, size_t count,
+                 unsigned int jobs);
 
 void createCache(
-        const std::string &setupCommand,
         const std::string &cacheSource,
-        const std::string &commandString,
+        const std::string &cacheDestination,
         const std::string &targetDirectoryPath,
         const stdfs::copy_options &copyOptions,
-        const bool &archive
+        const bool &archive,
+        const compress::ArchiveOptions &archiveOptions,
+        const bool &syncToDisk,
+        const bool &asyncStore,
+        const bool &snapshotLinks,
+        double setupSeconds,
+        const eviction::Limits &cacheLimits,
+        cadird::Client &daemonClient
+);
+
+void storeCache(
+        const std::string &cacheSource,
+        const std::string &cacheDestination,
+        const std::string &targetDirectoryPath,
+        const stdfs::copy_options &copyOptions,
+        const bool &archive,
+        const compress::ArchiveOptions &archiveOptions,
+        const bool &syncToDisk,
+        double setupSeconds,
+        cadird::Client &daemonClient
+);
+
+bool storeInBackground(
+        const std::string &cacheSource,
+        const std::string &cacheDestination,
+        const std::string &targetDirectoryPath,
+        const stdfs::copy_options &copyOptions,
+        const bool &archive,
+        const compress::ArchiveOptions &archiveOptions,
+        const bool &syncToDisk,
+        const bool &snapshotLinks,
+        double setupSeconds,
+        const eviction::Limits &cacheLimits,
+        cadird::Client &daemonClient
+);
+
+bool runInBackground(const std::string &description, const std::function<int()> &work);
+
+void uploadCache(const std::string &entryPath, const std::string &cacheDestination,
+                 const remote::Options &remoteOptions, bool inBackground);
+
+bool evictInBackground(const std::string &cacheDestination, const eviction::Limits &cacheLimits);
+
+void propagateCache(
+        const std::string &localEntryPath,
+        const std::string &localCacheDestination,
+        const std::string &cacheDestination,
+        const std::string &targetDirectoryPath,
+        const bool &archive,
+        double setupSeconds,
+        uintmax_t minFreeSpace,
+        cadird::Client &daemonClient
+);
+
+bool propagateInBackground(
+        const std::string &localEntryPath,
+        const std::string &localCacheDestination,
+        const std::string &cacheDestination,
+        const std::string &targetDirectoryPath,
+        const bool &archive,
+        double setupSeconds,
+        const eviction::Limits &cacheLimits,
+        uintmax_t minFreeSpace,
+        cadird::Client &daemonClient
 );
 
 void loadFromCache(
         const std::string &cacheSource,
         const std::string &currentWorkingDirectoryPath,
         bool linkCache,
-        const std::string &commandString,
         const std::string &targetDirectoryPath,
         const stdfs::copy_options &copyOptions,
-        const bool &archive
+        const bool &archive,
+        const bool &fastExtract,
+        cadird::Client &daemonClient,
+        const std::string &localCacheDestination = ""
 );
 
+/**
+ * Everything one cache operation needs. The command line fills one, a batch manifest one per line.
+ */
+struct JobOptions {
+    std::vector<std::string> identityFiles;
+    std::string cacheSource;
+    std::string commandWorkingDirectory;
+    std::string setupCommand;
+    std::string finalizeCommand;
+    std::string cacheDestination;
+    std::string currentWorkingDirectoryPath;
+    bool linkCache = false;
+    bool archive = false;
+    compress::ArchiveOptions archiveOptions;
+    bool fastExtract = false;
+    unsigned int lockTimeout = defaultLockTimeout;
+    bool syncToDisk = false;
+    bool asyncStore = false;
+    bool snapshotLinks = false;
+    bool useShell = false;
+    unsigned int setupTimeout = 0;
+    std::string metricsFile;
+    unsigned int failureTtl = 0;
+    bool retryFailed = false;
+    eviction::Limits cacheLimits;
+    uintmax_t minFreeSpace = 0;
+    // percentage of the blocks of an entry hashed before it is restored, 0 checks nothing
+    double verifySample = 0;
+    std::string localCacheDestination;
+    eviction::Limits localCacheLimits;
+    remote::Options remote;
+    // background processes are not forked from the worker threads of a batch
+    bool mayFork = true;
+    unsigned int leaseTtl = 0;
+    pid_t leasePid = getppid();
+    std::string daemonSocket;
+};
+
+// state of a job between the lookup of its entry and building or restoring it
+struct Job {
+    JobOptions options;
+    std::string key;
+    std::string targetDirectoryPath;
+    // the entry in the local tier, localHit if it is restored from there
+    std::string localTargetDirectoryPath;
+    bool localHit = false;
+    // the entry in the object store if it is restored from there
+    std::string remoteEntry;
+    std::unique_ptr<KeyLock> keyLock;
+    cadird::Client daemonClient;
+};
+
+void addJobOptions(CLI::App &app, JobOptions &options);
+
+void addGcOptions(CLI::App &command, gc::Options &options);
+
+void addMigrationOptions(CLI::App &command, migration::Options &options);
+
+bool entryExists(Job &job, const std::string &targetDirectoryPath);
+
+bool lookupJob(Job &job);
+
+void buildJob(Job &job);
+
+void restoreJob(Job &job);
+
+void restoreFromRemote(Job &job);
+
+bool verifyBeforeRestore(Job &job, const std::string &cacheDestination, const std::string &targetDirectoryPath);
+
+process::Result runCommand(const Job &job, const std::string &name, const process::Command &command,
+                           unsigned int timeoutSeconds, size_t outputTailBytes = 0);
+
+int runBatch(const JobOptions &defaults, const std::string &manifestFile, unsigned int jobs, unsigned int setupJobs);
+
 int main(int argumentCount, char **argumentList) {
     try {
-        std::string identityFile;
-        std::string commandWorkingDirectory;
-        std::string setupCommand;
-        std::string finalizeCommand;
-        std::string targetCacheDirectoryPath;
-        std::string cacheSource;
-        std::string currentWorkingDirectoryPath(
-                removeLastStringAfterSlash(argumentList[currentWorkingDirectoryArgument]));
-        std::string generatedHashTargetDirectory;
-        bool linkCache = false;
+        JobOptions options;
+        options.currentWorkingDirectoryPath =
+                removeLastStringAfterSlash(argumentList[currentWorkingDirectoryArgument]);
         bool showHelp = false;
-        bool archive = false;
+        unsigned int daemonWorkers = std::max(std::thread::hardware_concurrency(), 1u);
+        std::string manifestFile;
+        unsigned int batchJobs = std::max(std::thread::hardware_concurrency(), 1u);
+        unsigned int setupJobs = batch::defaultSetupJobs;
+        std::vector<std::string> prewarmKeys;
+        size_t prewarmEntries = prewarm::defaultEntries;
+        unsigned int prewarmJobs = std::max(std::thread::hardware_concurrency(), 1u);
+        gc::Options gcOptions;
+        gcOptions.jobs = std::max(std::thread::hardware_concurrency(), 1u);
+        unsigned int gcInterval = 0;
+        migration::Options migrationOptions;
+        migrationOptions.jobs = std::max(std::thread::hardware_concurrency(), 1u);
+        unsigned int migrateInterval = 0;
+        std::string socketGroup;
+        std::vector<std::string> verifyKeys;
+        bool verifyAll = false;
+        double verifySample = 100;
+        integrity::Options verifyOptions;
+        verifyOptions.jobs = std::max(std::thread::hardware_concurrency(), 1u);
 
         CLI::App app{"cadir description", "cadir"};
         app.remove_option(app.get_help_ptr());
 
-        app.add_option("--cache-source", cacheSource, "The directory which should be cached");
-        app.add_option("--identity-file", identityFile, "File which shows differences");
-        app.add_option("--cache-destination", targetCacheDirectoryPath, "The directory where the cache is stored");
-        app.add_option("--command-working-directory", commandWorkingDirectory,
-                       "Working directory where the setup command is called from");
-        app.add_option("--setup", setupCommand, "Argument which is called if cache is not found");
-        app.add_option("--finalize", finalizeCommand,
-                       "[optional] Command which is called after cache is regenerated, linked or copied");
-        app.add_flag("-a,--archive", archive, "In case of copying the data a tar compressed archive will be created");
+        addJobOptions(app, options);
+        app.add_option("--cache-destination", options.cacheDestination, "The directory where the cache is stored");
+        app.add_flag("-a,--archive", options.archive,
+                     "In case of copying the data a tar compressed archive will be created");
+        app.add_flag("--deduplicate", options.archiveOptions.deduplicate,
+                     "Store identical files only once as hardlinks inside the archive (only with archive)");
+        app.add_flag("--adaptive-compression", options.archiveOptions.adaptiveCompression,
+                     "Store already compressed files without compressing them again (only with archive)");
+        app.add_flag("--chunked", options.archiveOptions.chunked,
+                     "Store the archive as content defined chunks shared with other entries (only with archive)");
+        app.add_option("--compression-threads", options.archiveOptions.compressionThreads,
+                       "Threads compressing the archive, 0 uses one per core (only with archive)");
+        app.add_flag("--fast-extract", options.fastExtract,
+                     "Skip ACLs and file flags and preallocate files while extracting (only with archive)");
+        app.add_option("--lock-timeout", options.lockTimeout,
+                       "Seconds to wait for another process building the same cache, 0 disables locking");
+        app.add_flag("--fsync", options.syncToDisk, "Flush a new cache entry to disk before it is published");
+        app.add_flag("--async-store", options.asyncStore,
+                     "Snapshot the cache source after the setup and store it in a background process");
+        app.add_flag("--snapshot-links", options.snapshotLinks,
+                     "Hardlink files into the snapshot without reflinks, the setup must not rewrite files in place");
+        app.add_option("--lease-ttl", options.leaseTtl,
+                       "Seconds a restored cache is protected from eviction, default is a day for links only");
+        app.add_option("--lease-pid", options.leasePid,
+                       "Process which holds the lease, it ends early when the process ends (default parent)");
+        app.add_option("--daemon-socket", options.daemonSocket,
+                       "Socket of the daemon serving the cache destination, without the daemon cadir works alone");
+        app.add_flag("--shell", options.useShell,
+                     "Run setup and finalize through /bin/sh, otherwise only command lines with shell syntax do");
+        app.add_option("--setup-timeout", options.setupTimeout,
+                       "Seconds after which the setup command and its children are killed, 0 (default) never");
+        app.add_option("--metrics-file", options.metricsFile,
+                       "Append resource usage of setup and finalize commands as JSON lines to this file");
+        app.add_option("--max-cache-size", options.cacheLimits.maxBytes,
+                       "Evict least recently used entries beyond this size after a store, e.g. 20G")
+                ->transform(CLI::AsSizeValue(false));
+        app.add_option("--max-cache-entries", options.cacheLimits.maxEntries,
+                       "Evict least recently used entries beyond this number after a store");
+        app.add_option("--min-free-space", options.minFreeSpace,
+                       "Space a store leaves free, it evicts least recently used entries first or is skipped, e.g. 1G")
+                ->transform(CLI::AsSizeValue(false));
+        app.add_option("--verify-sample", options.verifySample,
+                       "Percentage of the blocks of an entry compared with its checksums before it is restored, "
+                       "a corrupt entry is quarantined and rebuilt")->check(CLI::Range(0.0, 100.0));
+        app.add_option("--local-cache-destination", options.localCacheDestination,
+                       "Directory on a local disk used as a tier in front of --cache-destination");
+        app.add_option("--local-max-cache-size", options.localCacheLimits.maxBytes,
+                       "Evict least recently used entries of the local tier beyond this size, e.g. 50G")
+                ->transform(CLI::AsSizeValue(false));
+        app.add_option("--local-max-cache-entries", options.localCacheLimits.maxEntries,
+                       "Evict least recently used entries of the local tier beyond this number");
+        app.add_option("--remote-url", options.remote.url,
+                       "URL of an S3 compatible object store sharing archive entries, e.g. http://store:9000/bucket");
+        app.add_option("--remote-part-size", options.remote.partSize,
+                       "Archives above this size are uploaded in parts, e.g. 64M (default)")
+                ->transform(CLI::AsSizeValue(false));
+        app.add_option("--remote-jobs", options.remote.jobs, "Parts uploaded at the same time (default 4)");
+        app.add_option("--failure-ttl", options.failureTtl,
+                       "Seconds a failed setup is remembered, the key fails at once meanwhile, 0 (default) never");
+        app.add_flag("--retry-failed", options.retryFailed, "Run the setup even if it failed within --failure-ttl");
         app.add_flag("-v,--verbose", verbose, "Show verbose output");
-        app.add_flag("-l,--link", linkCache, "Link cache instead of copy");
+        app.add_flag("-l,--link", options.linkCache, "Link cache instead of copy");
         app.add_flag("-h,--help", showHelp, "Show help");
 
+        CLI::App *daemonCommand = app.add_subcommand(
+                "daemon", "Serve lookups, restores and stores of the cache destination until SIGINT or SIGTERM");
+        daemonCommand->fallthrough();
+        daemonCommand->add_option("--cache-destination", options.cacheDestination,
+                                  "The directory where the cache is stored")->required();
+        daemonCommand->add_option("--socket", options.daemonSocket,
+                                  "Unix socket to listen on (default .cadir/cadird.sock in the cache destination)");
+        daemonCommand->add_option("--workers", daemonWorkers, "Threads restoring and storing entries");
+        daemonCommand->add_option("--gc-interval", gcInterval,
+                                  "Seconds between garbage collections with the gc options, 0 (default) never");
+        addGcOptions(*daemonCommand, gcOptions);
+        daemonCommand->add_option("--migrate-interval", migrateInterval,
+                                  "Seconds between migrations with the migrate options, 0 (default) never");
+        addMigrationOptions(*daemonCommand, migrationOptions);
+        daemonCommand->add_option("--socket-group", socketGroup,
+                                  "Group whose members may use the daemon besides its user, the socket is 0660 then");
+
+        CLI::App *batchCommand = app.add_subcommand(
+                "batch", "Run the jobs of a manifest, one line of job options per cache source, in parallel");
+        batchCommand->fallthrough();
+        batchCommand->add_option("--manifest", manifestFile, "File with the options of one job per line")
+                ->required();
+        batchCommand->add_option("--jobs", batchJobs, "Jobs looking up and restoring their cache at the same time");
+        batchCommand->add_option("--setup-jobs", setupJobs,
+                                 "Jobs running their setup command and storing their cache at the same time");
+
+        CLI::App *prewarmCommand = app.add_subcommand(
+                "prewarm", "Read cache entries into the page cache, so later restores read from memory");
+        prewarmCommand->fallthrough();
+        prewarmCommand->add_option("--cache-destination", options.cacheDestination,
+                                   "The directory where the cache is stored")->required();
+        prewarmCommand->add_option("--key", prewarmKeys, "Key (entry name without extension) to prewarm, repeatable");
+        prewarmCommand->add_option("--top", prewarmEntries,
+                                   "Number of most recently used entries to prewarm if no key is given");
+        prewarmCommand->add_option("--jobs", prewarmJobs, "Files read at the same time");
+
+        CLI::App *gcCommand = app.add_subcommand(
+                "gc", "Remove entries by a policy until a target size or free space is reached, and stale files");
+        gcCommand->fallthrough();
+        gcCommand->add_option("--cache-destination", options.cacheDestination,
+                              "The directory where the cache is stored")->required();
+        addGcOptions(*gcCommand, gcOptions);
+
+        CLI::App *migrateCommand = app.add_subcommand(
+                "migrate", "Archive cold directory entries and expand hot archive entries into directories");
+        migrateCommand->fallthrough();
+        migrateCommand->add_option("--cache-destination", options.cacheDestination,
+                                   "The directory where the cache is stored")->required();
+        addMigrationOptions(*migrateCommand, migrationOptions);
+        migrateCommand->add_option("--jobs", migrationOptions.jobs, "Threads compressing and deleting entries");
+        migrateCommand->add_flag("--dry-run", migrationOptions.dryRun, "Only show what would be migrated");
+
+        CLI::App *verifyCommand = app.add_subcommand(
+                "verify", "Compare entries with their checksums and quarantine corrupt ones, so they are rebuilt");
+        verifyCommand->fallthrough();
+        verifyCommand->add_option("--cache-destination", options.cacheDestination,
+                                  "The directory where the cache is stored")->required();
+        verifyCommand->add_option("key", verifyKeys, "Key (or entry name) to verify, repeatable");
+        verifyCommand->add_flag("--all", verifyAll, "Verify every entry of the cache destination");
+        verifyCommand->add_option("--sample", verifySample,
+                                  "Percentage of the blocks and chunks which are hashed (default 100)")
+                ->check(CLI::Range(0.0, 100.0));
+        verifyCommand->add_option("--jobs", verifyOptions.jobs, "Threads hashing blocks and chunks");
+        verifyCommand->add_flag("--dry-run", verifyOptions.dryRun, "Only report corrupt entries");
+
         try {
             app.parse(argumentCount, argumentList);
 
@@ -124,56 +422,39 @@ int main(int argumentCount, char **argumentList) {
             return 0;
         }
 
-        std::string commandString;
-        std::string targetDirectoryPath;
+        if (daemonCommand->parsed()) {
+            return runDaemon(options.cacheDestination, options.daemonSocket, daemonWorkers, gcOptions, gcInterval,
+                             migrationOptions, migrateInterval, socketGroup);
+        }
 
-        try {
-            generatedHashTargetDirectory = generateMd5FromString(getFileContents(identityFile));
-        } catch (std::invalid_argument &exception) {
-            trace(exception.what());
-            trace(identityFile);
+        if (gcCommand->parsed()) {
+            return collectGarbage(options.cacheDestination, gcOptions);
+        }
 
-            return ExitCode::identityFileFailed;
+        if (migrateCommand->parsed()) {
+            return runMigration(options.cacheDestination, migrationOptions);
         }
 
-        targetDirectoryPath = generatePath(targetCacheDirectoryPath, generatedHashTargetDirectory);
+        if (verifyCommand->parsed()) {
+            verifyOptions.sample = verifySample / 100;
+            return verifyEntries(options.cacheDestination, verifyKeys, verifyAll, verifyOptions);
+        }
 
-        trace("Identity file is: " + generatedHashTargetDirectory);
+        if (prewarmCommand->parsed()) {
+            return prewarmCache(options.cacheDestination, prewarmKeys, prewarmEntries, prewarmJobs);
+        }
 
-        const bool foundCache = (archive)
-                ? stdfs::exists(targetDirectoryPath + archiveExtension)
-                : stdfs::exists(targetDirectoryPath);
+        if (batchCommand->parsed()) {
+            return runBatch(options, manifestFile, batchJobs, setupJobs);
+        }
 
-        if (!foundCache) {
-            trace("No cache exists");
-            commandString = generateCommand(commandWorkingDirectory, setupCommand);
+        Job job;
+        job.options = options;
 
-            createCache(
-                    setupCommand,
-                    cacheSource,
-                    commandString,
-                    targetDirectoryPath,
-                    defaultCopyOptions,
-                    archive
-            );
+        if (lookupJob(job)) {
+            restoreJob(job);
         } else {
-            commandString =
-                    (finalizeCommand != "")
-                    ? generateCommand(
-                            commandWorkingDirectory,
-                            finalizeCommand
-                    )
-                    : "";
-
-            loadFromCache(
-                    cacheSource,
-                    currentWorkingDirectoryPath,
-                    linkCache,
-                    commandString,
-                    targetDirectoryPath,
-                    defaultCopyOptions,
-                    archive
-            );
+            buildJob(job);
         }
 
         return ExitCode::ok;
@@ -183,6 +464,525 @@ int main(int argumentCount, char **argumentList) {
     }
 }
 
+// options which differ between the jobs of a batch, a manifest line may contain only these
+void addJobOptions(CLI::App &app, JobOptions &options) {
+    app.add_option("--cache-source", options.cacheSource, "The directory which should be cached");
+    app.add_option("--identity-file", options.identityFiles,
+                   "File which shows differences, repeat it if several files together identify the cache");
+    app.add_option("--command-working-directory", options.commandWorkingDirectory,
+                   "Working directory where the setup command is called from");
+    app.add_option("--setup", options.setupCommand, "Argument which is called if cache is not found");
+    app.add_option("--finalize", options.finalizeCommand,
+                   "[optional] Command which is called after cache is regenerated, linked or copied");
+}
+
+// options of the garbage collection, of "cadir gc" and of the daemon
+void addGcOptions(CLI::App &command, gc::Options &options) {
+    command.add_option("--policy", options.policy, "Order of removal: lru (default), lfu, ttl or cost")
+            ->transform(CLI::CheckedTransformer(gc::policyNames, CLI::ignore_case).description(""))
+            ->type_name("POLICY");
+    command.add_option("--target-size", options.targetBytes, "Remove entries until the cache is this small, e.g. 50G")
+            ->transform(CLI::AsSizeValue(false));
+    command.add_option("--free-percent", options.freePercent,
+                       "Remove entries until this percentage of the filesystem is free");
+    command.add_option("--free-space", options.freeBytes, "Remove entries until this much is free, e.g. 10G")
+            ->transform(CLI::AsSizeValue(false));
+    command.add_option("--max-age", options.maxAgeSeconds, "Seconds an entry may be unused with the ttl policy");
+    command.add_option("--stale-after", options.staleSeconds,
+                       "Seconds after which unfinished stores are removed (default one day)");
+    command.add_option("--jobs", options.jobs, "Threads measuring and deleting entries");
+    command.add_flag("--dry-run", options.dryRun, "Only show what would be removed");
+}
+
+// options of the migration between the formats, of "cadir migrate" and of the daemon
+void addMigrationOptions(CLI::App &command, migration::Options &options) {
+    command.add_option("--hot-hits", options.hotHits,
+                       "Restores after which a recently used archive is expanded into a directory, 0 never");
+    command.add_option("--cold-after", options.coldSeconds,
+                       "Seconds after which an unused directory entry is archived (default a week)");
+}
+
+/**
+ * Tells if the entry exists in either format and takes the format found over into the options. Migrations
+ * move entries between the formats, either restores, links need a directory.
+ */
+bool entryExists(Job &job, const std::string &targetDirectoryPath) {
+    const bool directoryExists = stdfs::is_directory(targetDirectoryPath);
+    const bool archiveExists = !job.options.linkCache && !cacheStore::findArchive(targetDirectoryPath).empty();
+
+    if (job.options.archive ? !archiveExists && directoryExists : !directoryExists && archiveExists) {
+        trace(std::string("Cache exists as ") + (archiveExists ? "archive" : "directory"));
+        job.options.archive = archiveExists;
+    }
+
+    return directoryExists || archiveExists;
+}
+
+/**
+ * Hashes the identity files and looks up the entry. If it is missing the job takes the build of the key,
+ * from the daemon and with the key lock, and looks again in case another process built it meanwhile.
+ */
+bool lookupJob(Job &job) {
+    JobOptions &options = job.options;
+    std::string identity;
+
+    // restores extract into the parent of the cache source, which "vendor/" would make vendor itself
+    options.cacheSource = cacheStore::sourcePath(options.cacheSource).u8string();
+
+    if (options.identityFiles.empty()) {
+        throw (IdentityFileException("No identity file given", ExitCode::identityFileFailed));
+    }
+    for (auto &identityFile: options.identityFiles) {
+        try {
+            identity.append(getFileContents(identityFile));
+        } catch (std::invalid_argument &exception) {
+            throw (IdentityFileException(std::string(exception.what()) + ": " + identityFile,
+                                         ExitCode::identityFileFailed));
+        }
+    }
+
+    std::string cacheDestinationPath = options.cacheDestination;
+    job.key = generateMd5FromString(identity);
+    job.targetDirectoryPath = generatePath(cacheDestinationPath, job.key);
+
+    trace("Identity file is: " + job.key);
+
+    auto cacheExists = [&job]() { return entryExists(job, job.targetDirectoryPath); };
+
+    // a hit in the local tier needs neither the daemon nor the shared destination
+    if (!options.localCacheDestination.empty()) {
+        std::string localCacheDestinationPath = options.localCacheDestination;
+        job.localTargetDirectoryPath = generatePath(localCacheDestinationPath, job.key);
+        job.localHit = entryExists(job, job.localTargetDirectoryPath);
+
+        if (job.localHit) {
+            trace("Cache found in local tier");
+            return true;
+        }
+    }
+
+    if (!options.daemonSocket.empty() && !job.daemonClient.connect(options.daemonSocket)) {
+        trace("Daemon not reachable on " + options.daemonSocket + ", continue without it");
+    }
+
+    bool foundCache = false;
+    if (job.daemonClient.isConnected()) {
+        // the daemon lets only one of its clients build, the others wait here for the entry
+        cadird::Acquired acquired = job.daemonClient.acquire(job.key, options.archive, options.lockTimeout);
+        if (acquired == cadird::Acquired::timeout) {
+            trace("Cache was not built within " + std::to_string(options.lockTimeout) + " seconds");
+        }
+        // a hit is looked up again for its format
+        foundCache = (acquired == cadird::Acquired::unavailable || acquired == cadird::Acquired::hit)
+                     && cacheExists();
+    } else {
+        foundCache = cacheExists();
+    }
+
+    if (!foundCache && options.lockTimeout > 0) {
+        job.keyLock = lockKey(options.cacheDestination, job.key, options.lockTimeout);
+        foundCache = cacheExists();
+
+        if (foundCache) {
+            trace("Cache was created by another process");
+        }
+    }
+
+    if (!foundCache && options.remote.enabled()) {
+        if (!options.archive) {
+            trace("The object store holds archives only, use --archive");
+        } else {
+            try {
+                remote::Client client(options.remote);
+                job.remoteEntry = remote::findEntry(client, job.key);
+                foundCache = !job.remoteEntry.empty();
+            } catch (RemoteStorageException &exception) {
+                trace(std::string(exception.what()) + ", continue without object store");
+            }
+        }
+    }
+
+    return foundCache;
+}
+
+void buildJob(Job &job) {
+    JobOptions &options = job.options;
+
+    trace("No cache exists");
+
+    if (options.failureTtl > 0 && !options.retryFailed) {
+        failureCache::Failure failure =
+                failureCache::lookup(options.cacheDestination, job.key, options.failureTtl);
+        if (failure.found) {
+            if (!failure.output.empty()) {
+                trace(failure.output.substr(0, failure.output.find_last_not_of('\n') + 1), true);
+            }
+            trace("Setup command " +
+                  (failure.timedOut ? std::string("timed out ")
+                                    : "failed with exit code " + std::to_string(failure.exitCode) + " ") +
+                  std::to_string(time(nullptr) - failure.time) + " seconds ago, use --retry-failed to run it again",
+                  true);
+
+            throw (SetupCommandException("Setup command failed before",
+                                         failure.timedOut ? ExitCode::setupCommandTimedOut
+                                                          : ExitCode::setupCommandFailed));
+        }
+    }
+
+    process::Result setupResult = runCommand(
+            job,
+            "setup",
+            generateCommand(options.commandWorkingDirectory, options.setupCommand, options.useShell),
+            options.setupTimeout,
+            (options.failureTtl > 0) ? failureCache::outputTailBytes : 0
+    );
+    if (options.failureTtl > 0) {
+        if (setupResult.timedOut || setupResult.exitCode != 0) {
+            if (!failureCache::record(options.cacheDestination, job.key, setupResult.exitCode,
+                                      setupResult.timedOut, setupResult.outputTail)) {
+                trace("Cannot record the failure of the setup command");
+            }
+        } else {
+            failureCache::clear(options.cacheDestination, job.key);
+        }
+    }
+    if (setupResult.timedOut) {
+        throw (SetupCommandException("Setup command timed out", ExitCode::setupCommandTimedOut));
+    }
+    if (setupResult.exitCode != 0) {
+        throw (SetupCommandException("Setup command failed", ExitCode::setupCommandFailed));
+    }
+
+    if (options.remote.enabled() && options.archive && options.asyncStore) {
+        trace("--async-store is ignored with an object store, the upload runs in the background anyway");
+        options.asyncStore = false;
+    }
+
+    // a store which does not fit is skipped, the build itself succeeded
+    const uintmax_t entryBytes = freeSpace::estimateEntrySize(options.cacheSource);
+    trace("Estimated entry size: " + std::to_string(entryBytes) + " bytes");
+    if (!options.localCacheDestination.empty() &&
+        !freeSpace::makeRoom(options.localCacheDestination, entryBytes, options.minFreeSpace)) {
+        trace("Not enough space in the local tier " + options.localCacheDestination + ", store in " +
+              options.cacheDestination, true);
+        options.localCacheDestination.clear();
+    }
+
+    if (options.localCacheDestination.empty()) {
+        if (!freeSpace::makeRoom(options.cacheDestination, entryBytes, options.minFreeSpace)) {
+            trace("Not enough space in " + options.cacheDestination + " for " + std::to_string(entryBytes) +
+                  " bytes, the cache is not stored", true);
+            job.daemonClient.release(job.key, options.archive);
+            job.keyLock.reset();
+            return;
+        }
+
+        createCache(
+                options.cacheSource,
+                options.cacheDestination,
+                job.targetDirectoryPath,
+                cacheStore::defaultCopyOptions,
+                options.archive,
+                options.archiveOptions,
+                options.syncToDisk,
+                options.asyncStore,
+                options.snapshotLinks,
+                setupResult.usage.wallSeconds,
+                options.cacheLimits,
+                job.daemonClient
+        );
+
+        if (options.remote.enabled() && options.archive) {
+            uploadCache(cacheStore::entryPath(job.targetDirectoryPath, options.archive, options.archiveOptions),
+                        options.cacheDestination, options.remote, options.mayFork);
+        }
+
+        job.keyLock.reset();
+        return;
+    }
+
+    // stored in the local tier first, the copy to the shared tier does not delay the build
+    if (options.asyncStore) {
+        trace("--async-store is ignored with a local tier, the shared tier is written in the background anyway");
+    }
+    cadird::Client localClient;
+    storeCache(
+            options.cacheSource,
+            options.localCacheDestination,
+            job.localTargetDirectoryPath,
+            cacheStore::defaultCopyOptions,
+            options.archive,
+            options.archiveOptions,
+            options.syncToDisk,
+            setupResult.usage.wallSeconds,
+            localClient
+    );
+
+    const std::string localEntryPath =
+            cacheStore::entryPath(job.localTargetDirectoryPath, options.archive, options.archiveOptions);
+
+    if (!options.mayFork ||
+        !propagateInBackground(localEntryPath, options.localCacheDestination, options.cacheDestination,
+                               job.targetDirectoryPath, options.archive, setupResult.usage.wallSeconds,
+                               options.cacheLimits, options.minFreeSpace, job.daemonClient)) {
+        propagateCache(localEntryPath, options.localCacheDestination, options.cacheDestination,
+                       job.targetDirectoryPath, options.archive, setupResult.usage.wallSeconds,
+                       options.minFreeSpace, job.daemonClient);
+
+        if (options.cacheLimits.any()) {
+            evictInBackground(options.cacheDestination, options.cacheLimits);
+        }
+    }
+    if (options.remote.enabled() && options.archive) {
+        uploadCache(localEntryPath, options.localCacheDestination, options.remote, options.mayFork);
+    }
+    if (options.localCacheLimits.any()) {
+        evictInBackground(options.localCacheDestination, options.localCacheLimits);
+    }
+
+    job.keyLock.reset();
+}
+
+void restoreJob(Job &job) {
+    JobOptions &options = job.options;
+    const process::Command command =
+            (options.finalizeCommand != "")
+            ? generateCommand(
+                    options.commandWorkingDirectory,
+                    options.finalizeCommand,
+                    options.useShell
+            )
+            : process::Command();
+
+    if (!job.remoteEntry.empty()) {
+        // the key lock of the lookup is still held, the download fills the cache destination
+        try {
+            restoreFromRemote(job);
+        } catch (RemoteStorageException &exception) {
+            trace(std::string(exception.what()) + ", build instead");
+            job.remoteEntry.clear();
+            buildJob(job);
+            return;
+        }
+
+        job.daemonClient.release(job.key, options.archive);
+        job.keyLock.reset();
+        return;
+    }
+
+    // the tier restored from, and the local tier filled by a restore from the shared tier
+    std::string cacheDestination = options.cacheDestination;
+    std::string targetDirectoryPath = job.targetDirectoryPath;
+    std::string fillDestination;
+    cadird::Client localClient;
+    cadird::Client &daemonClient = job.localHit ? localClient : job.daemonClient;
+
+    if (job.localHit) {
+        cacheDestination = options.localCacheDestination;
+        targetDirectoryPath = job.localTargetDirectoryPath;
+    } else if (!options.localCacheDestination.empty() && !options.linkCache) {
+        fillDestination = options.localCacheDestination;
+    } else if (!options.localCacheDestination.empty()) {
+        // links point into the local tier, the entry is copied there first
+        if (!job.keyLock && options.lockTimeout > 0) {
+            job.keyLock = lockKey(options.cacheDestination, job.key, options.lockTimeout, false);
+        }
+        try {
+            tier::copyEntry(job.targetDirectoryPath, options.cacheDestination, options.localCacheDestination);
+            cacheStore::recordAccess(job.targetDirectoryPath);
+            cacheDestination = options.localCacheDestination;
+            targetDirectoryPath = job.localTargetDirectoryPath;
+            job.keyLock.reset();
+        } catch (CadirException &exception) {
+            trace(std::string(exception.what()) + ", link to the shared tier");
+        }
+    }
+
+    if (!job.keyLock && options.lockTimeout > 0) {
+        job.keyLock = lockKey(cacheDestination, job.key, options.lockTimeout, false);
+    }
+
+    // the lookup ran without the lock, the entry may have been evicted or migrated since
+    if (!entryExists(job, targetDirectoryPath)) {
+        trace("Cache was removed meanwhile");
+        job.keyLock.reset();
+        job.localHit = false;
+        if (options.lockTimeout > 0) {
+            job.keyLock = lockKey(options.cacheDestination, job.key, options.lockTimeout);
+        }
+        if (entryExists(job, job.targetDirectoryPath)) {
+            trace("Cache was created by another process");
+            restoreJob(job);
+        } else {
+            buildJob(job);
+        }
+        return;
+    }
+
+    if (options.verifySample > 0 && !verifyBeforeRestore(job, cacheDestination, targetDirectoryPath)) {
+        buildJob(job);
+        return;
+    }
+
+    if (options.leaseTtl == 0 && options.linkCache) {
+        options.leaseTtl = defaultLinkLeaseTtl;
+    }
+    if (options.leaseTtl > 0 &&
+        !lease::acquire(cacheDestination, job.key, options.leaseTtl, options.leasePid)) {
+        trace("Cannot take lease on cache");
+    }
+
+    loadFromCache(
+            options.cacheSource,
+            options.currentWorkingDirectoryPath,
+            options.linkCache,
+            targetDirectoryPath,
+            cacheStore::defaultCopyOptions,
+            options.archive,
+            options.fastExtract,
+            daemonClient,
+            fillDestination
+    );
+
+    // finalize only follows copies of directory entries, as it always did
+    if (!options.linkCache && !options.archive && !command.empty()) {
+        if (runCommand(job, "finalize", command, 0).exitCode != 0) {
+            throw (FinalizeCommandException("Finalize command failed", ExitCode::finalizeCommandFailed));
+        }
+    }
+
+    job.keyLock.reset();
+
+    if (!fillDestination.empty() && options.localCacheLimits.any() && options.mayFork) {
+        evictInBackground(fillDestination, options.localCacheLimits);
+    }
+}
+
+/**
+ * Compares a sample of the entry with its checksums, see --verify-sample. A corrupt entry is quarantined and
+ * false is returned, the key lock is then held exclusively for the rebuild.
+ */
+bool verifyBeforeRestore(Job &job, const std::string &cacheDestination, const std::string &targetDirectoryPath) {
+    const JobOptions &options = job.options;
+    const std::string entryPath = options.archive ? cacheStore::findArchive(targetDirectoryPath) : targetDirectoryPath;
+    if (entryPath.empty()) {
+        return true;
+    }
+
+    const std::string name = stdfs::path(entryPath).filename().u8string();
+    WorkerPool pool(std::max(std::thread::hardware_concurrency(), 1u));
+    integrity::Result result = integrity::verify(cacheDestination, name, options.verifySample / 100, pool);
+    if (result.status != integrity::Status::corrupt) {
+        return true;
+    }
+
+    trace("Cache entry " + name + " is corrupt (" + result.problem + "), it is rebuilt", true);
+    // the shared lock of the restore would block the quarantine
+    job.keyLock.reset();
+    if (!integrity::quarantine(cacheDestination, name, result.corruptChunks, options.lockTimeout)) {
+        trace("Cannot quarantine " + name + ", it is in use", true);
+    }
+    if (options.lockTimeout > 0) {
+        job.keyLock = lockKey(options.cacheDestination, job.key, options.lockTimeout);
+    }
+
+    return false;
+}
+
+/**
+ * Extracts the archive of the object store while it is downloaded and keeps it in the cache destination.
+ */
+void restoreFromRemote(Job &job) {
+    const JobOptions &options = job.options;
+    remote::Client client(options.remote);
+
+    trace("Cache found in object store");
+    try {
+        if (stdfs::exists(options.cacheSource)) {
+            stdfs::remove_all(options.cacheSource);
+        }
+    } catch (...) {
+        throw (CleaningFailedException("Cleaning for cache regeneration failed", ExitCode::cleaningFailed));
+    }
+
+    const stdfs::path absoluteCacheSource = stdfs::absolute(options.cacheSource);
+    try {
+        remote::restore(client, job.remoteEntry, options.cacheDestination, options.fastExtract,
+                        absoluteCacheSource.parent_path().u8string(),
+                        cacheStore::restoredTopLevel(job.remoteEntry, options.cacheSource));
+    } catch (RemoteStorageException &exception) {
+        // the setup starts from scratch, not from a partial extraction
+        std::error_code errorCode;
+        stdfs::remove_all(options.cacheSource, errorCode);
+        throw;
+    }
+}
+
+/**
+ * Looks up and restores the jobs of the manifest on one pool, the misses build on a smaller pool, so the
+ * wall time is close to the slowest job. Returns the first failing exit code in manifest order.
+ */
+int runBatch(const JobOptions &defaults, const std::string &manifestFile, unsigned int jobs, unsigned int setupJobs) {
+    std::vector<JobOptions> jobOptions;
+
+    if (defaults.asyncStore) {
+        // forking a background store is not safe from the worker threads, stores overlap other jobs anyway
+        trace("--async-store is ignored in batch mode");
+    }
+
+    for (auto &line: batch::readManifest(manifestFile)) {
+        JobOptions options = defaults;
+        options.asyncStore = false;
+        options.mayFork = false;
+        // evicted once after all jobs, see below
+        options.cacheLimits = eviction::Limits();
+        options.localCacheLimits = eviction::Limits();
+        CLI::App jobApp{"cadir batch job", "job"};
+        addJobOptions(jobApp, options);
+
+        try {
+            jobApp.parse(line, false);
+        } catch (const CLI::ParseError &exception) {
+            throw (ManifestException("Invalid manifest line: " + line, ExitCode::argumentParsingFailed));
+        }
+
+        jobOptions.push_back(options);
+    }
+
+    trace("Run " + std::to_string(jobOptions.size()) + " jobs from " + manifestFile);
+
+    std::vector<int> exitCodes = batch::run(jobOptions.size(), jobs, setupJobs,
+                                            [&jobOptions](size_t index) -> std::function<void()> {
+        auto job = std::make_shared<Job>();
+        job->options = jobOptions[index];
+
+        if (lookupJob(*job)) {
+            restoreJob(*job);
+            return nullptr;
+        }
+
+        return [job] { buildJob(*job); };
+    });
+
+    if (defaults.cacheLimits.any()) {
+        evictInBackground(defaults.cacheDestination, defaults.cacheLimits);
+    }
+    if (defaults.localCacheLimits.any()) {
+        evictInBackground(defaults.localCacheDestination, defaults.localCacheLimits);
+    }
+
+    int exitCode = ExitCode::ok;
+    for (size_t index = 0; index < exitCodes.size(); index++) {
+        if (exitCodes[index] != ExitCode::ok) {
+            trace("Job " + jobOptions[index].cacheSource + " failed with exit code " +
+                  std::to_string(exitCodes[index]), true);
+            exitCode = (exitCode == ExitCode::ok) ? exitCodes[index] : exitCode;
+        }
+    }
+
+    return exitCode;
+}
+
 void showHelpText(const std::string &helpText) {
     trace(helpText, true);
     trace(true);
@@ -198,6 +998,11 @@ void showHelpText(const std::string &helpText) {
     trace("7 = Cannot create link from cache", true);
     trace("8 = Removing existing cache folder failed", true);
     trace("9 = Cannot create cache directories", true);
+    trace("10 = gzip error (only with option a, archive)", true);
+    trace("11 = Daemon cannot serve the cache destination", true);
+    trace("12 = Setup command timed out", true);
+    trace("13 = Remote object store failed", true);
+    trace("14 = Verification found a corrupt entry (verify)", true);
 }
 
 
@@ -224,54 +1029,55 @@ bool isAbsolutePath(const std::string &directory) {
     return directory.front() == '/';
 }
 
-std::string generateCommand(const std::string &workingDirectory, const std::string &command) {
-    std::string commandString = "cd ";
-    commandString
-            .append(workingDirectory)
-            .append("; ")
-            .append(command);
-    return commandString;
+process::Command generateCommand(const std::string &workingDirectory, const std::string &command, bool shell) {
+    process::Command processCommand;
+    processCommand.workingDirectory = workingDirectory;
+    processCommand.commandLine = command;
+    processCommand.shell = shell;
+
+    return processCommand;
 }
 
 std::string removeLastStringAfterSlash(const std::string &content) {
     return content.substr(0, (content.rfind('/') + 1));
 };
 
-int executeCommand(std::string command) {
-    if (verbose) {
-        std::array<char, 128> buffer{};
+/**
+ * Runs a setup or finalize command, traces its resource usage and appends it to the metrics file.
+ */
+process::Result runCommand(const Job &job, const std::string &name, const process::Command &command,
+                           unsigned int timeoutSeconds, size_t outputTailBytes) {
+    trace("Execute: " + command.describe());
 
-        FILE *pipe = popen(command.c_str(), "r");
-        if (!pipe) {
-            std::cerr << "Command failed." << std::endl;
-            return 255;
-        }
-        while (fgets(buffer.data(), 128, pipe) != nullptr) {
-            std::cout << buffer.data() << std::endl;
-        }
-        return pclose(pipe);
-    }
+    process::Result result = process::run(command, verbose, timeoutSeconds, outputTailBytes);
 
-    return system(command.append(" &> /dev/null").c_str());
-}
-
-
-void trace(bool const &force) {
-    if (!force && !verbose) {
-        return;
+    if (result.timedOut) {
+        trace("The " + name + " command did not finish within " + std::to_string(timeoutSeconds) + " seconds");
     }
-
-    std::cout << "\n";
-}
-
-void trace(const std::string &log, bool const &force) {
-    if (!force && !verbose) {
-        return;
+    trace("Usage of " + name + ": " + result.usage.describe());
+
+    if (!job.options.metricsFile.empty()) {
+        metrics::Record record;
+        record.add("key", job.key)
+                .add("cacheSource", job.options.cacheSource)
+                .add("command", name)
+                .add("exitCode", (long long) result.exitCode)
+                .add("timedOut", result.timedOut)
+                .add("wallSeconds", result.usage.wallSeconds)
+                .add("userSeconds", result.usage.userSeconds)
+                .add("systemSeconds", result.usage.systemSeconds)
+                .add("maxResidentKilobytes", (long long) result.usage.maxResidentKilobytes)
+                .add("blockInputs", (long long) result.usage.blockInputs)
+                .add("blockOutputs", (long long) result.usage.blockOutputs)
+                .add("voluntaryContextSwitches", (long long) result.usage.voluntaryContextSwitches)
+                .add("involuntaryContextSwitches", (long long) result.usage.involuntaryContextSwitches);
+
+        if (!metrics::append(job.options.metricsFile, record)) {
+            trace("Cannot write metrics to " + job.options.metricsFile);
+        }
     }
 
-    std::cout << log;
-
-    trace(force);
+    return result;
 }
 
 
@@ -294,70 +1100,442 @@ std::string generateMd5FromString(const std::string &content) {
 }
 
 void createCache(
-        const std::string &setupCommand,
         const std::string &cacheSource,
-        const std::string &commandString,
+        const std::string &cacheDestination,
         const std::string &targetDirectoryPath,
         const stdfs::copy_options &copyOptions,
-        const bool &archive
+        const bool &archive,
+        const compress::ArchiveOptions &archiveOptions,
+        const bool &syncToDisk,
+        const bool &asyncStore,
+        const bool &snapshotLinks,
+        double setupSeconds,
+        const eviction::Limits &cacheLimits,
+        cadird::Client &daemonClient
 ) {
-    trace("Execute: " + commandString);
-    int setupExitCode = executeCommand(commandString);
-    if (setupExitCode != 0) {
-        throw (SetupCommandException("Setup command failed", ExitCode::setupCommandFailed));
+    if (asyncStore && storeInBackground(cacheSource, cacheDestination, targetDirectoryPath, copyOptions, archive,
+                                        archiveOptions, syncToDisk, snapshotLinks, setupSeconds, cacheLimits,
+                                        daemonClient)) {
+        return;
     }
-    if (archive) {
-        trace("Archive: " + targetDirectoryPath);
 
-        stdfs::path cacheSourcePath(cacheSource);
-        std::string targetDirectoryPathString(targetDirectoryPath);
+    storeCache(cacheSource, cacheDestination, targetDirectoryPath, copyOptions, archive, archiveOptions, syncToDisk,
+               setupSeconds, daemonClient);
 
-        std::vector<std::string> fileNames;
-        for (auto &p: stdfs::recursive_directory_iterator(cacheSource)) {
-            fileNames.push_back(p.path().u8string());
-            trace("add: " + p.path().u8string());
-        }
+    if (cacheLimits.any()) {
+        evictInBackground(cacheDestination, cacheLimits);
+    }
+}
 
-        compress::write_archive(
-                cacheSourcePath.parent_path(),
-                targetDirectoryPathString.append(archiveExtension).c_str(),
-                fileNames
+void storeCache(
+        const std::string &cacheSource,
+        const std::string &cacheDestination,
+        const std::string &targetDirectoryPath,
+        const stdfs::copy_options &copyOptions,
+        const bool &archive,
+        const compress::ArchiveOptions &archiveOptions,
+        const bool &syncToDisk,
+        double setupSeconds,
+        cadird::Client &daemonClient
+) {
+    const std::string key = stdfs::path(targetDirectoryPath).filename().u8string();
+
+    if (daemonClient.isConnected()) {
+        trace("Store through daemon");
+    }
+    if (!daemonClient.isConnected() ||
+        !daemonClient.store(key, archive, stdfs::absolute(cacheSource).u8string(), syncToDisk, archiveOptions)) {
+        cacheStore::store(
+                cacheSource,
+                cacheDestination,
+                targetDirectoryPath,
+                copyOptions,
+                archive,
+                archiveOptions,
+                syncToDisk
         );
-    } else {
-        trace("Copy: " + targetDirectoryPath);
+    }
+
+    // the cost of rebuilding the entry, for eviction policies
+    cacheIndex::recordSetupTime(
+            cacheDestination,
+            stdfs::path(cacheStore::entryPath(targetDirectoryPath, archive, archiveOptions)).filename().u8string(),
+            setupSeconds
+    );
+
+    daemonClient.release(key, archive);
+}
+
+/**
+ * Snapshots the cache source and stores the snapshot in a detached process, so the build continues at once.
+ * The process inherits the key lock and the daemon connection, other processes wait for the entry as before.
+ * Returns false if the snapshot or the process cannot be created, the cache is stored in the foreground then.
+ */
+bool storeInBackground(
+        const std::string &cacheSource,
+        const std::string &cacheDestination,
+        const std::string &targetDirectoryPath,
+        const stdfs::copy_options &copyOptions,
+        const bool &archive,
+        const compress::ArchiveOptions &archiveOptions,
+        const bool &syncToDisk,
+        const bool &snapshotLinks,
+        double setupSeconds,
+        const eviction::Limits &cacheLimits,
+        cadird::Client &daemonClient
+) {
+    const stdfs::path source = stdfs::absolute(cacheSource);
+    const std::string suffix = stdfs::path(targetDirectoryPath).filename().u8string() + "." +
+                               std::to_string(getpid());
+    struct stat sourceStatus{};
+    struct stat destinationStatus{};
+
+    // links and reflinks need the snapshot on the filesystem of the cache source
+    const bool besideSource = !(stat(source.c_str(), &sourceStatus) == 0 &&
+                                 stat(cacheDestination.c_str(), &destinationStatus) == 0 &&
+                                 sourceStatus.st_dev == destinationStatus.st_dev);
+    const stdfs::path snapshotRoot =
+            besideSource
+            ? source.parent_path() / ("." + source.filename().u8string() + snapshot::snapshotInfix + suffix)
+            : stdfs::path(cacheLayout::snapshotDirectory(cacheDestination)) / suffix;
+    const stdfs::path snapshotSource = snapshotRoot / source.filename();
+
+    try {
+        if (besideSource)
+            snapshot::registerSnapshot(cacheDestination, suffix, snapshotRoot);
+
+        snapshot::Statistics statistics = snapshot::create(source, snapshotSource, snapshotLinks);
+        trace("Snapshot " + source.u8string() + " to " + snapshotSource.u8string() + ": " +
+              std::to_string(statistics.cloned) + " cloned, " + std::to_string(statistics.linked) + " linked, " +
+              std::to_string(statistics.copied) + " copied files");
+    } catch (std::exception &exception) {
+        trace(std::string("Cannot snapshot cache source, store in foreground: ") + exception.what());
+        snapshot::removeSnapshot(cacheDestination, suffix, snapshotRoot);
+
+        return false;
+    }
+
+    bool started = runInBackground("store", [&]() {
+        int exitCode = ExitCode::ok;
+        try {
+            storeCache(snapshotSource.u8string(), cacheDestination, targetDirectoryPath, copyOptions, archive,
+                       archiveOptions, syncToDisk, setupSeconds, daemonClient);
+        } catch (CadirException &exception) {
+            exitCode = exception.getErrorCode();
+        } catch (...) {
+            exitCode = ExitCode::copyToCacheFailed;
+        }
+
+        snapshot::removeSnapshot(cacheDestination, suffix, snapshotRoot);
+
+        // already in the background, the eviction does not need its own process
+        if (exitCode == ExitCode::ok && cacheLimits.any()) {
+            try {
+                eviction::evict(cacheDestination, cacheLimits);
+            } catch (...) {
+            }
+        }
+
+        return exitCode;
+    });
+
+    if (!started) {
+        trace("Store in foreground");
+        snapshot::removeSnapshot(cacheDestination, suffix, snapshotRoot);
+    }
+
+    return started;
+}
+
+/**
+ * Runs work in a detached process with its exit code, the calling process continues at once.
+ * Must not be called while other threads run, the child process could inherit a held mutex.
+ * Returns false if the process cannot be created.
+ */
+bool runInBackground(const std::string &description, const std::function<int()> &work) {
+    std::cout.flush();
+    pid_t pid = fork();
+    if (pid < 0) {
+        trace("Cannot start background " + description);
+
+        return false;
+    }
+    if (pid > 0) {
+        trace("Run " + description + " in background process " + std::to_string(pid));
+
+        return true;
+    }
+
+    setsid();
+    int devNull = open("/dev/null", O_RDWR);
+    if (devNull >= 0) {
+        dup2(devNull, STDIN_FILENO);
+        dup2(devNull, STDOUT_FILENO);
+        dup2(devNull, STDERR_FILENO);
+    }
+
+    _exit(work());
+}
+
+// copies a new archive entry to the object store, a failure only means other machines build it as well
+void uploadCache(const std::string &entryPath, const std::string &cacheDestination,
+                 const remote::Options &remoteOptions, bool inBackground) {
+    auto upload = [&entryPath, &cacheDestination, &remoteOptions]() {
+        try {
+            remote::Client client(remoteOptions);
+            remote::upload(client, entryPath, cacheDestination);
+        } catch (RemoteStorageException &exception) {
+            trace(std::string(exception.what()), true);
+            return (int) exception.getErrorCode();
+        }
+
+        return (int) ExitCode::ok;
+    };
+
+    if (!inBackground || !runInBackground("upload to " + remoteOptions.url, upload)) {
+        upload();
+    }
+}
+
+// evicts entries beyond the limits, the build does not wait for the deletes
+bool evictInBackground(const std::string &cacheDestination, const eviction::Limits &cacheLimits) {
+    return runInBackground("eviction of " + cacheDestination, [&cacheDestination, &cacheLimits]() {
         try {
-            trace("Create cache directory: " + targetDirectoryPath);
-            stdfs::create_directories(targetDirectoryPath);
+            eviction::evict(cacheDestination, cacheLimits);
         } catch (...) {
-            throw (CreateCacheDirectoryException("Create cache directories failed",
-                                                 ExitCode::createCacheDirectoriesFailed));
+            return (int) ExitCode::cleaningFailed;
         }
+
+        return (int) ExitCode::ok;
+    });
+}
+
+
+// copies an entry stored in the local tier to the shared tier, which makes it available to other machines
+void propagateCache(
+        const std::string &localEntryPath,
+        const std::string &localCacheDestination,
+        const std::string &cacheDestination,
+        const std::string &targetDirectoryPath,
+        const bool &archive,
+        double setupSeconds,
+        uintmax_t minFreeSpace,
+        cadird::Client &daemonClient
+) {
+    const uintmax_t entryBytes = cacheIndex::measure(localEntryPath).bytes;
+    if (!freeSpace::makeRoom(cacheDestination, entryBytes, minFreeSpace)) {
+        trace("Not enough space in " + cacheDestination + " for " + std::to_string(entryBytes) +
+              " bytes, the cache is only stored in the local tier", true);
+        daemonClient.release(stdfs::path(targetDirectoryPath).filename().u8string(), archive);
+        return;
+    }
+
+    trace("Propagate " + localEntryPath + " to " + cacheDestination);
+    tier::copyEntry(localEntryPath, localCacheDestination, cacheDestination);
+
+    cacheIndex::recordSetupTime(cacheDestination, stdfs::path(localEntryPath).filename().u8string(), setupSeconds);
+    daemonClient.release(stdfs::path(targetDirectoryPath).filename().u8string(), archive);
+}
+
+/**
+ * Propagates the entry in a detached process, like storeInBackground it inherits the key lock and the daemon
+ * connection, so other machines wait for the shared entry. Returns false if the process cannot be created.
+ */
+bool propagateInBackground(
+        const std::string &localEntryPath,
+        const std::string &localCacheDestination,
+        const std::string &cacheDestination,
+        const std::string &targetDirectoryPath,
+        const bool &archive,
+        double setupSeconds,
+        const eviction::Limits &cacheLimits,
+        uintmax_t minFreeSpace,
+        cadird::Client &daemonClient
+) {
+    return runInBackground("propagation to " + cacheDestination, [&]() {
+        int exitCode = ExitCode::ok;
         try {
-            trace("Copy data from " + cacheSource + " to " + targetDirectoryPath);
-            stdfs::copy(cacheSource, targetDirectoryPath, copyOptions);
+            propagateCache(localEntryPath, localCacheDestination, cacheDestination, targetDirectoryPath, archive,
+                           setupSeconds, minFreeSpace, daemonClient);
+        } catch (CadirException &exception) {
+            exitCode = exception.getErrorCode();
         } catch (...) {
-            trace("Copy to cache failed");
-            throw (CopyToCacheFailedException("Copy to cache failed", ExitCode::copyToCacheFailed));
+            exitCode = ExitCode::copyToCacheFailed;
         }
+
+        if (exitCode == ExitCode::ok && cacheLimits.any()) {
+            try {
+                eviction::evict(cacheDestination, cacheLimits);
+            } catch (...) {
+            }
+        }
+
+        return exitCode;
+    });
+}
+
+/**
+ * Only one process builds the cache of a key, the others wait for it and restore the result.
+ * Restoring processes hold the lock shared, so the entry is not evicted while it is read.
+ * Returns nullptr if the lock cannot be taken in time, the cache is used without lock then.
+ */
+std::unique_ptr<KeyLock> lockKey(
+        const std::string &cacheDestination,
+        const std::string &key,
+        unsigned int timeout,
+        bool exclusive
+) {
+    try {
+        stdfs::create_directories(cacheLayout::lockDirectory(cacheDestination));
+    } catch (...) {
+        trace("Cannot create lock directory, continue without lock");
+
+        return nullptr;
+    }
+
+    auto keyLock = std::make_unique<KeyLock>(cacheLayout::lockFile(cacheDestination, key));
+
+    trace("Wait for lock of " + key);
+    if (!(exclusive ? keyLock->lockExclusive(timeout) : keyLock->lockShared(timeout))) {
+        trace("Cannot get lock within " + std::to_string(timeout) + " seconds, continue without lock");
+
+        return nullptr;
     }
+
+    return keyLock;
 }
 
-int updateAccessTime(const char *fileName) {
-    struct utimbuf utimbuf{};
+int runDaemon(const std::string &cacheDestination, const std::string &socketPath, unsigned int workers,
+              const gc::Options &gcOptions, unsigned int gcInterval, migration::Options migrationOptions,
+              unsigned int migrateInterval, const std::string &socketGroup) {
+    if (gcInterval > 0 && !gcOptions.hasTarget()) {
+        trace("--gc-interval needs --target-size, --free-percent, --free-space or --policy=ttl with --max-age", true);
+
+        return ExitCode::argumentParsingFailed;
+    }
 
-    utimbuf.modtime =  std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+    gid_t socketGroupId = cadird::noGroup;
+    if (!socketGroup.empty()) {
+        struct group *group = getgrnam(socketGroup.c_str());
+        if (group == nullptr) {
+            trace("Unknown socket group " + socketGroup, true);
 
-    return utime(fileName, &utimbuf);
+            return ExitCode::argumentParsingFailed;
+        }
+        socketGroupId = group->gr_gid;
+    }
+
+    try {
+        stdfs::create_directories(cacheDestination);
+    } catch (...) {
+        throw (CreateCacheDirectoryException("Create cache directories failed",
+                                             ExitCode::createCacheDirectoriesFailed));
+    }
+
+    // --jobs and --dry-run of the gc options apply to the migration as well
+    migrationOptions.jobs = gcOptions.jobs;
+    migrationOptions.dryRun = gcOptions.dryRun;
+
+    cadird::Server server(
+            cacheDestination,
+            socketPath.empty() ? cacheLayout::socketFile(cacheDestination) : socketPath,
+            workers,
+            gcOptions,
+            gcInterval,
+            migrationOptions,
+            migrateInterval,
+            socketGroupId
+    );
+
+    return server.run();
+}
+
+int collectGarbage(const std::string &cacheDestination, const gc::Options &options) {
+    if (!options.hasTarget()) {
+        trace("gc needs --target-size, --free-percent, --free-space or --policy=ttl with --max-age", true);
+
+        return ExitCode::argumentParsingFailed;
+    }
+
+    gc::Statistics statistics = gc::collect(cacheDestination, options);
+    if (statistics.skipped) {
+        trace("An eviction or garbage collection of " + cacheDestination + " runs already", true);
+
+        return ExitCode::ok;
+    }
+
+    trace(std::to_string(statistics.entries) + " entries, " + std::to_string(statistics.bytes) + " bytes, " +
+          (options.dryRun ? "would evict " : "evicted ") + std::to_string(statistics.evicted.evicted) +
+          " entries, " + std::to_string(statistics.evicted.bytes) + " bytes, " +
+          std::to_string(statistics.staleFiles) + " stale files, " + std::to_string(statistics.chunks.chunks) +
+          " unreferenced chunks (" + std::to_string(statistics.chunks.bytes) + " bytes)", true);
+
+    return ExitCode::ok;
+}
+
+int runMigration(const std::string &cacheDestination, const migration::Options &options) {
+    migration::Statistics statistics = migration::migrateEntries(cacheDestination, options);
+    if (statistics.skipped) {
+        trace("An eviction, garbage collection or migration of " + cacheDestination + " runs already", true);
+
+        return ExitCode::ok;
+    }
+
+    trace((options.dryRun ? "Would archive " : "Archived ") + std::to_string(statistics.archived) +
+          " cold entries, " + (options.dryRun ? "would expand " : "expanded ") +
+          std::to_string(statistics.expanded) + " hot entries, " + std::to_string(statistics.kept) +
+          " entries in use", true);
+
+    return ExitCode::ok;
+}
+
+int verifyEntries(const std::string &cacheDestination, const std::vector<std::string> &keys, bool all,
+                  const integrity::Options &options) {
+    if (keys.empty() != all) {
+        trace("verify needs keys or --all", true);
+
+        return ExitCode::argumentParsingFailed;
+    }
+
+    integrity::Statistics statistics = integrity::verifyEntries(cacheDestination, keys, options);
+
+    trace(std::to_string(statistics.intact) + " intact entries (" + std::to_string(statistics.bytes) + " bytes), " +
+          std::to_string(statistics.corrupt) + " corrupt, " + std::to_string(statistics.quarantined) +
+          " quarantined, " + std::to_string(statistics.unverified) + " without checksums", true);
+
+    return statistics.corrupt > 0 ? ExitCode::verificationFailed : ExitCode::ok;
+}
+
+int prewarmCache(const std::string &cacheDestination, const std::vector<std::string> &keys, size_t count,
+                 unsigned int jobs) {
+    std::vector<stdfs::path> entries;
+
+    try {
+        entries = prewarm::selectEntries(cacheDestination, keys, count);
+    } catch (std::exception &exception) {
+        throw (CopyFromCacheException(std::string("Cannot read cache destination: ") + exception.what(),
+                                      ExitCode::copyFromCacheFailed));
+    }
+
+    prewarm::Statistics statistics;
+    prewarm::warm(entries, jobs, statistics);
+
+    trace("Prewarmed " + std::to_string(entries.size()) + " entries, " + std::to_string(statistics.files) +
+          " files, " + std::to_string(statistics.bytes) + " bytes");
+
+    return ExitCode::ok;
 }
 
 void loadFromCache(
         const std::string &cacheSource,
         const std::string &currentWorkingDirectoryPath,
         const bool linkCache,
-        const std::string &commandString,
         const std::string &targetDirectoryPath,
         const stdfs::copy_options &copyOptions,
-        const bool &archive
+        const bool &archive,
+        const bool &fastExtract,
+        cadird::Client &daemonClient,
+        const std::string &localCacheDestination
 ) {
     trace("Cache found");
     try {
@@ -369,34 +1547,29 @@ void loadFromCache(
     }
     std::string fromPath = targetDirectoryPath;
     if (!linkCache) {
-        if (archive) {
-            trace("Extract data from " + targetDirectoryPath + archiveExtension + " to " + cacheSource);
-            std::string targetDirectoryPathString(targetDirectoryPath);
-            std::string fileNameWithExtension = targetDirectoryPathString.append(archiveExtension);
-
-            compress::extract(fileNameWithExtension.c_str());
-
-            if (updateAccessTime(fileNameWithExtension.c_str()) != 0)
-                trace("could not update access time");
+        const stdfs::path absoluteCacheSource = stdfs::absolute(cacheSource);
+
+        if (!localCacheDestination.empty()) {
+            // the daemon is not asked, the entry is copied to the local tier while it is read
+            tier::restoreThrough(
+                    archive ? cacheStore::findArchive(targetDirectoryPath) : targetDirectoryPath,
+                    stdfs::path(targetDirectoryPath).parent_path().u8string(),
+                    localCacheDestination,
+                    cacheSource,
+                    archive,
+                    fastExtract,
+                    absoluteCacheSource.parent_path().u8string()
+            );
         } else {
-            try {
-                trace("Copy data from " + targetDirectoryPath + " to " + cacheSource);
-                stdfs::copy(targetDirectoryPath, cacheSource, copyOptions);
-
-                if (updateAccessTime(cacheSource.c_str()) != 0)
-                    trace("could not update access time");
-
-            } catch (...) {
-                throw (CopyFromCacheException("Copy from cache failed", ExitCode::copyFromCacheFailed));
+            if (daemonClient.isConnected()) {
+                trace("Restore through daemon");
             }
-
-            if (!commandString.empty()) {
-                trace("Execute: " + commandString);
-
-                int finalizeExitCode = executeCommand(commandString);
-                if (finalizeExitCode != 0) {
-                    throw (FinalizeCommandException("Finalize command failed", ExitCode::finalizeCommandFailed));
-                }
+            if (!daemonClient.isConnected() ||
+                !daemonClient.restore(stdfs::path(targetDirectoryPath).filename().u8string(), archive,
+                                      absoluteCacheSource.u8string(), absoluteCacheSource.parent_path().u8string(),
+                                      fastExtract)) {
+                cacheStore::restore(cacheSource, targetDirectoryPath, copyOptions, archive, fastExtract,
+                                    absoluteCacheSource.parent_path().u8string());
             }
         }
     } else {
@@ -408,8 +1581,9 @@ void loadFromCache(
         try {
             stdfs::create_symlink(fromPath, cacheSource);
 
-            if (updateAccessTime(cacheSource.c_str()) != 0)
+            if (cacheStore::updateAccessTime(cacheSource.c_str()) != 0)
                 trace("could not update access time");
+            cacheStore::recordAccess(targetDirectoryPath);
         } catch (...) {
             throw (LinkFromCacheException("Cannot create symlink", ExitCode::createSymLinkFailed));
         }
@@ -0,0 +1,95 @@
+#pragma once //"metrics.hpp"
+
+#include <cstdio>
+#include <ctime>
+#include <string>
+#include <fcntl.h>
+#include <unistd.h>
+
+/**
+ * Metrics are appended to a file as one JSON object per line, so a collector can tail it.
+ */
+namespace metrics {
+    std::string escape(const std::string &value) {
+        std::string escaped;
+
+        for (char character: value) {
+            switch (character) {
+                case '"':
+                    escaped.append("\\\"");
+                    break;
+                case '\\':
+                    escaped.append("\\\\");
+                    break;
+                case '\n':
+                    escaped.append("\\n");
+                    break;
+                case '\t':
+                    escaped.append("\\t");
+                    break;
+                default:
+                    if ((unsigned char) character < 0x20) {
+                        char code[7];
+                        snprintf(code, sizeof(code), "\\u%04x", character);
+                        escaped.append(code);
+                    } else {
+                        escaped.push_back(character);
+                    }
+            }
+        }
+
+        return escaped;
+    }
+
+    class Record {
+    public:
+        Record() {
+            add("time", (long long) time(nullptr));
+        }
+
+        Record &add(const std::string &name, const std::string &value) {
+            return addRaw(name, "\"" + escape(value) + "\"");
+        }
+
+        Record &add(const std::string &name, const char *value) {
+            return add(name, std::string(value));
+        }
+
+        Record &add(const std::string &name, long long value) {
+            return addRaw(name, std::to_string(value));
+        }
+
+        Record &add(const std::string &name, double value) {
+            return addRaw(name, std::to_string(value));
+        }
+
+        Record &add(const std::string &name, bool value) {
+            return addRaw(name, value ? "true" : "false");
+        }
+
+        std::string json() const {
+            return "{" + fields + "}";
+        }
+
+    private:
+        std::string fields;
+
+        Record &addRaw(const std::string &name, const std::string &value) {
+            fields.append(fields.empty() ? "" : ",").append("\"" + escape(name) + "\":" + value);
+            return *this;
+        }
+    };
+
+    // a single write with O_APPEND, lines of concurrent processes do not mix
+    bool append(const std::string &metricsFile, const Record &record) {
+        int fileDescriptor = open(metricsFile.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+        if (fileDescriptor < 0)
+            return false;
+
+        const std::string line = record.json() + "\n";
+        bool written = write(fileDescriptor, line.data(), line.size()) == (ssize_t) line.size();
+        close(fileDescriptor);
+
+        return written;
+    }
+}
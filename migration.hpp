@@ -0,0 +1,202 @@
+#pragma once //"migration.hpp"
+
+#include <config.h>
+#include <algorithm>
+#include <ctime>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+#include "cacheIndex.hpp"
+#include "cacheLayout.hpp"
+#include "cacheStore.hpp"
+#include "compress.hpp"
+#include "eviction.hpp"
+#include "integrity.hpp"
+#include "keyLock.hpp"
+#include "lease.hpp"
+#include "publish.hpp"
+#include "trace.hpp"
+
+/**
+ * Moves entries between the directory and the archive format by their use, run by "cadir migrate" or
+ * periodically by the daemon. Directory entries restore fastest but cost inodes and space, archives are
+ * compact. Entries unused for coldSeconds are archived, archives restored at least hotHits times and used
+ * within coldSeconds are expanded into directories. Lookups find an entry in either format.
+ *
+ * The new format is published before the old one is moved to the trash, so a lookup always finds one of
+ * them. Leased entries and entries whose key lock is taken are left alone.
+ */
+namespace migration {
+    const unsigned int defaultHotHits = 10;
+    const unsigned int defaultColdSeconds = 7 * 86400;
+
+    struct Options {
+        unsigned int hotHits = defaultHotHits;
+        unsigned int coldSeconds = defaultColdSeconds;
+        unsigned int jobs = 1;
+        bool dryRun = false;
+    };
+
+    struct Statistics {
+        bool skipped = false;
+        size_t archived = 0;
+        size_t expanded = 0;
+        // in use or failed, they are tried again by the next migration
+        size_t kept = 0;
+    };
+
+    enum class Direction {
+        archive,
+        expand
+    };
+
+    /**
+     * Entries to migrate, coldest directories and hottest archives first. Keys which exist in both formats
+     * are not migrated.
+     */
+    std::vector<std::pair<std::string, Direction>> plan(const cacheIndex::Entries &entries, const Options &options,
+                                                        time_t now) {
+        std::vector<std::pair<time_t, std::string>> cold;
+        std::vector<std::pair<uint64_t, std::string>> hot;
+        std::map<std::string, size_t> formats;
+
+        for (auto &entry: entries)
+            formats[entry.first.substr(0, cacheLayout::entryKeyLength)]++;
+
+        for (auto &entry: entries) {
+            const std::string &name = entry.first;
+            const cacheIndex::Entry &values = entry.second;
+            if (formats[name.substr(0, cacheLayout::entryKeyLength)] > 1)
+                continue;
+
+            const bool recentlyUsed = values.lastAccess + (time_t) options.coldSeconds > now;
+            if (name.size() == cacheLayout::entryKeyLength) {
+                if (!recentlyUsed)
+                    cold.emplace_back(values.lastAccess, name);
+            } else if (recentlyUsed && options.hotHits > 0 && values.hits >= options.hotHits) {
+                hot.emplace_back(values.hits, name);
+            }
+        }
+
+        std::sort(cold.begin(), cold.end());
+        std::sort(hot.rbegin(), hot.rend());
+
+        std::vector<std::pair<std::string, Direction>> migrations;
+        for (auto &entry: cold)
+            migrations.emplace_back(entry.second, Direction::archive);
+        for (auto &entry: hot)
+            migrations.emplace_back(entry.second, Direction::expand);
+
+        return migrations;
+    }
+
+    /**
+     * Builds the entry name in its new format below temporaryPath and returns the path to publish. The
+     * archive holds the directory of the entry, restores extract it under the name of their cache source.
+     */
+    std::string convert(const std::string &cacheDestination, const std::string &name, Direction direction,
+                        const std::string &temporaryPath, unsigned int jobs) {
+        const std::string entryPath = (stdfs::path(cacheDestination) / name).u8string();
+
+        if (direction == Direction::archive) {
+            compress::ArchiveOptions archiveOptions;
+            archiveOptions.compressionThreads = jobs;
+            compress::write_archive(cacheDestination, temporaryPath.c_str(), entryPath, archiveOptions);
+
+            return temporaryPath;
+        }
+
+        // extracted as <temporaryPath>/entry whatever directory the archive holds, it becomes the directory entry
+        compress::TopLevel topLevel;
+        topLevel.to = "entry";
+        stdfs::create_directories(temporaryPath);
+        cacheStore::extractArchive(entryPath, false, temporaryPath, topLevel);
+
+        return (stdfs::path(temporaryPath) / "entry").u8string();
+    }
+
+    /**
+     * Converts one entry while its key is locked. Returns false if it is in use or the conversion failed.
+     */
+    bool migrate(const std::string &cacheDestination, const std::string &name, const cacheIndex::Entry &entry,
+                 Direction direction, const Options &options) {
+        const std::string key = name.substr(0, cacheLayout::entryKeyLength);
+        const std::string newName = (direction == Direction::archive) ? key + cacheStore::archiveExtension : key;
+
+        if (lease::isLeased(cacheDestination, key))
+            return false;
+        // restores hold the key lock shared
+        KeyLock keyLock(cacheLayout::lockFile(cacheDestination, key));
+        if (!keyLock.lockExclusive(0))
+            return false;
+
+        trace((options.dryRun ? "Would " : "") +
+              std::string(direction == Direction::archive ? "Archive cold entry " : "Expand hot entry ") + name,
+              options.dryRun);
+        if (options.dryRun)
+            return true;
+
+        std::string temporaryPath;
+        std::error_code errorCode;
+        try {
+            temporaryPath = publish::temporaryPath(cacheDestination, newName);
+            const std::string convertedPath = convert(cacheDestination, name, direction, temporaryPath,
+                                                      options.jobs);
+
+            const cacheIndex::Size size = cacheIndex::measure(convertedPath);
+            const std::string checksums = integrity::computeChecksums(convertedPath, options.jobs);
+            if (publish::publish(convertedPath, (stdfs::path(cacheDestination) / newName).u8string())) {
+                cacheIndex::recordMigration(cacheDestination, newName, size, entry);
+                integrity::record(cacheDestination, newName, checksums);
+            }
+        } catch (std::exception &exception) {
+            trace("Cannot migrate " + name + ": " + exception.what());
+        }
+        // whatever was not published
+        if (!temporaryPath.empty())
+            stdfs::remove_all(temporaryPath, errorCode);
+
+        if (!stdfs::exists(stdfs::path(cacheDestination) / newName))
+            return false;
+        if (eviction::moveToTrash(cacheDestination, name))
+            cacheIndex::recordRemovals(cacheDestination, {name});
+
+        return true;
+    }
+
+    /**
+     * Migrates the entries of the cache destination by options. Skipped if an eviction, a garbage collection
+     * or another migration runs.
+     */
+    Statistics migrateEntries(const std::string &cacheDestination, const Options &options) {
+        Statistics statistics;
+        std::error_code errorCode;
+        stdfs::create_directories(cacheLayout::lockDirectory(cacheDestination), errorCode);
+
+        KeyLock evictionLock(cacheLayout::evictionLockFile(cacheDestination));
+        if (!evictionLock.lockExclusive(0)) {
+            statistics.skipped = true;
+            return statistics;
+        }
+
+        const cacheIndex::Entries entries = cacheIndex::reconcile(cacheDestination, options.jobs);
+        for (auto &migration: plan(entries, options, time(nullptr))) {
+            if (!migrate(cacheDestination, migration.first, entries.at(migration.first), migration.second,
+                         options)) {
+                statistics.kept++;
+                continue;
+            }
+
+            if (migration.second == Direction::archive)
+                statistics.archived++;
+            else
+                statistics.expanded++;
+        }
+
+        if (!options.dryRun)
+            eviction::emptyTrash(cacheDestination, options.jobs);
+
+        return statistics;
+    }
+}
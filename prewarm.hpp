@@ -0,0 +1,109 @@
+#pragma once //"prewarm.hpp"
+
+#include <config.h>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "cacheLayout.hpp"
+#include "cacheStore.hpp"
+#include "workerPool.hpp"
+#include "trace.hpp"
+
+/**
+ * Reads cache entries into the page cache ahead of their restore, e.g. after a reboot of a build agent
+ * whose cache destination is on a slow disk.
+ */
+namespace prewarm {
+    const size_t defaultEntries = 10;
+
+    struct Statistics {
+        std::atomic<size_t> files{0};
+        std::atomic<uintmax_t> bytes{0};
+    };
+
+    // readahead() returns when the pages are read, fadvise only schedules the read if it is not available
+    void warmFile(const stdfs::path &file, Statistics &statistics) {
+        int fileDescriptor = open(file.c_str(), O_RDONLY | O_CLOEXEC | O_NOATIME);
+        if (fileDescriptor < 0)
+            fileDescriptor = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fileDescriptor < 0)
+            return;
+
+        struct stat status{};
+        if (fstat(fileDescriptor, &status) == 0 && status.st_size > 0) {
+            if (readahead(fileDescriptor, 0, status.st_size) != 0)
+                posix_fadvise(fileDescriptor, 0, 0, POSIX_FADV_WILLNEED);
+
+            statistics.files++;
+            statistics.bytes += status.st_size;
+        }
+
+        close(fileDescriptor);
+    }
+
+    /**
+     * Entries of the given keys in all formats, or the count most recently used entries without keys.
+     */
+    std::vector<stdfs::path> selectEntries(const std::string &cacheDestination, const std::vector<std::string> &keys,
+                                           size_t count) {
+        if (keys.empty())
+            return cacheStore::recentEntries(cacheDestination, count);
+
+        std::vector<stdfs::path> entries;
+        for (auto &key: keys) {
+            const std::string targetDirectoryPath = (stdfs::path(cacheDestination) / key).u8string();
+
+            if (stdfs::is_directory(targetDirectoryPath))
+                entries.emplace_back(targetDirectoryPath);
+            for (auto &extension: {cacheStore::archiveExtension, cacheStore::chunkedArchiveExtension}) {
+                if (stdfs::exists(targetDirectoryPath + extension))
+                    entries.emplace_back(targetDirectoryPath + extension);
+            }
+        }
+
+        return entries;
+    }
+
+    /**
+     * Reads the files of the entries on jobs threads. Walking directory entries also loads their inodes.
+     */
+    void warm(const std::vector<stdfs::path> &entries, unsigned int jobs, Statistics &statistics) {
+        WorkerPool pool(jobs);
+
+        for (auto &entry: entries) {
+            trace("Prewarm " + entry.u8string());
+
+            // the chunks of a chunked entry are read with it
+            if (cacheStore::isChunked(entry.u8string())) {
+                pool.submit([&statistics, entry] { warmFile(entry, statistics); });
+                try {
+                    const std::string cacheDestination = entry.parent_path().u8string();
+                    for (auto &chunk: chunkStore::readManifest(entry.u8string())) {
+                        pool.submit([&statistics, file = cacheLayout::chunkFile(cacheDestination, chunk.hash)] {
+                            warmFile(file, statistics);
+                        });
+                    }
+                } catch (...) {
+                    trace("Cannot read the chunks of " + entry.u8string());
+                }
+                continue;
+            }
+
+            if (!stdfs::is_directory(entry)) {
+                pool.submit([&statistics, entry] { warmFile(entry, statistics); });
+                continue;
+            }
+
+            std::error_code errorCode;
+            for (stdfs::recursive_directory_iterator iterator(entry, errorCode), end;
+                 !errorCode && iterator != end; iterator.increment(errorCode)) {
+                if (iterator->is_regular_file(errorCode)) {
+                    pool.submit([&statistics, file = iterator->path()] { warmFile(file, statistics); });
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,318 @@
+#pragma once //"process.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cerrno>
+#include <csignal>
+#include <fcntl.h>
+#include <poll.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "trace.hpp"
+
+extern char **environ;
+
+/**
+ * Runs setup and finalize commands without a shell where the command line does not need one. The working
+ * directory is changed by the spawned process itself, the output goes straight to the output of cadir.
+ */
+namespace process {
+    const std::string shell = "/bin/sh";
+    // quoting, redirection, pipes, lists, expansions and variable assignments need the shell
+    const std::string shellCharacters = "|&;<>()$`\\\"'*?[]#~={}!\n";
+    const int cannotExecute = 127;
+    // after SIGTERM the process group gets this long to exit before SIGKILL
+    const unsigned int terminateGraceSeconds = 5;
+    // a build writing a lot of output is read in few large blocks
+    const size_t outputBlockSize = 64 * 1024;
+
+    /**
+     * Resources of a command and the processes it waited for, from wait4.
+     */
+    struct Usage {
+        double wallSeconds = 0;
+        double userSeconds = 0;
+        double systemSeconds = 0;
+        long maxResidentKilobytes = 0;
+        long blockInputs = 0;
+        long blockOutputs = 0;
+        long voluntaryContextSwitches = 0;
+        long involuntaryContextSwitches = 0;
+
+        std::string describe() const {
+            return "wall " + std::to_string(wallSeconds) + "s, user " + std::to_string(userSeconds) +
+                   "s, system " + std::to_string(systemSeconds) + "s, max rss " +
+                   std::to_string(maxResidentKilobytes) + " KB, block input " + std::to_string(blockInputs) +
+                   " output " + std::to_string(blockOutputs) + ", context switches " +
+                   std::to_string(voluntaryContextSwitches) + " voluntary " +
+                   std::to_string(involuntaryContextSwitches) + " involuntary";
+        }
+    };
+
+    struct Result {
+        int exitCode = 0;
+        bool timedOut = false;
+        Usage usage;
+        // last bytes of stdout and stderr, if they were captured
+        std::string outputTail;
+    };
+
+    struct Command {
+        std::string workingDirectory;
+        std::string commandLine;
+        // run through the shell even if the command line does not need it
+        bool shell = false;
+
+        bool empty() const {
+            return commandLine.find_first_not_of(" \t") == std::string::npos;
+        }
+
+        std::string describe() const {
+            return workingDirectory.empty() ? commandLine : "cd " + workingDirectory + "; " + commandLine;
+        }
+    };
+
+    bool needsShell(const std::string &commandLine) {
+        return commandLine.find_first_of(shellCharacters) != std::string::npos;
+    }
+
+    std::vector<std::string> arguments(const Command &command) {
+        if (command.shell || needsShell(command.commandLine))
+            return {shell, "-c", command.commandLine};
+
+        std::vector<std::string> words;
+        size_t start = command.commandLine.find_first_not_of(" \t");
+        while (start != std::string::npos) {
+            size_t end = command.commandLine.find_first_of(" \t", start);
+            words.push_back(command.commandLine.substr(start, end == std::string::npos ? end : end - start));
+            start = command.commandLine.find_first_not_of(" \t", end);
+        }
+
+        return words;
+    }
+
+    int exitCode(int status) {
+        if (WIFEXITED(status))
+            return WEXITSTATUS(status);
+        if (WIFSIGNALED(status))
+            return 128 + WTERMSIG(status);
+
+        return 255;
+    }
+
+    /**
+     * Starts the command, its output goes to the output of cadir with forwardOutput, to /dev/null otherwise.
+     * An outputDescriptor replaces both. With ownProcessGroup the command and its children can be killed
+     * together, but they no longer get the signals of the terminal. Returns the pid or -1 if it cannot be
+     * started.
+     */
+    pid_t spawn(const Command &command, bool forwardOutput, bool ownProcessGroup, int outputDescriptor = -1) {
+        std::vector<std::string> words = arguments(command);
+        std::vector<char *> argumentList;
+        for (auto &word: words)
+            argumentList.push_back(&word[0]);
+        argumentList.push_back(nullptr);
+
+        // the command writes to the same descriptors, what cadir buffered must come first
+        std::cout.flush();
+        std::cerr.flush();
+
+        pid_t pid = -1;
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 29))
+        posix_spawn_file_actions_t fileActions;
+        posix_spawn_file_actions_init(&fileActions);
+        if (!command.workingDirectory.empty())
+            posix_spawn_file_actions_addchdir_np(&fileActions, command.workingDirectory.c_str());
+        if (outputDescriptor >= 0) {
+            posix_spawn_file_actions_adddup2(&fileActions, outputDescriptor, STDOUT_FILENO);
+            posix_spawn_file_actions_adddup2(&fileActions, outputDescriptor, STDERR_FILENO);
+        } else if (!forwardOutput) {
+            posix_spawn_file_actions_addopen(&fileActions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+            posix_spawn_file_actions_adddup2(&fileActions, STDOUT_FILENO, STDERR_FILENO);
+        }
+
+        posix_spawnattr_t attributes;
+        posix_spawnattr_init(&attributes);
+        if (ownProcessGroup) {
+            posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETPGROUP);
+            posix_spawnattr_setpgroup(&attributes, 0);
+        }
+
+        int error = posix_spawnp(&pid, argumentList[0], &fileActions, &attributes, argumentList.data(), environ);
+        posix_spawn_file_actions_destroy(&fileActions);
+        posix_spawnattr_destroy(&attributes);
+
+        return (error == 0) ? pid : -1;
+#else
+        // without posix_spawn_file_actions_addchdir_np the child has to change the directory itself
+        pid = fork();
+        if (pid != 0)
+            return pid;
+
+        if (ownProcessGroup)
+            setpgid(0, 0);
+        if (!command.workingDirectory.empty() && chdir(command.workingDirectory.c_str()) != 0)
+            _exit(cannotExecute);
+        if (outputDescriptor >= 0) {
+            dup2(outputDescriptor, STDOUT_FILENO);
+            dup2(outputDescriptor, STDERR_FILENO);
+        } else if (!forwardOutput) {
+            int devNull = open("/dev/null", O_WRONLY);
+            dup2(devNull, STDOUT_FILENO);
+            dup2(devNull, STDERR_FILENO);
+        }
+
+        execvp(argumentList[0], argumentList.data());
+        _exit(cannotExecute);
+#endif
+    }
+
+    double seconds(const struct timeval &time) {
+        return time.tv_sec + time.tv_usec / 1e6;
+    }
+
+    /**
+     * Waits for the command. After timeoutSeconds, if not 0, its process group is terminated and killed after
+     * the grace period, also if the command itself ended within it and left other processes of the group.
+     */
+    Result wait(pid_t pid, unsigned int timeoutSeconds) {
+        const auto start = std::chrono::steady_clock::now();
+        const auto deadline = start + std::chrono::seconds(timeoutSeconds);
+        auto interval = std::chrono::milliseconds(10);
+        Result result;
+        int status = 0;
+        struct rusage usage{};
+        bool terminated = false;
+
+        for (;;) {
+            pid_t waited = wait4(pid, &status, (timeoutSeconds > 0) ? WNOHANG : 0, &usage);
+            if (waited == pid)
+                break;
+            if (waited < 0 && errno != EINTR) {
+                result.exitCode = 255;
+                return result;
+            }
+            if (waited != 0)
+                continue;
+
+            auto now = std::chrono::steady_clock::now();
+            if (!terminated && now >= deadline) {
+                kill(-pid, SIGTERM);
+                terminated = true;
+                result.timedOut = true;
+            } else if (terminated && now >= deadline + std::chrono::seconds(terminateGraceSeconds)) {
+                kill(-pid, SIGKILL);
+                timeoutSeconds = 0;
+            }
+
+            std::this_thread::sleep_for(interval);
+            interval = std::min(interval * 2, std::chrono::milliseconds(100));
+        }
+
+        result.exitCode = exitCode(status);
+        result.usage.wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        result.usage.userSeconds = seconds(usage.ru_utime);
+        result.usage.systemSeconds = seconds(usage.ru_stime);
+        result.usage.maxResidentKilobytes = usage.ru_maxrss;
+        result.usage.blockInputs = usage.ru_inblock;
+        result.usage.blockOutputs = usage.ru_oublock;
+        result.usage.voluntaryContextSwitches = usage.ru_nvcsw;
+        result.usage.involuntaryContextSwitches = usage.ru_nivcsw;
+
+        if (terminated) {
+            const auto killAt = deadline + std::chrono::seconds(terminateGraceSeconds);
+            while (kill(-pid, 0) == 0 && std::chrono::steady_clock::now() < killAt)
+                std::this_thread::sleep_for(std::chrono::milliseconds(50));
+            kill(-pid, SIGKILL);
+        }
+
+        return result;
+    }
+
+    /**
+     * Reads the output pipe of a command until it is closed, or until finished is set and nothing more
+     * arrives, since background processes of the command may keep it open. Keeps the last tailBytes.
+     * Forwarded output is buffered by std::cout like the traces, it is not flushed per block.
+     */
+    void captureOutput(int pipeDescriptor, bool forwardOutput, size_t tailBytes, const std::atomic<bool> &finished,
+                       std::string &tail) {
+        std::vector<char> buffer(outputBlockSize);
+
+        for (;;) {
+            struct pollfd pollDescriptor{pipeDescriptor, POLLIN, 0};
+            int ready = poll(&pollDescriptor, 1, 100);
+            if (ready < 0 && errno != EINTR)
+                return;
+            if (ready <= 0) {
+                if (finished)
+                    return;
+                continue;
+            }
+
+            ssize_t bytes = read(pipeDescriptor, buffer.data(), buffer.size());
+            if (bytes < 0 && errno == EINTR)
+                continue;
+            if (bytes <= 0)
+                return;
+
+            if (forwardOutput) {
+                std::lock_guard<std::mutex> lock(traceMutex);
+                std::cout.write(buffer.data(), bytes);
+            }
+
+            tail.append(buffer.data(), bytes);
+            if (tail.size() > 2 * tailBytes)
+                tail.erase(0, tail.size() - tailBytes);
+        }
+    }
+
+    /**
+     * Runs the command, the exit code is 127 if it cannot be started like the shell does. With
+     * outputTailBytes the output is read through a pipe and its end is kept in the result.
+     */
+    Result run(const Command &command, bool forwardOutput, unsigned int timeoutSeconds = 0,
+               size_t outputTailBytes = 0) {
+        if (command.empty())
+            return Result();
+
+        int pipeDescriptors[2] = {-1, -1};
+        if (outputTailBytes > 0 && pipe2(pipeDescriptors, O_CLOEXEC) != 0)
+            outputTailBytes = 0;
+
+        pid_t pid = spawn(command, forwardOutput, timeoutSeconds > 0, pipeDescriptors[1]);
+        if (pipeDescriptors[1] >= 0)
+            close(pipeDescriptors[1]);
+        if (pid < 0) {
+            if (pipeDescriptors[0] >= 0)
+                close(pipeDescriptors[0]);
+            Result result;
+            result.exitCode = cannotExecute;
+            return result;
+        }
+
+        if (outputTailBytes == 0)
+            return wait(pid, timeoutSeconds);
+
+        std::atomic<bool> finished{false};
+        std::string tail;
+        std::thread reader(captureOutput, pipeDescriptors[0], forwardOutput, outputTailBytes, std::cref(finished),
+                           std::ref(tail));
+
+        Result result = wait(pid, timeoutSeconds);
+        finished = true;
+        reader.join();
+        close(pipeDescriptors[0]);
+
+        result.outputTail = (tail.size() > outputTailBytes) ? tail.substr(tail.size() - outputTailBytes) : tail;
+
+        return result;
+    }
+}
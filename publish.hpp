@@ -0,0 +1,94 @@
+#pragma once //"publish.hpp"
+
+#include <config.h>
+#include <string>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include "cacheLayout.hpp"
+
+#ifndef RENAME_NOREPLACE
+#define RENAME_NOREPLACE (1 << 0)
+#endif
+
+/**
+ * Cache entries are built under a temporary name inside the cache destination and become visible with
+ * a single rename, so a reader either sees a complete entry or none.
+ */
+namespace publish {
+    /**
+     * Temporary path for building the entry, on the same filesystem as the cache destination.
+     * The sequence keeps the paths of concurrent stores of one process (daemon, batch mode) apart.
+     */
+    std::string temporaryPath(const std::string &cacheDestination, const std::string &entryName) {
+        static std::atomic<unsigned int> sequence(0);
+        stdfs::path temporaryDirectory(cacheLayout::temporaryDirectory(cacheDestination));
+        stdfs::create_directories(temporaryDirectory);
+
+        return (temporaryDirectory / (entryName + "." + std::to_string(getpid()) + "." +
+                                      std::to_string(sequence++))).u8string();
+    }
+
+    void syncPath(const std::string &path, int flags) {
+        int fileDescriptor = open(path.c_str(), flags | O_CLOEXEC);
+        if (fileDescriptor < 0)
+            return;
+
+        fsync(fileDescriptor);
+        close(fileDescriptor);
+    }
+
+    void syncDirectory(const std::string &directory) {
+        syncPath(directory, O_RDONLY | O_DIRECTORY);
+    }
+
+    /**
+     * Flushes every file and directory below path to disk before it is published.
+     */
+    void syncTree(const std::string &path) {
+        if (!stdfs::is_directory(path)) {
+            syncPath(path, O_RDONLY);
+
+            return;
+        }
+
+        for (auto &directoryEntry: stdfs::recursive_directory_iterator(path)) {
+            if (directoryEntry.is_symlink())
+                continue;
+
+            syncPath(directoryEntry.path().u8string(), directoryEntry.is_directory() ? O_RDONLY | O_DIRECTORY
+                                                                                       : O_RDONLY);
+        }
+        syncDirectory(path);
+    }
+
+    /**
+     * Moves the temporary entry to its final name without replacing an entry which was published in the
+     * meantime. Returns false if the target already existed, the temporary entry is left untouched then.
+     */
+    bool publish(const std::string &temporary, const std::string &target) {
+#ifdef SYS_renameat2
+        if (syscall(SYS_renameat2, AT_FDCWD, temporary.c_str(), AT_FDCWD, target.c_str(), RENAME_NOREPLACE) == 0)
+            return true;
+        if (errno == EEXIST)
+            return false;
+        if (errno != ENOSYS && errno != EINVAL)
+            throw stdfs::filesystem_error("Cannot publish cache entry", temporary, target,
+                                          std::error_code(errno, std::generic_category()));
+#endif
+        // without RENAME_NOREPLACE a directory cannot replace a non empty one and a replaced archive is complete
+        if (stdfs::is_regular_file(temporary) && stdfs::exists(target))
+            return false;
+
+        if (rename(temporary.c_str(), target.c_str()) == 0)
+            return true;
+        if (errno == EEXIST || errno == ENOTEMPTY)
+            return false;
+
+        throw stdfs::filesystem_error("Cannot publish cache entry", temporary, target,
+                                      std::error_code(errno, std::generic_category()));
+    }
+}
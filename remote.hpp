@@ -0,0 +1,747 @@
+#pragma once //"remote.hpp"
+
+#include <config.h>
+#include <algorithm>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <future>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <openssl/hmac.h>
+#include <openssl/sha.h>
+#if HAS_CURL
+#include <curl/curl.h>
+#endif
+#include "Exceptions/RemoteStorageException.h"
+#include "cacheIndex.hpp"
+#include "cacheLayout.hpp"
+#include "cacheStore.hpp"
+#include "chunkStore.hpp"
+#include "compress.hpp"
+#include "integrity.hpp"
+#include "publish.hpp"
+#include "workerPool.hpp"
+#include "trace.hpp"
+
+/**
+ * Archive entries in an HTTP object store with the S3 protocol, so machines share a cache without a shared
+ * filesystem. Objects are named like the entries below the url, e.g. http://store:9000/bucket/prefix/<key>.tar.gz,
+ * and the chunks of chunked entries as chunks/<sha256>. Requests are signed with AWS signature version 4 if
+ * AWS_ACCESS_KEY_ID and AWS_SECRET_ACCESS_KEY are set (AWS_SESSION_TOKEN, AWS_REGION, default us-east-1).
+ *
+ * Downloads are extracted while they arrive and copied into the cache destination on the way, uploads of
+ * large archives are split into parts which are sent in parallel. Chunked entries move only the chunks the
+ * other side is missing.
+ */
+namespace remote {
+    const size_t defaultPartSize = 64 * 1024 * 1024;
+    // S3 rejects smaller parts, except the last one
+    const size_t minimumPartSize = 5 * 1024 * 1024;
+    const unsigned int defaultJobs = 4;
+    const std::string chunkPrefix = "chunks/";
+
+    struct Options {
+        std::string url;
+        size_t partSize = defaultPartSize;
+        unsigned int jobs = defaultJobs;
+
+        bool enabled() const {
+            return !url.empty();
+        }
+    };
+
+    std::string hex(const unsigned char *data, size_t length) {
+        static const char digits[] = "0123456789abcdef";
+        std::string text;
+
+        for (size_t i = 0; i < length; i++) {
+            text += digits[data[i] >> 4];
+            text += digits[data[i] & 0x0f];
+        }
+
+        return text;
+    }
+
+    std::string sha256Hex(const std::string &data) {
+        unsigned char digest[SHA256_DIGEST_LENGTH];
+        SHA256((const unsigned char *) data.data(), data.size(), digest);
+
+        return hex(digest, sizeof(digest));
+    }
+
+    std::string hmacSha256(const std::string &key, const std::string &data) {
+        unsigned char digest[EVP_MAX_MD_SIZE];
+        unsigned int length = 0;
+        HMAC(EVP_sha256(), key.data(), (int) key.size(), (const unsigned char *) data.data(), data.size(),
+             digest, &length);
+
+        return std::string((const char *) digest, length);
+    }
+
+    // RFC 3986 encoding as the signature expects it, slashes of paths stay
+    std::string uriEncode(const std::string &value, bool keepSlash) {
+        static const char digits[] = "0123456789ABCDEF";
+        std::string encoded;
+
+        for (unsigned char character: value) {
+            if (isalnum(character) || character == '-' || character == '_' || character == '.' || character == '~' ||
+                (keepSlash && character == '/')) {
+                encoded += (char) character;
+            } else {
+                encoded += '%';
+                encoded += digits[character >> 4];
+                encoded += digits[character & 0x0f];
+            }
+        }
+
+        return encoded;
+    }
+
+    // text of the first <name> element, enough for the small documents of the multipart protocol
+    std::string xmlValue(const std::string &document, const std::string &name) {
+        size_t start = document.find("<" + name + ">");
+        if (start == std::string::npos)
+            return "";
+        start += name.size() + 2;
+
+        size_t end = document.find("</" + name + ">", start);
+
+        return end == std::string::npos ? "" : document.substr(start, end - start);
+    }
+
+    bool sendAll(int fileDescriptor, const char *data, size_t length) {
+        while (length > 0) {
+            // the reading side may close early, this must not raise SIGPIPE
+            ssize_t written = send(fileDescriptor, data, length, MSG_NOSIGNAL);
+            if (written < 0 && errno == EINTR)
+                continue;
+            if (written <= 0)
+                return false;
+
+            data += written;
+            length -= (size_t) written;
+        }
+
+        return true;
+    }
+
+    struct Credentials {
+        std::string accessKey;
+        std::string secretKey;
+        std::string sessionToken;
+        std::string region = "us-east-1";
+
+        static Credentials fromEnvironment() {
+            Credentials credentials;
+            auto variable = [](const char *name) {
+                const char *value = getenv(name);
+                return value != nullptr ? std::string(value) : std::string();
+            };
+
+            credentials.accessKey = variable("AWS_ACCESS_KEY_ID");
+            credentials.secretKey = variable("AWS_SECRET_ACCESS_KEY");
+            credentials.sessionToken = variable("AWS_SESSION_TOKEN");
+            if (!variable("AWS_REGION").empty())
+                credentials.region = variable("AWS_REGION");
+
+            return credentials;
+        }
+
+        bool present() const {
+            return !accessKey.empty() && !secretKey.empty();
+        }
+    };
+
+    struct Response {
+        long status = 0;
+        std::string body;
+        std::string etag;
+        bool outputClosed = false;
+    };
+
+    /**
+     * One request. The body is a string or a range of a file, the response body is kept in memory or sent
+     * to outputFileDescriptor.
+     */
+    struct Request {
+        std::string method = "GET";
+        std::string name;
+        // already encoded and sorted by name, as the signature needs it
+        std::string query;
+        std::string body;
+        int bodyFileDescriptor = -1;
+        off_t bodyOffset = 0;
+        size_t bodyLength = 0;
+        int outputFileDescriptor = -1;
+    };
+
+    class Client {
+    public:
+        explicit Client(const Options &options) : options(options), credentials(Credentials::fromEnvironment()) {
+            std::string url = options.url;
+            while (!url.empty() && url.back() == '/')
+                url.pop_back();
+
+            size_t schemeEnd = url.find("://");
+            size_t pathStart = url.find('/', schemeEnd == std::string::npos ? 0 : schemeEnd + 3);
+            if (schemeEnd == std::string::npos)
+                throw (RemoteStorageException("Invalid remote url " + options.url, ExitCode::remoteStorageFailed));
+
+            origin = url.substr(0, pathStart);
+            host = url.substr(schemeEnd + 3, pathStart == std::string::npos ? std::string::npos
+                                                                              : pathStart - schemeEnd - 3);
+            basePath = pathStart == std::string::npos ? "" : url.substr(pathStart);
+
+#if HAS_CURL
+            static std::once_flag initialized;
+            std::call_once(initialized, [] { curl_global_init(CURL_GLOBAL_DEFAULT); });
+#endif
+        }
+
+        bool exists(const std::string &name) {
+            Request request;
+            request.method = "HEAD";
+            request.name = name;
+
+            Response response = perform(request, true);
+
+            return response.status / 100 == 2;
+        }
+
+        std::string get(const std::string &name) {
+            Request request;
+            request.name = name;
+
+            return perform(request).body;
+        }
+
+        /**
+         * Sends the object to a socket, the caller reads it at the same time. Returns false if the reader
+         * closed its end before the object was complete.
+         */
+        bool download(const std::string &name, int fileDescriptor) {
+            Request request;
+            request.name = name;
+            request.outputFileDescriptor = fileDescriptor;
+
+            return !perform(request).outputClosed;
+        }
+
+        std::string url(const std::string &name) const {
+            return origin + basePath + "/" + name;
+        }
+
+        // requests the client may run at the same time
+        unsigned int jobs() const {
+            return std::max(options.jobs, 1u);
+        }
+
+        /**
+         * Uploads the file, in parts of options.partSize on options.jobs threads if it is larger.
+         */
+        void upload(const std::string &name, const std::string &file) {
+            int fileDescriptor = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+            struct stat status{};
+            if (fileDescriptor < 0 || fstat(fileDescriptor, &status) != 0) {
+                if (fileDescriptor >= 0)
+                    close(fileDescriptor);
+                throw (RemoteStorageException("Cannot read " + file, ExitCode::remoteStorageFailed));
+            }
+
+            try {
+                const size_t size = (size_t) status.st_size;
+                const size_t partSize = std::max(options.partSize, minimumPartSize);
+
+                if (size <= partSize) {
+                    Request request;
+                    request.method = "PUT";
+                    request.name = name;
+                    request.bodyFileDescriptor = fileDescriptor;
+                    request.bodyLength = size;
+                    perform(request);
+                } else {
+                    uploadParts(name, fileDescriptor, size, partSize);
+                }
+            } catch (...) {
+                close(fileDescriptor);
+                throw;
+            }
+
+            close(fileDescriptor);
+        }
+
+    private:
+        Options options;
+        Credentials credentials;
+        std::string origin;
+        std::string host;
+        std::string basePath;
+
+        void uploadParts(const std::string &name, int fileDescriptor, size_t size, size_t partSize) {
+            Request start;
+            start.method = "POST";
+            start.name = name;
+            start.query = "uploads=";
+            const std::string uploadId = xmlValue(perform(start).body, "UploadId");
+            if (uploadId.empty())
+                throw (RemoteStorageException("No upload id for " + name, ExitCode::remoteStorageFailed));
+
+            const std::string uploadQuery = "uploadId=" + uriEncode(uploadId, false);
+            const size_t partCount = (size + partSize - 1) / partSize;
+            std::vector<std::future<std::string>> etags;
+
+            try {
+                WorkerPool pool(std::min((size_t) std::max(options.jobs, 1u), partCount));
+
+                for (size_t part = 0; part < partCount; part++) {
+                    etags.push_back(pool.submit([this, &name, &uploadQuery, fileDescriptor, size, partSize, part] {
+                        Request request;
+                        request.method = "PUT";
+                        request.name = name;
+                        request.query = "partNumber=" + std::to_string(part + 1) + "&" + uploadQuery;
+                        request.bodyFileDescriptor = fileDescriptor;
+                        request.bodyOffset = (off_t) (part * partSize);
+                        request.bodyLength = std::min(partSize, size - part * partSize);
+
+                        trace("Upload part " + std::to_string(part + 1) + " of " + name);
+                        return perform(request).etag;
+                    }));
+                }
+
+                std::string document = "<CompleteMultipartUpload>";
+                for (size_t part = 0; part < partCount; part++) {
+                    document += "<Part><PartNumber>" + std::to_string(part + 1) + "</PartNumber><ETag>" +
+                                etags[part].get() + "</ETag></Part>";
+                }
+                document += "</CompleteMultipartUpload>";
+
+                Request complete;
+                complete.method = "POST";
+                complete.name = name;
+                complete.query = uploadQuery;
+                complete.body = document;
+
+                // the store answers 200 and reports a failure in the body
+                Response response = perform(complete);
+                if (!xmlValue(response.body, "Code").empty())
+                    throw (RemoteStorageException("Completing upload of " + name + " failed: " +
+                                                  xmlValue(response.body, "Code"), ExitCode::remoteStorageFailed));
+            } catch (...) {
+                // the parts still running finished with the pool
+                Request abort;
+                abort.method = "DELETE";
+                abort.name = name;
+                abort.query = uploadQuery;
+                try {
+                    perform(abort, true);
+                } catch (...) {
+                }
+                throw;
+            }
+        }
+
+        // AWS signature version 4 with an unsigned payload, bodies are streamed
+        std::vector<std::string> signatureHeaders(const Request &request, const std::string &path) {
+            char date[32];
+            time_t now = time(nullptr);
+            struct tm utc{};
+            gmtime_r(&now, &utc);
+            strftime(date, sizeof(date), "%Y%m%dT%H%M%SZ", &utc);
+            const std::string amzDate = date;
+            const std::string day = amzDate.substr(0, 8);
+            const std::string payloadHash = "UNSIGNED-PAYLOAD";
+            const std::string scope = day + "/" + credentials.region + "/s3/aws4_request";
+
+            std::string canonicalHeaders = "host:" + host + "\n" +
+                                           "x-amz-content-sha256:" + payloadHash + "\n" +
+                                           "x-amz-date:" + amzDate + "\n";
+            std::string signedHeaders = "host;x-amz-content-sha256;x-amz-date";
+            if (!credentials.sessionToken.empty()) {
+                canonicalHeaders += "x-amz-security-token:" + credentials.sessionToken + "\n";
+                signedHeaders += ";x-amz-security-token";
+            }
+
+            const std::string canonicalRequest = request.method + "\n" + path + "\n" + request.query + "\n" +
+                                                 canonicalHeaders + "\n" + signedHeaders + "\n" + payloadHash;
+            const std::string stringToSign = "AWS4-HMAC-SHA256\n" + amzDate + "\n" + scope + "\n" +
+                                             sha256Hex(canonicalRequest);
+
+            std::string key = hmacSha256("AWS4" + credentials.secretKey, day);
+            key = hmacSha256(key, credentials.region);
+            key = hmacSha256(key, "s3");
+            key = hmacSha256(key, "aws4_request");
+            const std::string signature = hmacSha256(key, stringToSign);
+
+            std::vector<std::string> headers = {
+                    "x-amz-content-sha256: " + payloadHash,
+                    "x-amz-date: " + amzDate,
+                    "Authorization: AWS4-HMAC-SHA256 Credential=" + credentials.accessKey + "/" + scope +
+                    ", SignedHeaders=" + signedHeaders +
+                    ", Signature=" + hex((const unsigned char *) signature.data(), signature.size())
+            };
+            if (!credentials.sessionToken.empty())
+                headers.push_back("x-amz-security-token: " + credentials.sessionToken);
+
+            return headers;
+        }
+
+#if HAS_CURL
+        struct Transfer {
+            const Request &request;
+            Response &response;
+            size_t bodySent = 0;
+        };
+
+        static size_t readBody(char *buffer, size_t size, size_t count, void *userData) {
+            auto *transfer = static_cast<Transfer *>(userData);
+            const Request &request = transfer->request;
+            size_t length = std::min(size * count, request.bodyLength - transfer->bodySent);
+
+            if (request.bodyFileDescriptor < 0) {
+                memcpy(buffer, request.body.data() + transfer->bodySent, length);
+                transfer->bodySent += length;
+
+                return length;
+            }
+
+            ssize_t result = pread(request.bodyFileDescriptor, buffer, length,
+                                   request.bodyOffset + (off_t) transfer->bodySent);
+            if (result < 0)
+                return CURL_READFUNC_ABORT;
+            transfer->bodySent += (size_t) result;
+
+            return (size_t) result;
+        }
+
+        static size_t writeBody(char *data, size_t size, size_t count, void *userData) {
+            auto *transfer = static_cast<Transfer *>(userData);
+            size_t length = size * count;
+
+            // error documents go to the response, not into the extraction
+            if (transfer->request.outputFileDescriptor >= 0 && transfer->response.status / 100 == 2) {
+                if (!sendAll(transfer->request.outputFileDescriptor, data, length)) {
+                    transfer->response.outputClosed = true;
+                    return 0;
+                }
+                return length;
+            }
+
+            transfer->response.body.append(data, length);
+
+            return length;
+        }
+
+        static size_t readHeader(char *data, size_t size, size_t count, void *userData) {
+            auto *transfer = static_cast<Transfer *>(userData);
+            std::string line(data, size * count);
+
+            if (line.compare(0, 5, "HTTP/") == 0) {
+                size_t space = line.find(' ');
+                transfer->response.status = space == std::string::npos ? 0 : std::atol(line.c_str() + space + 1);
+            } else if (line.size() > 5 && strncasecmp(line.c_str(), "etag:", 5) == 0) {
+                std::string value = line.substr(5);
+                value.erase(0, value.find_first_not_of(" \t"));
+                value.erase(value.find_last_not_of(" \t\r\n") + 1);
+                transfer->response.etag = value;
+            }
+
+            return size * count;
+        }
+#endif
+
+        /**
+         * Runs the request. Failed transfers and status codes other than 2xx throw, except 404 if missingAllowed.
+         */
+        Response perform(Request request, bool missingAllowed = false) {
+            Response response;
+            const std::string path = uriEncode(basePath + "/" + request.name, true);
+            const std::string url = origin + path + (request.query.empty() ? "" : "?" + request.query);
+
+#if HAS_CURL
+            if (request.bodyFileDescriptor < 0)
+                request.bodyLength = request.body.size();
+
+            Transfer transfer{request, response};
+            CURL *curl = curl_easy_init();
+            if (curl == nullptr)
+                throw (RemoteStorageException("Cannot create request", ExitCode::remoteStorageFailed));
+
+            struct curl_slist *headers = nullptr;
+            if (credentials.present()) {
+                for (auto &header: signatureHeaders(request, path))
+                    headers = curl_slist_append(headers, header.c_str());
+            }
+            // no "Expect: 100-continue" round trip before every part
+            headers = curl_slist_append(headers, "Expect:");
+
+            curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+            curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+            curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 0L);
+            curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+            curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, readHeader);
+            curl_easy_setopt(curl, CURLOPT_HEADERDATA, &transfer);
+            curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writeBody);
+            curl_easy_setopt(curl, CURLOPT_WRITEDATA, &transfer);
+
+            if (request.method == "HEAD") {
+                curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+            } else if (request.method == "PUT" || request.method == "POST") {
+                curl_easy_setopt(curl, CURLOPT_UPLOAD, 1L);
+                curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, request.method.c_str());
+                curl_easy_setopt(curl, CURLOPT_READFUNCTION, readBody);
+                curl_easy_setopt(curl, CURLOPT_READDATA, &transfer);
+                curl_easy_setopt(curl, CURLOPT_INFILESIZE_LARGE, (curl_off_t) request.bodyLength);
+            } else if (request.method != "GET") {
+                curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, request.method.c_str());
+            }
+
+            CURLcode result = curl_easy_perform(curl);
+            curl_slist_free_all(headers);
+            curl_easy_cleanup(curl);
+
+            if (response.outputClosed)
+                return response;
+            if (result != CURLE_OK)
+                throw (RemoteStorageException(request.method + " " + url + " failed: " + curl_easy_strerror(result),
+                                              ExitCode::remoteStorageFailed));
+            if (response.status / 100 != 2 && !(missingAllowed && response.status == 404))
+                throw (RemoteStorageException(request.method + " " + url + " failed with status " +
+                                              std::to_string(response.status), ExitCode::remoteStorageFailed));
+#else
+            (void) missingAllowed;
+            throw (RemoteStorageException("Built without curl, cannot reach " + url, ExitCode::remoteStorageFailed));
+#endif
+
+            return response;
+        }
+    };
+
+    // name of the entry of the key in the object store, empty if it has none
+    std::string findEntry(Client &client, const std::string &key) {
+        for (auto &extension: {cacheStore::archiveExtension, cacheStore::chunkedArchiveExtension}) {
+            if (client.exists(key + extension))
+                return key + extension;
+        }
+
+        return "";
+    }
+
+    std::string chunkName(const std::string &hash) {
+        return chunkPrefix + hash;
+    }
+
+    /**
+     * Downloads the manifest and the chunks missing in the cache destination on client.jobs() threads,
+     * publishes the entry and extracts it from there.
+     */
+    void restoreChunked(
+            Client &client,
+            const std::string &name,
+            const std::string &cacheDestination,
+            const bool &fastExtract,
+            const std::string &extractRoot,
+            const compress::TopLevel &topLevel
+    ) {
+        const std::string manifest = client.get(name);
+        const std::vector<chunkStore::Chunk> chunks = chunkStore::parseManifest(manifest, client.url(name));
+        std::vector<std::future<void>> downloads;
+        size_t missing = 0;
+
+        {
+            WorkerPool pool(client.jobs());
+            for (auto &chunk: chunks) {
+                const std::string chunkFile = cacheLayout::chunkFile(cacheDestination, chunk.hash);
+                if (stdfs::exists(chunkFile) && chunkStore::touch(chunkFile))
+                    continue;
+
+                missing++;
+                downloads.push_back(pool.submit([&client, &chunk, &cacheDestination, chunkFile] {
+                    const std::string content = client.get(chunkName(chunk.hash));
+                    if (content.size() != chunk.storedSize)
+                        throw (RemoteStorageException("Incomplete chunk " + chunk.hash,
+                                                      ExitCode::remoteStorageFailed));
+                    chunkStore::publishFile(cacheDestination, chunkFile, content, false);
+                }));
+            }
+        }
+        trace("Downloaded " + std::to_string(missing) + " of " + std::to_string(chunks.size()) + " chunks");
+        for (auto &download: downloads) {
+            try {
+                download.get();
+            } catch (RemoteStorageException &) {
+                throw;
+            } catch (...) {
+                throw (RemoteStorageException("Cannot store chunks in " + cacheDestination,
+                                              ExitCode::remoteStorageFailed));
+            }
+        }
+
+        const std::string entryPath = (stdfs::path(cacheDestination) / name).u8string();
+        std::string temporaryPath;
+        try {
+            temporaryPath = publish::temporaryPath(cacheDestination, name);
+            chunkStore::writeFile(temporaryPath, manifest, false);
+        } catch (...) {
+            throw (RemoteStorageException("Cannot store " + name + " in " + cacheDestination,
+                                          ExitCode::remoteStorageFailed));
+        }
+
+        const cacheIndex::Size size = cacheIndex::measure(temporaryPath);
+        const std::string checksums = integrity::computeChecksums(temporaryPath, 1);
+        trace("Publish " + temporaryPath + " as " + name);
+        if (publish::publish(temporaryPath, entryPath)) {
+            cacheIndex::recordStore(cacheDestination, name, size);
+            integrity::record(cacheDestination, name, checksums);
+        } else {
+            trace("Cache was published by another process");
+            std::error_code errorCode;
+            stdfs::remove(temporaryPath, errorCode);
+        }
+
+        trace("Extract data from " + entryPath);
+        chunkStore::extract(entryPath, fastExtract, extractRoot, topLevel);
+        cacheStore::recordAccess(entryPath);
+    }
+
+    /**
+     * Extracts the remote entry to cacheSource while it is downloaded and copies it into the cache
+     * destination on the way, the copy is published if the download and the extraction succeeded.
+     * Failures of the object store throw RemoteStorageException, failures of the extraction their own.
+     * topLevel renames the directory of the archive, see cacheStore::restoredTopLevel().
+     */
+    void restore(
+            Client &client,
+            const std::string &name,
+            const std::string &cacheDestination,
+            const bool &fastExtract,
+            const std::string &extractRoot,
+            const compress::TopLevel &topLevel
+    ) {
+        if (cacheStore::isChunked(name)) {
+            restoreChunked(client, name, cacheDestination, fastExtract, extractRoot, topLevel);
+            return;
+        }
+
+        std::string temporaryPath;
+        int teeFileDescriptor = -1;
+        try {
+            temporaryPath = publish::temporaryPath(cacheDestination, name);
+            teeFileDescriptor = open(temporaryPath.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+        } catch (...) {
+            trace("Cannot create temporary file in " + cacheDestination + ", restore without copy");
+        }
+
+        // a socket pair instead of a pipe, so the download ends without SIGPIPE if the extraction gives up
+        int sockets[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sockets) != 0) {
+            if (teeFileDescriptor >= 0)
+                close(teeFileDescriptor);
+            throw (RemoteStorageException("Cannot create socket pair", ExitCode::remoteStorageFailed));
+        }
+
+        std::exception_ptr downloadError;
+        std::thread downloader([&client, &name, &downloadError, socket = sockets[1]] {
+            try {
+                client.download(name, socket);
+            } catch (...) {
+                downloadError = std::current_exception();
+            }
+            close(socket);
+        });
+
+        trace("Extract data from " + client.url(name));
+        int extracted = -1;
+        std::exception_ptr extractError;
+        try {
+            extracted = compress::extract_stream(sockets[0], fastExtract, extractRoot, teeFileDescriptor, topLevel);
+        } catch (...) {
+            extractError = std::current_exception();
+        }
+        close(sockets[0]);
+        downloader.join();
+
+        bool copyComplete = extracted == 0 && !downloadError && teeFileDescriptor >= 0;
+        if (teeFileDescriptor >= 0 && close(teeFileDescriptor) != 0)
+            copyComplete = false;
+
+        std::error_code errorCode;
+        if (!copyComplete && !temporaryPath.empty())
+            stdfs::remove(temporaryPath, errorCode);
+
+        // a broken download also breaks the extraction, its cause is reported
+        if (downloadError && (extractError || extracted < 0))
+            std::rethrow_exception(downloadError);
+        if (extractError)
+            std::rethrow_exception(extractError);
+
+        if (!copyComplete) {
+            trace("Copy to " + cacheDestination + " failed");
+            return;
+        }
+
+        // the download was extracted completely, so its checksums are those of the uploaded archive
+        const cacheIndex::Size size = cacheIndex::measure(temporaryPath);
+        const std::string checksums = integrity::computeChecksums(temporaryPath);
+        trace("Publish " + temporaryPath + " as " + name);
+        if (publish::publish(temporaryPath, (stdfs::path(cacheDestination) / name).u8string())) {
+            cacheIndex::recordStore(cacheDestination, name, size);
+            integrity::record(cacheDestination, name, checksums);
+        } else {
+            trace("Cache was published by another process");
+            stdfs::remove(temporaryPath, errorCode);
+        }
+    }
+
+    /**
+     * Uploads the chunks of the manifest the object store is missing on client.jobs() threads.
+     */
+    void uploadChunks(Client &client, const std::string &manifestPath, const std::string &cacheDestination) {
+        std::vector<chunkStore::Chunk> chunks;
+        try {
+            chunks = chunkStore::readManifest(manifestPath);
+        } catch (...) {
+            throw (RemoteStorageException("Cannot read " + manifestPath, ExitCode::remoteStorageFailed));
+        }
+
+        std::vector<std::future<bool>> uploads;
+        {
+            WorkerPool pool(client.jobs());
+            for (auto &chunk: chunks) {
+                uploads.push_back(pool.submit([&client, &chunk, &cacheDestination] {
+                    if (client.exists(chunkName(chunk.hash)))
+                        return false;
+
+                    client.upload(chunkName(chunk.hash), cacheLayout::chunkFile(cacheDestination, chunk.hash));
+                    return true;
+                }));
+            }
+        }
+
+        size_t uploaded = 0;
+        for (auto &upload: uploads)
+            uploaded += upload.get() ? 1 : 0;
+        trace("Uploaded " + std::to_string(uploaded) + " of " + std::to_string(chunks.size()) + " chunks");
+    }
+
+    /**
+     * Uploads the archive entry. The manifest of a chunked entry is uploaded after its chunks, so it is
+     * complete once it is visible.
+     */
+    void upload(Client &client, const std::string &entryPath, const std::string &cacheDestination) {
+        const std::string name = stdfs::path(entryPath).filename().u8string();
+
+        if (cacheStore::isChunked(entryPath))
+            uploadChunks(client, entryPath, cacheDestination);
+
+        trace("Upload " + entryPath + " to " + client.url(name));
+        client.upload(name, entryPath);
+    }
+}
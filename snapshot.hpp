@@ -0,0 +1,143 @@
+#pragma once //"snapshot.hpp"
+
+#include <config.h>
+#include <string>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#include "cacheLayout.hpp"
+#include "trace.hpp"
+
+/**
+ * Cheap copies of a directory tree, so the tree can be stored while the build already changes the original.
+ * Files are reflinked, which only works on the same filesystem. Without reflinks files are hardlinked if the
+ * caller allows it: a hardlinked file still changes with the original if it is rewritten in place, only tools
+ * which replace files (write and rename) do not affect the snapshot.
+ */
+namespace snapshot {
+    const std::string snapshotInfix = ".snapshot.";
+
+    struct Statistics {
+        size_t cloned = 0;
+        size_t linked = 0;
+        size_t copied = 0;
+    };
+
+    // reflink of the whole file, the copy shares the extents until one side writes
+    bool cloneFile(const stdfs::path &source, const stdfs::path &destination, const struct stat &status) {
+#ifdef FICLONE
+        int sourceDescriptor = open(source.c_str(), O_RDONLY | O_CLOEXEC);
+        if (sourceDescriptor < 0)
+            return false;
+
+        int destinationDescriptor = open(destination.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+                                         status.st_mode & 07777);
+        if (destinationDescriptor < 0) {
+            close(sourceDescriptor);
+            return false;
+        }
+
+        bool cloned = ioctl(destinationDescriptor, FICLONE, sourceDescriptor) == 0;
+        if (cloned) {
+            const struct timespec times[2] = {status.st_atim, status.st_mtim};
+            futimens(destinationDescriptor, times);
+        }
+
+        close(sourceDescriptor);
+        close(destinationDescriptor);
+        if (!cloned)
+            unlink(destination.c_str());
+
+        return cloned;
+#else
+        return false;
+#endif
+    }
+
+    /**
+     * Copies the tree source to destination, which must not exist yet. Symlinks are copied as symlinks. Throws
+     * if the filesystem has no reflinks and linkFiles is false, a full copy would cost as much as the store.
+     * Files which cannot be reflinked after others were are copied.
+     */
+    Statistics create(const stdfs::path &source, const stdfs::path &destination, bool linkFiles) {
+        Statistics statistics;
+        bool tryClone = true;
+        bool tryLink = linkFiles;
+
+        stdfs::create_directories(destination.parent_path());
+        stdfs::create_directory(destination, source);
+
+        for (stdfs::recursive_directory_iterator iterator(source), end; iterator != end; ++iterator) {
+            const stdfs::path target = destination / iterator->path().lexically_relative(source);
+            struct stat status{};
+
+            if (lstat(iterator->path().c_str(), &status) != 0)
+                throw stdfs::filesystem_error("Cannot stat", iterator->path(),
+                                              std::error_code(errno, std::generic_category()));
+
+            if (S_ISDIR(status.st_mode)) {
+                stdfs::create_directory(target, iterator->path());
+            } else if (S_ISLNK(status.st_mode)) {
+                stdfs::copy_symlink(iterator->path(), target);
+            } else if (S_ISREG(status.st_mode)) {
+                if (tryClone && cloneFile(iterator->path(), target, status)) {
+                    statistics.cloned++;
+                    continue;
+                }
+                // the filesystem has no reflinks, do not try it for every file
+                tryClone = false;
+                if (statistics.cloned == 0 && !linkFiles)
+                    throw stdfs::filesystem_error("No reflinks", iterator->path(),
+                                                  std::make_error_code(std::errc::operation_not_supported));
+
+                if (tryLink && link(iterator->path().c_str(), target.c_str()) == 0) {
+                    statistics.linked++;
+                    continue;
+                }
+                tryLink = false;
+
+                stdfs::copy_file(iterator->path(), target);
+                statistics.copied++;
+            }
+        }
+
+        return statistics;
+    }
+
+    /**
+     * Snapshots next to their cache source are outside the cache destination. A symlink to them in its
+     * snapshot directory lets the garbage collection remove them if the store is killed.
+     */
+    void registerSnapshot(const std::string &cacheDestination, const std::string &name,
+                          const stdfs::path &snapshotRoot) {
+        const stdfs::path directory = cacheLayout::snapshotDirectory(cacheDestination);
+
+        stdfs::create_directories(directory);
+        stdfs::create_symlink(snapshotRoot, directory / name);
+    }
+
+    // removes the snapshot and its symlink, if it has one
+    void removeSnapshot(const std::string &cacheDestination, const std::string &name,
+                        const stdfs::path &snapshotRoot) {
+        std::error_code errorCode;
+
+        stdfs::remove_all(snapshotRoot, errorCode);
+        stdfs::remove(stdfs::path(cacheLayout::snapshotDirectory(cacheDestination)) / name, errorCode);
+    }
+
+    /**
+     * Removes a registered snapshot and its symlink, see registerSnapshot(). Only targets named like a
+     * snapshot are removed. Returns false if nothing was removed.
+     */
+    bool removeRegistered(const stdfs::path &link) {
+        std::error_code errorCode;
+        const stdfs::path target = stdfs::read_symlink(link, errorCode);
+        if (!errorCode && target.filename().u8string().find(snapshotInfix) != std::string::npos)
+            stdfs::remove_all(target, errorCode);
+
+        return stdfs::remove(link, errorCode);
+    }
+}
@@ -0,0 +1,95 @@
+#!/bin/bash
+# Stores an archive entry through test/s3stub.py and restores it on another cache destination: the round
+# trip, the multipart upload and a download which breaks off.
+#
+#   test/remote.sh <cadir executable>
+set -u
+
+cadir="$(cd "$(dirname "$1")" && pwd)/$(basename "$1")"
+stub="$(cd "$(dirname "$0")" && pwd)/s3stub.py"
+work=$(mktemp -d)
+stubPid=
+trap '[ -n "$stubPid" ] && kill $stubPid; rm -rf "$work"' EXIT
+
+fail() {
+    echo "FAIL: $*"
+    [ -f "$work/out" ] && cat "$work/out"
+    exit 1
+}
+
+startStub() {
+    "${PYTHON:-python3}" "$stub" "$work/store" > "$work/s3.log" &
+    stubPid=$!
+    for _ in $(seq 50); do
+        port=$(sed -n 's/^port //p' "$work/s3.log")
+        [ -n "$port" ] && return
+        sleep 0.1
+    done
+    fail "object store stand-in did not start"
+}
+
+stopStub() {
+    kill $stubPid
+    wait $stubPid 2>/dev/null
+    stubPid=
+}
+
+# waits for the background upload of an entry
+waitForUpload() {
+    for _ in $(seq 100); do
+        grep -q "^POST complete" "$work/s3.log" && return
+        sleep 0.1
+    done
+    fail "entry was not uploaded"
+}
+
+# runs cadir in the project with the cache destination $1
+run() {
+    (cd "$work/project" && "$cadir" --cache-source=vendor --identity-file=lock --cache-destination="$work/$1" \
+        --remote-url="http://127.0.0.1:$port/bucket/prefix" --remote-part-size=5M \
+        --command-working-directory="$work/project" --setup="sh setup.sh" -a -v > "$work/out" 2>&1)
+}
+
+builds() {
+    wc -l < "$work/builds.log"
+}
+
+mkdir -p "$work/project" "$work/store"
+echo "lock $RANDOM" > "$work/project/lock"
+cat > "$work/project/setup.sh" <<'SETUP'
+mkdir -p vendor/a/b vendor/c
+for i in $(seq 1 50); do echo "file $i" > vendor/a/b/f$i.js; done
+head -c 12000000 /dev/urandom > vendor/c/big.bin
+ln -s a/b/f2.js vendor/link.js
+echo built >> ../builds.log
+SETUP
+
+startStub
+
+# the build uploads the entry in the background, 12M in parts of 5M
+run cache1 || fail "build exited with $?"
+cp -a "$work/project/vendor" "$work/reference"
+waitForUpload
+[ "$(grep -c "^PUT part" "$work/s3.log")" -eq 3 ] || fail "expected an upload in 3 parts"
+echo "OK multipart upload"
+
+# another cache destination restores the entry from the object store without building
+rm -rf "$work/project/vendor"
+run cache2 || fail "restore exited with $?"
+[ "$(builds)" -eq 1 ] || fail "restore built again"
+diff -r "$work/reference" "$work/project/vendor" > /dev/null || fail "restored tree differs"
+ls "$work/cache2" | grep -q '\.tar\.gz$' || fail "downloaded entry was not kept"
+"$cadir" verify --cache-destination="$work/cache2" --all > /dev/null || fail "downloaded entry is corrupt"
+echo "OK round trip"
+
+# a download which breaks off builds again and leaves no entry or temporary file behind
+stopStub
+BREAK=1 startStub
+rm -rf "$work/project/vendor"
+run cache3 || fail "build after broken download exited with $?"
+grep -q "^GET " "$work/s3.log" || fail "entry was not downloaded"
+[ "$(builds)" -eq 2 ] || fail "broken download was not built again"
+[ -z "$(ls -A "$work/cache3/.cadir/tmp" 2>/dev/null)" ] || fail "temporary files left behind"
+[ -f "$work/project/vendor/c/big.bin" ] || fail "rebuilt tree is incomplete"
+waitForUpload
+echo "OK broken download"
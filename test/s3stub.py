@@ -0,0 +1,125 @@
+# Minimal stand-in for an S3 compatible object store, for test/remote.sh.
+#
+#   python3 s3stub.py ROOT
+#
+# Serves the objects below ROOT on a free port of 127.0.0.1 and prints "port <port>", then a line per
+# request. Supports HEAD, GET, PUT, DELETE and multipart uploads, signatures are not checked.
+# BREAK=1 sends only the first half of every GET slowly and then closes the connection.
+import hashlib
+import http.server
+import os
+import re
+import sys
+import threading
+import time
+import urllib.parse
+import uuid
+
+root = sys.argv[1]
+uploads = {}
+uploadsLock = threading.Lock()
+
+
+def log(line):
+    print(line, flush=True)
+
+
+class Handler(http.server.BaseHTTPRequestHandler):
+    protocol_version = 'HTTP/1.1'
+
+    def log_message(self, *arguments):
+        pass
+
+    def target(self):
+        url = urllib.parse.urlsplit(self.path)
+        path = os.path.join(root, urllib.parse.unquote(url.path).lstrip('/'))
+        return path, urllib.parse.parse_qs(url.query, keep_blank_values=True)
+
+    def reply(self, code, body=b'', headers=None):
+        self.send_response(code)
+        for name, value in (headers or {}).items():
+            self.send_header(name, value)
+        self.send_header('Content-Length', str(len(body)))
+        self.end_headers()
+        if self.command != 'HEAD':
+            self.wfile.write(body)
+
+    def body(self):
+        return self.rfile.read(int(self.headers.get('Content-Length', 0)))
+
+    def do_HEAD(self):
+        path, _ = self.target()
+        log('HEAD ' + self.path)
+        if not os.path.isfile(path):
+            return self.reply(404)
+        self.send_response(200)
+        self.send_header('Content-Length', str(os.path.getsize(path)))
+        self.end_headers()
+
+    def do_GET(self):
+        path, _ = self.target()
+        log('GET ' + self.path)
+        if not os.path.isfile(path):
+            return self.reply(404, b'<Error><Code>NoSuchKey</Code></Error>')
+        with open(path, 'rb') as file:
+            data = file.read()
+        if not os.environ.get('BREAK'):
+            return self.reply(200, data)
+
+        self.send_response(200)
+        self.send_header('Content-Length', str(len(data)))
+        self.end_headers()
+        for offset in range(0, len(data) // 2, 65536):
+            self.wfile.write(data[offset:min(offset + 65536, len(data) // 2)])
+            time.sleep(0.01)
+        self.close_connection = True
+
+    def do_PUT(self):
+        path, query = self.target()
+        data = self.body()
+        if 'uploadId' in query:
+            log('PUT part %s' % query['partNumber'][0])
+            with uploadsLock:
+                uploads[query['uploadId'][0]][int(query['partNumber'][0])] = data
+            return self.reply(200, headers={'ETag': '"%s"' % hashlib.md5(data).hexdigest()})
+
+        log('PUT ' + self.path)
+        os.makedirs(os.path.dirname(path), exist_ok=True)
+        with open(path, 'wb') as file:
+            file.write(data)
+        self.reply(200, headers={'ETag': '"%s"' % hashlib.md5(data).hexdigest()})
+
+    def do_POST(self):
+        path, query = self.target()
+        data = self.body()
+        if 'uploads' in query:
+            log('POST start ' + self.path)
+            # characters which must be escaped in the query of the parts
+            uploadId = uuid.uuid4().hex + '+/='
+            with uploadsLock:
+                uploads[uploadId] = {}
+            body = '<InitiateMultipartUploadResult><UploadId>%s</UploadId></InitiateMultipartUploadResult>' % uploadId
+            return self.reply(200, body.encode())
+
+        log('POST complete ' + self.path)
+        with uploadsLock:
+            parts = uploads.pop(query['uploadId'][0], None)
+        numbers = [int(number) for number in re.findall(r'<PartNumber>(\d+)</PartNumber>', data.decode())]
+        if parts is None or numbers != sorted(parts):
+            return self.reply(400, b'<Error><Code>InvalidPart</Code></Error>')
+        os.makedirs(os.path.dirname(path), exist_ok=True)
+        with open(path, 'wb') as file:
+            file.write(b''.join(parts[number] for number in numbers))
+        self.reply(200, b'<CompleteMultipartUploadResult/>')
+
+    def do_DELETE(self):
+        path, query = self.target()
+        log('DELETE ' + self.path)
+        with uploadsLock:
+            uploads.pop(query.get('uploadId', [''])[0], None)
+        self.reply(204)
+
+
+server = http.server.ThreadingHTTPServer(('127.0.0.1', 0), Handler)
+log('port %d' % server.server_address[1])
+server.serve_forever()
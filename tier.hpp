@@ -0,0 +1,292 @@
+#pragma once //"tier.hpp"
+
+#include <config.h>
+#include <string>
+#include <vector>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "Exceptions/CopyFromCacheException.h"
+#include "Exceptions/CopyToCacheFailedException.h"
+#include "cacheIndex.hpp"
+#include "cacheLayout.hpp"
+#include "cacheStore.hpp"
+#include "chunkStore.hpp"
+#include "compress.hpp"
+#include "integrity.hpp"
+#include "publish.hpp"
+#include "trace.hpp"
+
+/**
+ * A local cache destination on a fast disk in front of the shared one. Entries found only in the shared
+ * tier are copied to the local tier while they are restored, entries are stored in the local tier first
+ * and copied to the shared tier afterwards. Both copies are published like any store, with a rename.
+ */
+namespace tier {
+    const size_t copyBlockSize = 1024 * 1024;
+
+    bool writeAll(int fileDescriptor, const char *data, size_t length) {
+        while (length > 0) {
+            ssize_t written = write(fileDescriptor, data, length);
+            if (written < 0 && errno == EINTR)
+                continue;
+            if (written <= 0)
+                return false;
+
+            data += written;
+            length -= (size_t) written;
+        }
+
+        return true;
+    }
+
+    /**
+     * Copies the file to target and, as long as it works, to copy. Only the target is required.
+     */
+    void copyFileTwice(const stdfs::path &source, const stdfs::path &target, const stdfs::path &copy,
+                       bool &copyComplete, std::vector<char> &block) {
+        int sourceDescriptor = open(source.c_str(), O_RDONLY | O_CLOEXEC);
+        if (sourceDescriptor < 0)
+            throw stdfs::filesystem_error("Cannot open", source, std::error_code(errno, std::generic_category()));
+
+        struct stat status{};
+        fstat(sourceDescriptor, &status);
+        posix_fadvise(sourceDescriptor, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+        int targetDescriptor = open(target.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                                    status.st_mode & 07777);
+        if (targetDescriptor < 0) {
+            int error = errno;
+            close(sourceDescriptor);
+            throw stdfs::filesystem_error("Cannot create", target, std::error_code(error, std::generic_category()));
+        }
+
+        int copyDescriptor = copyComplete ? open(copy.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                                                 status.st_mode & 07777) : -1;
+        copyComplete = copyDescriptor >= 0;
+
+        bool targetComplete = true;
+        ssize_t length;
+        while ((length = read(sourceDescriptor, block.data(), block.size())) != 0) {
+            if (length < 0 && errno == EINTR)
+                continue;
+            if (length < 0 || !writeAll(targetDescriptor, block.data(), (size_t) length)) {
+                targetComplete = false;
+                break;
+            }
+            if (copyComplete && !writeAll(copyDescriptor, block.data(), (size_t) length))
+                copyComplete = false;
+        }
+
+        const struct timespec times[2] = {status.st_atim, status.st_mtim};
+        futimens(targetDescriptor, times);
+        if (copyDescriptor >= 0) {
+            futimens(copyDescriptor, times);
+            close(copyDescriptor);
+        }
+        close(sourceDescriptor);
+        if (close(targetDescriptor) != 0 || !targetComplete)
+            throw stdfs::filesystem_error("Cannot copy", source, target,
+                                          std::error_code(EIO, std::generic_category()));
+    }
+
+    /**
+     * Copies the tree source to target and to copy with one read of every file. The copy is given up at the
+     * first failure, e.g. a full local disk, the target is required. An empty copy copies to the target only.
+     */
+    void copyTreeTwice(const stdfs::path &source, const stdfs::path &target, const stdfs::path &copy,
+                       bool &copyComplete) {
+        std::vector<char> block(copyBlockSize);
+        std::error_code errorCode;
+
+        stdfs::create_directories(target);
+        copyComplete = !copy.empty();
+        if (copyComplete) {
+            stdfs::create_directories(copy, errorCode);
+            copyComplete = !errorCode;
+        }
+
+        for (stdfs::recursive_directory_iterator iterator(source), end; iterator != end; ++iterator) {
+            const stdfs::path relative = iterator->path().lexically_relative(source);
+            const stdfs::path targetPath = target / relative;
+            const stdfs::path copyPath = copy / relative;
+
+            if (iterator->is_symlink()) {
+                stdfs::copy_symlink(iterator->path(), targetPath);
+                if (copyComplete) {
+                    stdfs::copy_symlink(iterator->path(), copyPath, errorCode);
+                    copyComplete = !errorCode;
+                }
+            } else if (iterator->is_directory()) {
+                stdfs::create_directory(targetPath, iterator->path());
+                if (copyComplete) {
+                    stdfs::create_directory(copyPath, iterator->path(), errorCode);
+                    copyComplete = !errorCode;
+                }
+            } else if (iterator->is_regular_file()) {
+                copyFileTwice(iterator->path(), targetPath, copyPath, copyComplete, block);
+            }
+        }
+    }
+
+    /**
+     * Publishes a complete copy in the cache destination and records it in its index. The copy keeps the
+     * checksums of the entry it was copied from.
+     */
+    bool publishCopy(const std::string &temporaryPath, const std::string &fromDestination,
+                     const std::string &cacheDestination, const std::string &entryName) {
+        const cacheIndex::Size size = cacheIndex::measure(temporaryPath);
+        const std::string checksums = integrity::copyChecksums(fromDestination, entryName, temporaryPath);
+        std::error_code errorCode;
+
+        if (!publish::publish(temporaryPath, (stdfs::path(cacheDestination) / entryName).u8string())) {
+            stdfs::remove_all(temporaryPath, errorCode);
+            return false;
+        }
+        cacheIndex::recordStore(cacheDestination, entryName, size);
+        integrity::record(cacheDestination, entryName, checksums);
+
+        return true;
+    }
+
+    /**
+     * Copies an entry from one cache destination to another, e.g. from the local tier to the shared tier.
+     */
+    void copyEntry(const std::string &entryPath, const std::string &fromDestination,
+                   const std::string &toDestination) {
+        const std::string entryName = stdfs::path(entryPath).filename().u8string();
+        std::string temporaryPath;
+
+        try {
+            temporaryPath = publish::temporaryPath(toDestination, entryName);
+            trace("Copy " + entryPath + " to " + temporaryPath);
+
+            if (stdfs::is_directory(entryPath)) {
+                stdfs::create_directories(temporaryPath);
+                stdfs::copy(entryPath, temporaryPath, cacheStore::defaultCopyOptions);
+            } else if (cacheStore::isChunked(entryPath)) {
+                // chunks first, the published manifest refers to them
+                chunkStore::copyChunks(chunkStore::readManifest(entryPath), fromDestination, toDestination);
+                stdfs::copy_file(entryPath, temporaryPath);
+            } else {
+                stdfs::copy_file(entryPath, temporaryPath);
+            }
+        } catch (...) {
+            std::error_code errorCode;
+            stdfs::remove_all(temporaryPath, errorCode);
+            throw (CopyToCacheFailedException("Copy to " + toDestination + " failed", ExitCode::copyToCacheFailed));
+        }
+
+        trace("Publish " + entryName + " in " + toDestination);
+        if (!publishCopy(temporaryPath, fromDestination, toDestination, entryName))
+            trace("Cache was published by another process");
+    }
+
+    /**
+     * Chunked entries are restored from the local tier after the chunks it is missing are copied there,
+     * only the changed chunks of a new entry are read from the shared tier.
+     */
+    void restoreChunkedThrough(
+            const std::string &sharedEntryPath,
+            const std::string &sharedDestination,
+            const std::string &localDestination,
+            const std::string &cacheSource,
+            const bool &fastExtract,
+            const std::string &extractRoot
+    ) {
+        const std::string localEntryPath = (stdfs::path(localDestination) /
+                                            stdfs::path(sharedEntryPath).filename()).u8string();
+        std::string restorePath = localEntryPath;
+
+        try {
+            copyEntry(sharedEntryPath, sharedDestination, localDestination);
+        } catch (CopyToCacheFailedException &) {
+            trace("Copy to the local tier failed");
+        }
+        if (!stdfs::exists(localEntryPath))
+            restorePath = sharedEntryPath;
+
+        trace("Extract data from " + restorePath);
+        chunkStore::extract(restorePath, fastExtract, extractRoot,
+                            cacheStore::restoredTopLevel(restorePath, cacheSource));
+
+        if (cacheStore::updateAccessTime(sharedEntryPath.c_str()) != 0)
+            trace("could not update access time");
+        cacheStore::recordAccess(sharedEntryPath);
+    }
+
+    /**
+     * Restores the shared entry to cacheSource and copies it to the local tier on the way. The restore
+     * fails like a restore from the shared tier, a failing local copy is only traced.
+     */
+    void restoreThrough(
+            const std::string &sharedEntryPath,
+            const std::string &sharedDestination,
+            const std::string &localDestination,
+            const std::string &cacheSource,
+            const bool &archive,
+            const bool &fastExtract,
+            const std::string &extractRoot
+    ) {
+        const std::string entryName = stdfs::path(sharedEntryPath).filename().u8string();
+        std::string temporaryPath;
+        bool copyComplete = false;
+        std::error_code errorCode;
+
+        if (archive && cacheStore::isChunked(sharedEntryPath)) {
+            restoreChunkedThrough(sharedEntryPath, sharedDestination, localDestination, cacheSource, fastExtract,
+                                  extractRoot);
+            return;
+        }
+
+        try {
+            temporaryPath = publish::temporaryPath(localDestination, entryName);
+        } catch (...) {
+            trace("Cannot create temporary directory of the local tier, restore without copy");
+        }
+
+        if (archive) {
+            int teeFileDescriptor = temporaryPath.empty()
+                                    ? -1
+                                    : open(temporaryPath.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+            trace("Extract data from " + sharedEntryPath + " to " + cacheSource + " and copy it to " + temporaryPath);
+
+            try {
+                copyComplete = compress::extract(sharedEntryPath.c_str(), fastExtract, extractRoot, teeFileDescriptor,
+                                                 cacheStore::restoredTopLevel(sharedEntryPath, cacheSource)) == 0 &&
+                               teeFileDescriptor >= 0;
+            } catch (...) {
+                if (teeFileDescriptor >= 0)
+                    close(teeFileDescriptor);
+                stdfs::remove(temporaryPath, errorCode);
+                throw;
+            }
+            if (teeFileDescriptor >= 0 && close(teeFileDescriptor) != 0)
+                copyComplete = false;
+        } else {
+            trace("Copy data from " + sharedEntryPath + " to " + cacheSource +
+                  (temporaryPath.empty() ? "" : " and " + temporaryPath));
+
+            try {
+                copyTreeTwice(sharedEntryPath, cacheSource, temporaryPath, copyComplete);
+            } catch (...) {
+                stdfs::remove_all(temporaryPath, errorCode);
+                throw (CopyFromCacheException("Copy from cache failed", ExitCode::copyFromCacheFailed));
+            }
+        }
+
+        if (cacheStore::updateAccessTime(sharedEntryPath.c_str()) != 0)
+            trace("could not update access time");
+        cacheStore::recordAccess(sharedEntryPath);
+
+        if (!copyComplete) {
+            trace("Copy to the local tier failed");
+            stdfs::remove_all(temporaryPath, errorCode);
+            return;
+        }
+
+        if (!publishCopy(temporaryPath, sharedDestination, localDestination, entryName))
+            trace("Cache was published in the local tier by another process");
+    }
+}
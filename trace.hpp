@@ -0,0 +1,33 @@
+#pragma once //"trace.hpp"
+
+#include <iostream>
+#include <mutex>
+#include <string>
+
+bool verbose = false;
+
+// workers of the daemon and the batch mode trace concurrently, lines must not interleave
+std::mutex traceMutex;
+
+void trace(bool const &force = false) {
+    if (!force && !verbose) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(traceMutex);
+    std::cout << "\n";
+}
+
+void trace(const std::string &log, bool const &force = false) {
+    if (!force && !verbose) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(traceMutex);
+    std::cout << log << "\n";
+}
+
+// without this overload string literals would convert to bool and select trace(force)
+void trace(const char *log, bool const &force = false) {
+    trace(std::string(log), force);
+}
@@ -0,0 +1,60 @@
+#pragma once //"workerPool.hpp"
+
+#include <algorithm>
+#include <functional>
+#include <future>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include "boundedQueue.hpp"
+
+/**
+ * Fixed set of threads running submitted tasks in order of submission. submit() blocks while the queue
+ * is full, so producers cannot run arbitrarily far ahead of the I/O the tasks do.
+ */
+class WorkerPool {
+public:
+    explicit WorkerPool(unsigned int threads, size_t queueCapacity = 0)
+            : tasks(queueCapacity > 0 ? queueCapacity : 4 * std::max(threads, 1u)) {
+        for (unsigned int i = 0; i < std::max(threads, 1u); i++) {
+            workers.emplace_back([this] {
+                std::function<void()> task;
+                while (tasks.pop(task)) {
+                    task();
+                }
+            });
+        }
+    }
+
+    WorkerPool(const WorkerPool &) = delete;
+
+    WorkerPool &operator=(const WorkerPool &) = delete;
+
+    // runs the queued tasks before the threads end
+    ~WorkerPool() {
+        tasks.close();
+        for (auto &worker: workers) {
+            worker.join();
+        }
+    }
+
+    /**
+     * Queues the task, its result or exception is delivered through the future.
+     */
+    template<typename Task>
+    auto submit(Task task) -> std::future<decltype(task())> {
+        auto packagedTask = std::make_shared<std::packaged_task<decltype(task())()>>(std::move(task));
+        auto result = packagedTask->get_future();
+
+        if (!tasks.push([packagedTask] { (*packagedTask)(); })) {
+            throw std::runtime_error("Worker pool is closed");
+        }
+
+        return result;
+    }
+
+private:
+    BoundedQueue<std::function<void()>> tasks;
+    std::vector<std::thread> workers;
+};